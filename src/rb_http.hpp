@@ -0,0 +1,320 @@
+/**
+ * @file rb_http.hpp
+ * @brief Header only C++ interface of librbhttp.
+ *
+ * Handler owns a rb_http_handler_s and destroys it when it goes out of
+ * scope. Payloads are either borrowed, and must outlive their report, or
+ * moved in as std::string, and released by the library once reported.
+ * Report handlers are templates: each one gets its own C trampoline, so the
+ * handler is called directly and can be inlined. Handler registers the
+ * payload deallocator of the C handler and produces moved payloads with
+ * RB_HTTP_MESSAGE_F_MARK. Other payloads produced through native() with
+ * RB_HTTP_MESSAGE_F_FREE are released with free(), like the C handler does,
+ * so they must not use RB_HTTP_MESSAGE_F_MARK.
+ */
+#ifndef RB_HTTP_HPP
+#define RB_HTTP_HPP
+
+extern "C" {
+#include "rb_http_handler.h"
+}
+
+#include <chrono>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#if __cplusplus >= 202002L
+#include <span>
+#endif
+
+namespace rb_http {
+
+enum class Mode { normal = NORMAL_MODE, chunked = CHUNKED_MODE };
+
+enum class Framing {
+  none = RB_HTTP_FRAMING_NONE,
+  ndjson = RB_HTTP_FRAMING_NDJSON,
+  json_array = RB_HTTP_FRAMING_JSON_ARRAY,
+  length_prefix = RB_HTTP_FRAMING_LENGTH_PREFIX
+};
+
+// @brief Handler creation or option error.
+class Error : public std::runtime_error {
+public:
+  using std::runtime_error::runtime_error;
+};
+
+// @brief Result of a message, valid during the report handler call.
+struct Report {
+  int status;        // 0 if sent, curl error or RB_HTTP_ERR_* otherwise
+  long http_code;    // HTTP response code
+  const char *error; // Description of status
+  std::string_view payload; // Empty for file and callback payloads
+
+  bool ok() const { return status == 0; }
+};
+
+class Handler {
+public:
+  /**
+   * Creates a handler. Options are set before run().
+   * @param url Endpoint URL
+   */
+  explicit Handler(const std::string &url) {
+    char err[BUFSIZ] = "";
+
+    handler_ = rb_http_handler_create(url.c_str(), err, sizeof(err));
+    if (handler_ == nullptr) {
+      throw Error(err);
+    }
+    rb_http_handler_set_payload_free(handler_, &free_payload, nullptr);
+  }
+
+  Handler(const Handler &) = delete;
+  Handler &operator=(const Handler &) = delete;
+
+  Handler(Handler &&other) noexcept
+      : handler_(std::exchange(other.handler_, nullptr)) {}
+
+  Handler &operator=(Handler &&other) noexcept {
+    if (this != &other) {
+      reset();
+      handler_ = std::exchange(other.handler_, nullptr);
+    }
+    return *this;
+  }
+
+  /**
+   * Destroys the handler, sending queued messages first for up to
+   * RB_HTTP_DRAIN_TIMEOUT ms. Call flush() before to get their reports.
+   */
+  ~Handler() { reset(); }
+
+  /**
+   * Sets an option by its librbhttp name
+   * @param  key   Option name, like "RB_HTTP_CONNECTIONS"
+   * @param  value Option value
+   * @return       This handler
+   */
+  Handler &set(const char *key, const std::string &value) {
+    char err[BUFSIZ] = "";
+
+    if (rb_http_handler_set_opt(handler_, key, value.c_str(), err,
+                                sizeof(err)) != 0) {
+      throw Error(err);
+    }
+    return *this;
+  }
+
+  Handler &set(const char *key, long value) {
+    return set(key, std::to_string(value));
+  }
+
+  Handler &set(const char *key, std::chrono::milliseconds value) {
+    return set(key, static_cast<long>(value.count()));
+  }
+
+  Handler &mode(Mode value) {
+    return set("RB_HTTP_MODE", static_cast<long>(value));
+  }
+  Handler &framing(Framing value) {
+    return set("RB_HTTP_FRAMING", static_cast<long>(value));
+  }
+  Handler &connections(int value) {
+    return set("RB_HTTP_CONNECTIONS", static_cast<long>(value));
+  }
+  Handler &max_messages(int value) {
+    return set("RB_HTTP_MAX_MESSAGES", static_cast<long>(value));
+  }
+  Handler &max_bytes(long value) { return set("RB_HTTP_MAX_BYTES", value); }
+  Handler &max_bytes_per_sec(long value, long burst = 0) {
+    return set("RB_HTTP_MAX_BYTES_PER_SEC", value)
+        .set("RB_HTTP_BYTES_BURST", burst);
+  }
+  Handler &max_requests_per_sec(long value, long burst = 0) {
+    return set("RB_HTTP_MAX_REQUESTS_PER_SEC", value)
+        .set("RB_HTTP_REQUESTS_BURST", burst);
+  }
+  Handler &batch_timeout(std::chrono::milliseconds value) {
+    return set("RB_HTTP_BATCH_TIMEOUT", value);
+  }
+  Handler &message_ttl(std::chrono::milliseconds value) {
+    return set("RB_HTTP_MESSAGE_TTL", value);
+  }
+  Handler &timeout(std::chrono::milliseconds value) {
+    return set("HTTP_TIMEOUT", value);
+  }
+  Handler &connect_timeout(std::chrono::milliseconds value) {
+    return set("HTTP_CONNTTIMEOUT", value);
+  }
+  Handler &unix_socket(const std::string &path) {
+    return set("HTTP_UNIX_SOCKET_PATH", path);
+  }
+
+  Handler &prewarm(bool value) {
+    return set("RB_HTTP_PREWARM", static_cast<long>(value));
+  }
+
+  /**
+   * Makes a runtime send the messages of this handler, instead of a thread
+   * of its own. The runtime must outlive the handler.
+   * @param  value Runtime from rb_http_runtime_create()
+   * @return       This handler
+   */
+  Handler &runtime(struct rb_http_runtime_s *value) {
+    char err[BUFSIZ] = "";
+
+    if (rb_http_handler_set_runtime(handler_, value, err, sizeof(err)) != 0) {
+      throw Error(err);
+    }
+    return *this;
+  }
+
+  // Starts sending messages
+  void run() { rb_http_handler_run(handler_); }
+
+  /**
+   * Waits for the connections opened by RB_HTTP_PREWARM
+   * @param  timeout Max wait
+   * @return         Connections ready
+   */
+  int wait_ready(std::chrono::milliseconds timeout) {
+    return rb_http_handler_wait_ready(handler_,
+                                      static_cast<int>(timeout.count()));
+  }
+
+  /**
+   * Produces a payload the library takes ownership of. It is moved, never
+   * copied, and released once reported.
+   * @param  payload Payload. Left untouched if the message is not queued.
+   * @param  flags   RB_HTTP_MESSAGE_F_PRIORITY or 0
+   * @return         true if queued, false if the queue or budget is full
+   */
+  bool produce(std::string &&payload, int flags = 0) {
+    char err[BUFSIZ];
+    auto *owned = new std::string(std::move(payload));
+
+    if (rb_http_produce(handler_, &(*owned)[0], owned->size(),
+                        RB_HTTP_MESSAGE_F_FREE | RB_HTTP_MESSAGE_F_MARK |
+                            (flags & RB_HTTP_MESSAGE_F_PRIORITY),
+                        err, sizeof(err), owned) != 0) {
+      payload = std::move(*owned);
+      delete owned;
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * Produces a borrowed payload, that must outlive its report
+   * @param  payload Payload
+   * @param  len     Length of the payload
+   * @param  flags   RB_HTTP_MESSAGE_F_PRIORITY, RB_HTTP_MESSAGE_F_COPY to
+   * queue a copy, or 0
+   * @return         true if queued, false if the queue or budget is full
+   */
+  bool produce(const char *payload, size_t len, int flags = 0) {
+    char err[BUFSIZ];
+
+    return rb_http_produce(
+               handler_, const_cast<char *>(payload), len,
+               flags & (RB_HTTP_MESSAGE_F_PRIORITY | RB_HTTP_MESSAGE_F_COPY),
+               err, sizeof(err), nullptr) == 0;
+  }
+
+#if __cplusplus >= 202002L
+  bool produce(std::span<const char> payload, int flags = 0) {
+    return produce(payload.data(), payload.size(), flags);
+  }
+#endif
+
+  /**
+   * Calls fn with the reports available, waiting up to timeout for them
+   * @param  fn      Called as fn(const Report &) on this thread
+   * @param  timeout Max wait if there are no reports
+   * @return         Messages not reported yet
+   */
+  template <class F>
+  int get_reports(F &&fn, std::chrono::milliseconds timeout) {
+    Batch<F> batch(fn);
+
+    return rb_http_get_reports(handler_, &trampoline<F>,
+                               static_cast<int>(timeout.count()));
+  }
+
+  /**
+   * Waits until every message produced has been reported, calling fn with
+   * the reports
+   * @param  fn      Called as fn(const Report &) on this thread
+   * @param  timeout Max wait
+   * @return         Messages not reported yet
+   */
+  template <class F> int flush(F &&fn, std::chrono::milliseconds timeout) {
+    Batch<F> batch(fn);
+
+    return rb_http_flush(handler_, &trampoline<F>,
+                         static_cast<int>(timeout.count()));
+  }
+
+  // Handler for the parts of the C API not wrapped here
+  struct rb_http_handler_s *native() const { return handler_; }
+
+private:
+  /**
+   * Makes a report handler reachable from its trampoline for the duration
+   * of one rb_http_get_reports() or rb_http_flush() call
+   */
+  template <class F> struct Batch {
+    explicit Batch(F &fn) : prev(current) { current = &fn; }
+    ~Batch() { current = prev; }
+
+    using Fn = typename std::remove_reference<F>::type;
+    static thread_local Fn *current;
+    Fn *prev;
+  };
+
+  template <class F>
+  static void trampoline(struct rb_http_handler_s *, int status_code,
+                         long http_code, const char *status_code_str,
+                         char *buff, size_t bufsiz, void *opaque) {
+    const Report report{status_code, http_code, status_code_str,
+                        std::string_view(buff, buff != nullptr ? bufsiz : 0)};
+
+    (void)opaque;
+    (*Batch<F>::current)(report);
+  }
+
+  /**
+   * Releases a payload moved in with produce(), marked and held by the
+   * std::string of its opaque. Any other payload is released with free().
+   */
+  static void free_payload(struct rb_http_handler_s *, char *payload, size_t,
+                           int marked, void *message_opaque, void *) {
+    if (marked) {
+      delete static_cast<std::string *>(message_opaque);
+    } else {
+      free(payload);
+    }
+  }
+
+  void reset() {
+    if (handler_ != nullptr) {
+      rb_http_handler_destroy(handler_, nullptr, 0);
+      handler_ = nullptr;
+    }
+  }
+
+  struct rb_http_handler_s *handler_ = nullptr;
+};
+
+template <class F>
+thread_local typename Handler::Batch<F>::Fn *Handler::Batch<F>::current =
+    nullptr;
+
+} // namespace rb_http
+
+#endif
@@ -0,0 +1,234 @@
+/**
+ * @file rb_http_adaptive.c
+ * @brief Adaptive batch size and batch timeout for CHUNKED_MODE, and
+ * adaptive limit of in-flight requests.
+ *
+ * The batch timeout follows the collector response latency, so the time
+ * spent waiting for responses stays small compared to the time spent
+ * streaming data. The batch size follows the arrival rate during that
+ * timeout, and shrinks when POSTs fail so fewer messages are affected by
+ * each error.
+ *
+ * The in-flight requests limit follows an AIMD scheme: it grows by one
+ * request every window of successful requests whose latency stays close to
+ * the long term average, and it is cut when latency rises or the collector
+ * answers 429/503.
+ */
+#include "../config.h"
+#include "rb_http_adaptive.h"
+
+#include <math.h>
+
+// Weight of the new sample on the moving averages
+#define ADAPTIVE_ALPHA 0.2
+// Batch timeout in units of response latency
+#define ADAPTIVE_LATENCY_FACTOR 4
+// Latency over the long term average that is considered congestion
+#define LIMIT_LATENCY_TOLERANCE 2.0
+// Latency jitter (ms) that is never considered congestion
+#define LIMIT_LATENCY_SLACK 10
+// Weight of the new sample on the long term latency average
+#define LIMIT_BASE_ALPHA 0.01
+// Factor applied to the limit on congestion
+#define LIMIT_BACKOFF 0.5
+
+// The upper bound wins if the bounds cross
+static long clamp_long(long val, long min, long max) {
+  if (val > max)
+    return max;
+  if (val < min)
+    return min;
+  return val;
+}
+
+long rb_http_now_ms(void) {
+  struct timespec spec;
+
+  clock_gettime(CLOCK_MONOTONIC, &spec);
+  return spec.tv_sec * 1000 + spec.tv_nsec / (1000 * 1000);
+}
+
+static double ewma(double avg, double sample) {
+  return avg + ADAPTIVE_ALPHA * (sample - avg);
+}
+
+void rb_http_adaptive_init(struct rb_http_adaptive_s *adaptive,
+                           const struct rb_http_options_s *options, long now) {
+  memset(adaptive, 0, sizeof(*adaptive));
+
+  adaptive->last_update = now;
+  rb_http_adaptive_configure(adaptive, options);
+}
+
+void rb_http_adaptive_configure(struct rb_http_adaptive_s *adaptive,
+                                const struct rb_http_options_s *options) {
+  if (!options->adaptive_batch) {
+    adaptive->batch_messages = options->max_batch_messages;
+    adaptive->batch_timeout = options->max_post_duration;
+    return;
+  }
+
+  adaptive->batch_messages =
+      (int)clamp_long(adaptive->batch_messages, options->min_batch_messages,
+                      options->max_batch_messages);
+  adaptive->batch_timeout =
+      clamp_long(adaptive->batch_timeout, options->min_batch_timeout,
+                 options->max_batch_timeout);
+  if (options->max_post_duration > 0 &&
+      adaptive->batch_timeout > options->max_post_duration) {
+    adaptive->batch_timeout = options->max_post_duration;
+  }
+}
+
+void rb_http_adaptive_update(struct rb_http_adaptive_s *adaptive,
+                             const struct rb_http_options_s *options,
+                             int messages, int backlog, long response,
+                             int error, long now) {
+  long elapsed = now - adaptive->last_update;
+  long batch_timeout = 0;
+  double batch_messages = 0;
+
+  if (!options->adaptive_batch) {
+    return;
+  }
+
+  if (elapsed < 1) {
+    elapsed = 1;
+  }
+
+  // Messages that arrived since last update. The backlog is counted too so
+  // the batch grows when the thread can't keep up
+  adaptive->rate = ewma(adaptive->rate, (double)(messages + backlog) / elapsed);
+  adaptive->latency = ewma(adaptive->latency, (double)response);
+  adaptive->errors = ewma(adaptive->errors, error ? 1.0 : 0.0);
+  adaptive->last_update = now;
+
+  batch_timeout = clamp_long((long)(ADAPTIVE_LATENCY_FACTOR * adaptive->latency),
+                             options->min_batch_timeout,
+                             options->max_batch_timeout);
+  if (options->max_post_duration > 0 &&
+      batch_timeout > options->max_post_duration) {
+    batch_timeout = options->max_post_duration;
+  }
+
+  batch_messages = adaptive->rate * batch_timeout * (1.0 - adaptive->errors);
+
+  adaptive->batch_timeout = batch_timeout;
+  adaptive->batch_messages =
+      (int)clamp_long((long)ceil(batch_messages), options->min_batch_messages,
+                      options->max_batch_messages);
+}
+
+void rb_http_limit_init(struct rb_http_limit_s *limit,
+                        const struct rb_http_options_s *options) {
+  memset(limit, 0, sizeof(*limit));
+
+  pthread_mutex_init(&limit->lock, NULL);
+  pthread_cond_init(&limit->cond, NULL);
+
+  limit->limit = options->adaptive_connections ? options->min_connections
+                                               : options->connections;
+  rb_http_limit_configure(limit, options);
+}
+
+void rb_http_limit_configure(struct rb_http_limit_s *limit,
+                             const struct rb_http_options_s *options) {
+  pthread_mutex_lock(&limit->lock);
+
+  limit->adaptive = options->adaptive_connections;
+  limit->max = options->connections;
+  limit->min = limit->adaptive ? options->min_connections : limit->max;
+  limit->limit = (int)clamp_long(limit->limit, limit->min, limit->max);
+
+  pthread_cond_broadcast(&limit->cond);
+  pthread_mutex_unlock(&limit->lock);
+}
+
+void rb_http_limit_destroy(struct rb_http_limit_s *limit) {
+  pthread_cond_destroy(&limit->cond);
+  pthread_mutex_destroy(&limit->lock);
+}
+
+int rb_http_limit_acquire(struct rb_http_limit_s *limit, int timeout_ms) {
+  struct timespec deadline;
+  int acquired = 0;
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += (timeout_ms % 1000) * 1000 * 1000;
+  if (deadline.tv_nsec >= 1000 * 1000 * 1000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000 * 1000 * 1000;
+  }
+
+  pthread_mutex_lock(&limit->lock);
+  while (limit->in_flight >= limit->limit) {
+    if (pthread_cond_timedwait(&limit->cond, &limit->lock, &deadline) ==
+        ETIMEDOUT) {
+      break;
+    }
+  }
+
+  if (limit->in_flight < limit->limit) {
+    limit->in_flight++;
+    acquired = 1;
+  }
+  pthread_mutex_unlock(&limit->lock);
+
+  return acquired;
+}
+
+void rb_http_limit_release(struct rb_http_limit_s *limit) {
+  pthread_mutex_lock(&limit->lock);
+  limit->in_flight--;
+  pthread_cond_signal(&limit->cond);
+  pthread_mutex_unlock(&limit->lock);
+}
+
+int rb_http_limit_update(struct rb_http_limit_s *limit, long latency,
+                         long http_code, long now) {
+  int congested = 0;
+  int new_limit = 0;
+
+  pthread_mutex_lock(&limit->lock);
+
+  if (limit->samples++ == 0) {
+    limit->latency = limit->base_latency = (double)latency;
+  } else {
+    limit->latency = ewma(limit->latency, (double)latency);
+    limit->base_latency +=
+        LIMIT_BASE_ALPHA * ((double)latency - limit->base_latency);
+  }
+
+  if (!limit->adaptive) {
+    new_limit = limit->limit;
+    pthread_mutex_unlock(&limit->lock);
+    return new_limit;
+  }
+
+  congested = http_code == 429 || http_code == 503 ||
+              limit->latency > LIMIT_LATENCY_TOLERANCE * limit->base_latency +
+                                   LIMIT_LATENCY_SLACK;
+
+  if (congested) {
+    // Requests started before the last decrease will see the same
+    // congestion. Decrease only once per latency window.
+    if (now - limit->last_decrease > (long)limit->latency) {
+      limit->limit = (int)clamp_long((long)(limit->limit * LIMIT_BACKOFF),
+                                     limit->min, limit->max);
+      limit->last_decrease = now;
+      limit->decreases++;
+    }
+    limit->successes = 0;
+  } else if (++limit->successes >= limit->limit) {
+    limit->limit = (int)clamp_long(limit->limit + 1, limit->min, limit->max);
+    limit->successes = 0;
+    limit->increases++;
+    pthread_cond_broadcast(&limit->cond);
+  }
+
+  new_limit = limit->limit;
+  pthread_mutex_unlock(&limit->lock);
+
+  return new_limit;
+}
@@ -0,0 +1,92 @@
+#include "rb_http_handler.h"
+
+/**
+ * Returns the current time in milliseconds from a monotonic clock. Only
+ * differences between two values are meaningful.
+ */
+long rb_http_now_ms(void);
+
+/**
+ * Initializes the batch controller of a thread with the configured limits
+ * @param adaptive Controller to initialize
+ * @param options  Handler options
+ * @param now      Current time in milliseconds
+ */
+void rb_http_adaptive_init(struct rb_http_adaptive_s *adaptive,
+                           const struct rb_http_options_s *options, long now);
+
+/**
+ * Applies new options to the batch controller of a thread. The current batch
+ * limits are kept if they are inside the new bounds.
+ * @param adaptive Controller to update
+ * @param options  New handler options
+ */
+void rb_http_adaptive_configure(struct rb_http_adaptive_s *adaptive,
+                                const struct rb_http_options_s *options);
+
+/**
+ * Feeds the controller with the result of a POST and computes the batch size
+ * and timeout for the next one. Does nothing if RB_HTTP_ADAPTIVE_BATCH is not
+ * set.
+ * @param adaptive Controller to update
+ * @param options  Handler options
+ * @param messages Messages sent on the POST
+ * @param backlog  Messages still waiting on the thread queue
+ * @param response Time (ms) between the end of the upload and the response
+ * @param error    1 if the POST failed
+ * @param now      Current time in milliseconds
+ */
+void rb_http_adaptive_update(struct rb_http_adaptive_s *adaptive,
+                             const struct rb_http_options_s *options,
+                             int messages, int backlog, long response,
+                             int error, long now);
+
+/**
+ * Initializes the in-flight requests limit
+ * @param limit   Limit to initialize
+ * @param options Handler options
+ */
+void rb_http_limit_init(struct rb_http_limit_s *limit,
+                        const struct rb_http_options_s *options);
+
+/**
+ * Applies new options to the in-flight requests limit
+ * @param limit   Limit to update
+ * @param options New handler options
+ */
+void rb_http_limit_configure(struct rb_http_limit_s *limit,
+                             const struct rb_http_options_s *options);
+
+/**
+ * Destroys the in-flight requests limit
+ * @param limit Limit to destroy
+ */
+void rb_http_limit_destroy(struct rb_http_limit_s *limit);
+
+/**
+ * Waits until a new request is allowed by the limit
+ * @param  limit      Limit to check
+ * @param  timeout_ms Max time to wait
+ * @return            1 if the request can be started, 0 on timeout
+ */
+int rb_http_limit_acquire(struct rb_http_limit_s *limit, int timeout_ms);
+
+/**
+ * Feeds the limit with the result of a request. The limit grows by one every
+ * full window of requests with stable latency, and decreases multiplicatively
+ * if latency rises over its long term average or the server answers 429 or
+ * 503.
+ * @param  limit     Limit to update
+ * @param  latency   Response latency (ms)
+ * @param  http_code HTTP response code
+ * @param  now       Current time in milliseconds
+ * @return           New limit
+ */
+int rb_http_limit_update(struct rb_http_limit_s *limit, long latency,
+                         long http_code, long now);
+
+/**
+ * Releases a request acquired with rb_http_limit_acquire()
+ * @param limit Limit to release
+ */
+void rb_http_limit_release(struct rb_http_limit_s *limit);
@@ -0,0 +1,109 @@
+/**
+ * @file rb_http_bench.cpp
+ * @brief Compares the report path of the C API with the C++ wrapper.
+ *
+ * Both sides queue the same borrowed messages, with a 1ms TTL, to an
+ * endpoint that refuses the connection, and wait until all of them have
+ * been reported as expired. Only the drain of that prefilled report queue
+ * is timed, once through a C callback and once through the trampoline of a
+ * C++ report handler, so the HTTP round trips are left out.
+ * Usage: bench [messages]
+ */
+#include "rb_http.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+#define URL "http://127.0.0.1:1"
+#define N_MESSAGE 100000
+
+using bench_clock = std::chrono::steady_clock;
+
+static const char payload[] = "{\"bench\":1}";
+
+static long c_reported = 0;
+
+static void c_callback(struct rb_http_handler_s *rb_http_handler,
+                       int status_code, long http_status,
+                       const char *status_code_str, char *buff, size_t bufsiz,
+                       void *opaque) {
+  (void)rb_http_handler;
+  (void)status_code;
+  (void)http_status;
+  (void)status_code_str;
+  (void)buff;
+  (void)bufsiz;
+  (void)opaque;
+
+  c_reported++;
+}
+
+/**
+ * Queues messages that expire right away and waits until all of them are
+ * reported, without taking the reports
+ * @return Messages whose report is queued
+ */
+static long prefill(struct rb_http_handler_s *handler, long messages) {
+  char err[BUFSIZ];
+  long produced = 0;
+
+  rb_http_handler_set_opt(handler, "RB_HTTP_MODE", "1", NULL, 0);
+  rb_http_handler_set_opt(handler, "RB_HTTP_MAX_MESSAGES", "1000000", NULL,
+                          0);
+  rb_http_handler_set_opt(handler, "RB_HTTP_MESSAGE_TTL", "1", NULL, 0);
+  rb_http_handler_run(handler);
+
+  for (produced = 0; produced < messages; produced++) {
+    if (rb_http_produce(handler, (char *)payload, sizeof(payload) - 1, 0, err,
+                        sizeof(err), NULL) != 0) {
+      break;
+    }
+  }
+  rb_http_flush(handler, NULL, 60000);
+
+  return produced;
+}
+
+static void print_result(const char *api, long messages, long reported,
+                         bench_clock::duration drain) {
+  const double drain_ns =
+      std::chrono::duration<double, std::nano>(drain).count();
+
+  printf("%-4s %ld messages, %ld reported: %.1f ns/report\n", api, messages,
+         reported, drain_ns / (double)reported);
+}
+
+static void bench_c(long messages) {
+  struct rb_http_handler_s *handler = rb_http_handler_create(URL, NULL, 0);
+  const long produced = prefill(handler, messages);
+
+  const bench_clock::time_point start = bench_clock::now();
+  rb_http_get_reports(handler, c_callback, 0);
+  const bench_clock::time_point end = bench_clock::now();
+
+  print_result("C", produced, c_reported, end - start);
+  rb_http_handler_destroy(handler, NULL, 0);
+}
+
+static void bench_cpp(long messages) {
+  rb_http::Handler handler(URL);
+  long reported = 0;
+  auto on_report = [&reported](const rb_http::Report &) { reported++; };
+  const long produced = prefill(handler.native(), messages);
+
+  const bench_clock::time_point start = bench_clock::now();
+  handler.get_reports(on_report, std::chrono::milliseconds(0));
+  const bench_clock::time_point end = bench_clock::now();
+
+  print_result("C++", produced, reported, end - start);
+}
+
+int main(int argc, char **argv) {
+  const long messages = argc > 1 ? atol(argv[1]) : N_MESSAGE;
+
+  bench_c(messages);
+  bench_cpp(messages);
+
+  return 0;
+}
@@ -0,0 +1,31 @@
+/**
+ * @file rb_http_budget.c
+ * @brief Memory budget of a handler.
+ *
+ * Queued messages are charged their descriptor, plus the payload when the
+ * library owns it (RB_HTTP_MESSAGE_F_COPY or RB_HTTP_MESSAGE_F_FREE), until
+ * they are reported. Messages that would exceed RB_HTTP_MAX_BYTES are
+ * rejected. Compression and response buffers of the connection threads are
+ * charged too, but never refused, so they only hold back new messages.
+ */
+#include "../config.h"
+#include "rb_http_budget.h"
+
+int rb_http_budget_charge(struct rb_http_handler_s *rb_http_handler,
+                          size_t bytes, int force) {
+  const long max_bytes = ATOMIC_OP(add, fetch, &rb_http_handler->max_bytes, 0);
+  const uint64_t used =
+      ATOMIC_OP64(add, fetch, &rb_http_handler->bytes, (uint64_t)bytes);
+
+  if (!force && max_bytes > 0 && used > (uint64_t)max_bytes) {
+    ATOMIC_OP64(sub, fetch, &rb_http_handler->bytes, (uint64_t)bytes);
+    return 0;
+  }
+
+  return 1;
+}
+
+void rb_http_budget_release(struct rb_http_handler_s *rb_http_handler,
+                            size_t bytes) {
+  ATOMIC_OP64(sub, fetch, &rb_http_handler->bytes, (uint64_t)bytes);
+}
@@ -0,0 +1,20 @@
+#include "rb_http_handler.h"
+
+/**
+ * Charges memory to the budget of a handler
+ * @param  rb_http_handler Handler
+ * @param  bytes           Bytes to charge
+ * @param  force           Charge even if the budget is exceeded, for memory
+ * that is needed to send the messages already queued
+ * @return                 1 if charged, 0 if it would exceed RB_HTTP_MAX_BYTES
+ */
+int rb_http_budget_charge(struct rb_http_handler_s *rb_http_handler,
+                          size_t bytes, int force);
+
+/**
+ * Returns memory charged with rb_http_budget_charge()
+ * @param rb_http_handler Handler
+ * @param bytes           Bytes to return
+ */
+void rb_http_budget_release(struct rb_http_handler_s *rb_http_handler,
+                            size_t bytes);
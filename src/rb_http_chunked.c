@@ -1,69 +1,449 @@
 #include "../config.h"
+#include "rb_http_adaptive.h"
+#include "rb_http_budget.h"
 #include "rb_http_chunked.h"
+#include "rb_http_fanout.h"
+#include "rb_http_lanes.h"
+#include "rb_http_options.h"
+#include "rb_http_payload.h"
+#include "rb_http_ratelimit.h"
+#include "rb_http_reports.h"
+#include "rb_http_timer.h"
+#include "rb_http_trace.h"
+#include "rb_http_warm.h"
 
 #include <math.h>
 
+static void batch_timer_cb(void *opaque) {
+  struct rb_http_threaddata_s *rb_http_threaddata =
+      (struct rb_http_threaddata_s *)opaque;
+
+  rb_http_threaddata->batch_expired = 1;
+}
+
+static void flush_timer_cb(void *opaque) {
+  struct rb_http_threaddata_s *rb_http_threaddata =
+      (struct rb_http_threaddata_s *)opaque;
+
+  rb_http_threaddata->flush_expired = 1;
+}
+
+/**
+ * The wait after a failed POST is over. Messages that expired meanwhile are
+ * reported instead of being sent.
+ */
+static void retry_timer_cb(void *opaque) {
+  struct rb_http_threaddata_s *rb_http_threaddata =
+      (struct rb_http_threaddata_s *)opaque;
+  rb_http_msg_q_t expired;
+
+  rb_http_msg_q_init(&expired);
+  rb_http_lanes_expire(&rb_http_threaddata->lanes,
+                       rb_http_threaddata->timers.now, &expired);
+  rb_http_lanes_report_expired(rb_http_threaddata->rb_http_handler, &expired);
+}
+
+/**
+ * Takes messages from the most loaded thread. Only messages without
+ * partitioning key are taken, from the tail of the queue, up to half of the
+ * queue and no more than a batch. Threads waiting to retry don't steal.
+ * @param  rb_http_threaddata Idle thread
+ * @return                    Number of messages taken
+ */
+static int chunked_thread_steal(struct rb_http_threaddata_s *rb_http_threaddata) {
+  struct rb_http_handler_s *rb_http_handler =
+      rb_http_threaddata->rb_http_handler;
+  struct rb_http_threaddata_s *victim = NULL;
+  int victim_cnt = 0;
+  int stolen = 0;
+  int cnt = 0;
+  int i = 0;
+
+  // A thread backing off after a failed POST would only delay the messages,
+  // and keep them away from the expiry checks of their current thread
+  if (rb_http_timer_pending(&rb_http_threaddata->retry_timer)) {
+    return 0;
+  }
+
+  // Threads are not reaped while the lock is held
+  pthread_mutex_lock(&rb_http_handler->options_lock);
+
+  if (rb_http_handler->options->work_stealing &&
+      rb_http_threaddata->id < rb_http_handler->options->connections) {
+    for (i = 0; i < rb_http_handler->nthreads; i++) {
+      if (rb_http_handler->threads[i] == NULL ||
+          rb_http_handler->threads[i] == rb_http_threaddata) {
+        continue;
+      }
+
+      cnt = rb_http_lanes_cnt(&rb_http_handler->threads[i]->lanes);
+      if (cnt > victim_cnt) {
+        victim = rb_http_handler->threads[i];
+        victim_cnt = cnt;
+      }
+    }
+
+    if (victim != NULL && victim_cnt / 2 > 0) {
+      stolen = rb_http_lanes_steal(&victim->lanes, &rb_http_threaddata->lanes,
+                                   rb_http_threaddata->adaptive.batch_messages);
+    }
+  }
+
+  pthread_mutex_unlock(&rb_http_handler->options_lock);
+
+  if (stolen > 0) {
+    ATOMIC_OP64(add, fetch, &rb_http_threaddata->steals, 1);
+    ATOMIC_OP64(add, fetch, &rb_http_threaddata->stolen, (uint64_t)stolen);
+  }
+
+  return stolen;
+}
+
+/**
+ * Checks if the POST in progress has reached any of the batch limits
+ * @param  rb_http_threaddata Thread owning the POST
+ * @return                    1 if no more messages should be added to the POST
+ */
+static int batch_full(const struct rb_http_threaddata_s *rb_http_threaddata) {
+  const struct rb_http_options_s *options = rb_http_threaddata->options;
+
+  const struct rb_http_adaptive_s *adaptive = &rb_http_threaddata->adaptive;
+
+  if (rb_http_threaddata->current_messages >= adaptive->batch_messages) {
+    return 1;
+  }
+
+  if (options->max_batch_bytes > 0 &&
+      rb_http_threaddata->current_bytes >= (size_t)options->max_batch_bytes) {
+    return 1;
+  }
+
+  if (rb_http_threaddata->strm != NULL &&
+      options->max_batch_compressed_bytes > 0 &&
+      rb_http_threaddata->strm->total_out >=
+          (uLong)options->max_batch_compressed_bytes) {
+    return 1;
+  }
+
+  if (rb_http_threaddata->batch_expired) {
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * Gets the next message for the POST in progress. A message that didn't fit
+ * on the previous POST has priority over the queue. Expired messages are
+ * reported and skipped. If the queue is empty it waits for messages until
+ * the next timer of the thread, so batches are closed at their deadline.
+ * With work stealing it looks for work on other threads every steal interval
+ * meanwhile, but still waits up to 500ms before giving up on the POST.
+ * @param  rb_http_threaddata Thread owning the POST
+ * @return                    Next message or NULL if queue is empty
+ */
+static struct rb_http_message_s *
+batch_next_message(struct rb_http_threaddata_s *rb_http_threaddata) {
+  struct rb_http_message_s *message = NULL;
+  long now = rb_http_threaddata->timers.now;
+  const long idle_since = now;
+  long wait_ms = 0;
+  rb_http_msg_q_t expired;
+
+  rb_http_msg_q_init(&expired);
+
+  if (rb_http_threaddata->message_next != NULL) {
+    message = rb_http_threaddata->message_next;
+    rb_http_threaddata->message_next = NULL;
+    if (!rb_http_msg_expired(message, now)) {
+      return message;
+    }
+    rb_http_msg_q_add(&expired, message);
+  }
+
+  while (1) {
+    message = rb_http_lanes_pop(&rb_http_threaddata->lanes,
+                                rb_http_threaddata->options->priority_weight, 0);
+
+    // Look for work on other threads before waiting, but not too often
+    if (message == NULL && rb_http_msg_q_empty(&expired) &&
+        rb_http_threaddata->options->work_stealing &&
+        now - rb_http_threaddata->steal_checked >= DEFAULT_STEAL_INTERVAL) {
+      rb_http_threaddata->steal_checked = now;
+      if (chunked_thread_steal(rb_http_threaddata) > 0) {
+        continue;
+      }
+    }
+
+    // Only wait if there is nothing to report, and only until a timer needs
+    // attention. The clock is read only after waiting.
+    if (message == NULL && rb_http_msg_q_empty(&expired) &&
+        ATOMIC_OP(add, fetch,
+                  &rb_http_threaddata->rb_http_handler->flushing, 0) == 0) {
+      wait_ms = 500 - (now - idle_since);
+      if (rb_http_threaddata->options->work_stealing &&
+          wait_ms > DEFAULT_STEAL_INTERVAL) {
+        wait_ms = DEFAULT_STEAL_INTERVAL;
+      }
+      wait_ms = rb_http_timer_wheel_next(&rb_http_threaddata->timers, wait_ms);
+      if (wait_ms > 0) {
+        message = rb_http_lanes_pop(
+            &rb_http_threaddata->lanes,
+            rb_http_threaddata->options->priority_weight, (int)wait_ms);
+      }
+      rb_http_timer_wheel_advance(&rb_http_threaddata->timers,
+                                  rb_http_now_ms());
+      now = rb_http_threaddata->timers.now;
+
+      // A quiet steal interval does not end the POST: look for work again
+      // until a timer closes the chunk or batch, or 500ms have passed
+      if (message == NULL && !rb_http_threaddata->batch_expired &&
+          !rb_http_threaddata->flush_expired && now - idle_since < 500) {
+        continue;
+      }
+    }
+
+    if (message == NULL || !rb_http_msg_expired(message, now)) {
+      break;
+    }
+    rb_http_msg_q_add(&expired, message);
+  }
+
+  if (message != NULL) {
+    RB_HTTP_TRACE(rb_http_threaddata->rb_http_handler, RB_HTTP_TRACE_DEQUEUE,
+                  dequeue, rb_http_threaddata->id, (uintptr_t)message,
+                  now - message->produced);
+    rb_http_lanes_dequeued(rb_http_threaddata->rb_http_handler, message, now);
+  }
+
+  rb_http_lanes_report_expired(rb_http_threaddata->rb_http_handler, &expired);
+
+  return message;
+}
+
+void rb_http_chunked_frame_message(
+    struct rb_http_threaddata_s *rb_http_threaddata,
+    struct rb_http_message_s *message) {
+  uint32_t len = (uint32_t)message->len;
+
+  rb_http_threaddata->frame_head_len = 0;
+  rb_http_threaddata->frame_tail_len = 0;
+
+  switch (rb_http_threaddata->options->framing) {
+  case RB_HTTP_FRAMING_NDJSON:
+    rb_http_threaddata->frame_tail[0] = '\n';
+    rb_http_threaddata->frame_tail_len = 1;
+    break;
+  case RB_HTTP_FRAMING_JSON_ARRAY:
+    rb_http_threaddata->frame_head[0] =
+        rb_http_threaddata->current_messages == 0 ? '[' : ',';
+    rb_http_threaddata->frame_head_len = 1;
+    break;
+  case RB_HTTP_FRAMING_LENGTH_PREFIX:
+    rb_http_threaddata->frame_head[0] = (char)(len >> 24);
+    rb_http_threaddata->frame_head[1] = (char)(len >> 16);
+    rb_http_threaddata->frame_head[2] = (char)(len >> 8);
+    rb_http_threaddata->frame_head[3] = (char)len;
+    rb_http_threaddata->frame_head_len = 4;
+    break;
+  default:
+    break;
+  }
+
+  message->read = 0;
+  rb_http_threaddata->message_left = message;
+  rb_http_threaddata->frame_part = RB_HTTP_FRAME_HEAD;
+}
+
+/**
+ * Sets the next piece of the payload being compressed as deflate input.
+ * Payloads in memory are a single piece. Other sources are read into the
+ * payload buffer of the thread.
+ * @param  rb_http_threaddata Thread owning the POST
+ * @param  message            Message being compressed
+ * @return                    0 if ok, -1 if the source failed
+ */
+static int
+chunked_payload_input(struct rb_http_threaddata_s *rb_http_threaddata,
+                      struct rb_http_message_s *message) {
+  z_stream *strm = rb_http_threaddata->strm;
+  ssize_t ret = 0;
+
+  if (message->source == RB_HTTP_SOURCE_MEMORY ||
+      message->source == RB_HTTP_SOURCE_MMAP) {
+    strm->next_in = (Bytef *)message->payload + message->read;
+    strm->avail_in = message->len - message->read;
+    message->read = message->len;
+    return 0;
+  }
+
+  if (rb_http_threaddata->payload_buf == NULL) {
+    rb_http_budget_charge(rb_http_threaddata->rb_http_handler,
+                          RB_HTTP_PAYLOAD_BUF, 1);
+    rb_http_threaddata->payload_buf = malloc(RB_HTTP_PAYLOAD_BUF);
+  }
+
+  ret = rb_http_payload_read(message, rb_http_threaddata->payload_buf,
+                             RB_HTTP_PAYLOAD_BUF, message->read);
+  if (ret < 0) {
+    return -1;
+  }
+
+  strm->next_in = (Bytef *)rb_http_threaddata->payload_buf;
+  strm->avail_in = (uInt)ret;
+  message->read += (size_t)ret;
+
+  return 0;
+}
+
+size_t rb_http_chunked_compress_message(
+    struct rb_http_threaddata_s *rb_http_threaddata, char *ptr, size_t nmemb,
+    size_t writed) {
+  z_stream *strm = rb_http_threaddata->strm;
+  struct rb_http_message_s *message = rb_http_threaddata->message_left;
+  int last = RB_HTTP_FRAME_PAYLOAD;
+  int partial = 0;
+  uInt avail_in = 0;
+
+  if (rb_http_threaddata->frame_tail_len > 0) {
+    last = RB_HTTP_FRAME_TAIL;
+  }
+
+  while (rb_http_threaddata->frame_part <= last) {
+    // Start the next part, unless the previous call didn't finish it
+    if (strm->avail_in == 0) {
+      if (rb_http_threaddata->frame_part == RB_HTTP_FRAME_HEAD) {
+        strm->next_in = (Bytef *)rb_http_threaddata->frame_head;
+        strm->avail_in = rb_http_threaddata->frame_head_len;
+      } else if (rb_http_threaddata->frame_part == RB_HTTP_FRAME_PAYLOAD) {
+        if (chunked_payload_input(rb_http_threaddata, message) != 0) {
+          rb_http_threaddata->payload_failed = 1;
+          return writed;
+        }
+      } else {
+        strm->next_in = (Bytef *)rb_http_threaddata->frame_tail;
+        strm->avail_in = rb_http_threaddata->frame_tail_len;
+      }
+
+      if (strm->avail_in == 0) {
+        rb_http_threaddata->frame_part++;
+        continue;
+      }
+    }
+
+    strm->next_out = (Bytef *)ptr + writed;
+    strm->avail_out = nmemb - (ulong)writed;
+    avail_in = strm->avail_in;
+
+    // The payload may still have pieces to read
+    partial = rb_http_threaddata->frame_part == RB_HTTP_FRAME_PAYLOAD &&
+              message->read < message->len;
+
+    deflate(strm, rb_http_threaddata->frame_part == last && !partial
+                      ? Z_SYNC_FLUSH
+                      : Z_NO_FLUSH);
+
+    RB_HTTP_TRACE(rb_http_threaddata->rb_http_handler, RB_HTTP_TRACE_COMPRESS,
+                  compress, rb_http_threaddata->id, avail_in - strm->avail_in,
+                  nmemb - strm->avail_out - writed);
+    writed = nmemb - strm->avail_out;
+
+    // The chunk is full
+    if (strm->avail_in > 0) {
+      return writed;
+    }
+
+    if (!partial) {
+      rb_http_threaddata->frame_part++;
+    }
+  }
+
+  rb_http_msg_q_add(rb_http_threaddata->rfq_pending, message);
+  rb_http_threaddata->message_left = NULL;
+
+  return writed;
+}
+
+size_t rb_http_chunked_compress_close(
+    struct rb_http_threaddata_s *rb_http_threaddata, char *ptr, size_t nmemb) {
+  z_stream *strm = rb_http_threaddata->strm;
+
+  rb_http_threaddata->frame_closed = 1;
+  if (rb_http_threaddata->options->framing != RB_HTTP_FRAMING_JSON_ARRAY) {
+    return 0;
+  }
+
+  strm->next_in = (Bytef *)"]";
+  strm->avail_in = 1;
+  strm->next_out = (Bytef *)ptr;
+  strm->avail_out = nmemb;
+
+  deflate(strm, Z_SYNC_FLUSH);
+
+  return nmemb - strm->avail_out;
+}
+
 static size_t read_callback_batch(void *ptr, size_t size, size_t nmemb,
                                   void *userp) {
 
   (void)size;
 
-  rd_fifoq_elm_t *rfqe = NULL;
   size_t writed = 0;
-  long now;
-  struct timespec spec;
   struct rb_http_message_s *message = NULL;
   struct rb_http_threaddata_s *rb_http_threaddata =
       (struct rb_http_threaddata_s *)userp;
-  struct rb_http_handler_s *rb_http_handler =
-      (struct rb_http_handler_s *)rb_http_threaddata->rb_http_handler;
+
+  // Wait until the bytes of the previous chunks are paid
+  if (rb_http_threaddata != NULL) {
+    rb_http_ratelimit_wait(rb_http_threaddata->rb_http_handler,
+                           &rb_http_threaddata->rb_http_handler->bytes_rate,
+                           rb_http_threaddata->options->max_bytes_per_sec,
+                           rb_http_threaddata->options->bytes_burst);
+  }
 
   // Send remaining message if neccesary. This happends when the previous
   // message didn't fit on the buffer
   if (rb_http_threaddata->strm != NULL &&
-      rb_http_threaddata->strm->avail_in > 0) {
-
-    // Update deflate buffers
-    rb_http_threaddata->strm->next_out = (Bytef *)ptr;
-    rb_http_threaddata->strm->avail_out = nmemb - (ulong)writed;
-
-    deflate(rb_http_threaddata->strm, Z_SYNC_FLUSH);
-
-    // Compute writed bytes on buffer
-    writed = nmemb - rb_http_threaddata->strm->avail_out;
-
-    // This message has been completely read. We can finally add it to the
-    // queue
-    if (rb_http_threaddata->strm->avail_in == 0) {
-      rb_http_msg_q_add(rb_http_threaddata->rfq_pending,
-                        rb_http_threaddata->message_left);
-    }
+      rb_http_threaddata->message_left != NULL) {
+    writed = rb_http_chunked_compress_message(rb_http_threaddata, ptr, nmemb,
+                                              writed);
   } else {
     if (rb_http_threaddata != NULL) {
+      // Every call fills a new chunk
+      rb_http_timer_wheel_advance(&rb_http_threaddata->timers,
+                                  rb_http_now_ms());
+      rb_http_timer_cancel(&rb_http_threaddata->timers,
+                           &rb_http_threaddata->flush_timer);
+      rb_http_threaddata->flush_expired = 0;
+
       // Read messages if...
       while (
           // ...we are allowed to send more message on this batch
-          rb_http_threaddata->current_messages <
-              rb_http_handler->options->max_batch_messages &&
+          !batch_full(rb_http_threaddata) &&
+          // ...the body has not been closed
+          !rb_http_threaddata->frame_closed &&
+          // ...the chunk has not been waiting for too long
+          !rb_http_threaddata->flush_expired &&
           // ...there are messages to be readed from the queue
-          (rfqe = rd_fifoq_pop_timedwait(&rb_http_threaddata->rfq, 500)) !=
-              NULL &&
-          // ...the message readed from the queue is not NULL
-          rfqe->rfqe_ptr != NULL) {
-
-        message = rfqe->rfqe_ptr;
-        rd_fifoq_elm_release(&rb_http_threaddata->rfq, rfqe);
+          (message = batch_next_message(rb_http_threaddata)) != NULL) {
 
         // We need to initialize a few things when starting new POST
         if (rb_http_threaddata->chunks == 0 && writed == 0) {
 
           // Timer starts here because this is the first message on the POST
           // request
-          clock_gettime(CLOCK_REALTIME, &spec);
-          rb_http_threaddata->post_timestamp =
-              spec.tv_sec * 1000 + spec.tv_nsec / (1000 * 1000);
+          rb_http_threaddata->post_timestamp = rb_http_threaddata->timers.now;
+          rb_http_threaddata->batch_expired = 0;
+          if (rb_http_threaddata->adaptive.batch_timeout > 0) {
+            rb_http_timer_add(&rb_http_threaddata->timers,
+                              &rb_http_threaddata->batch_timer,
+                              rb_http_threaddata->post_timestamp +
+                                  rb_http_threaddata->adaptive.batch_timeout);
+          }
 
           // Prepare buffers for deflate
+          rb_http_budget_charge(rb_http_threaddata->rb_http_handler,
+                                RB_HTTP_DEFLATE_BYTES, 1);
           rb_http_threaddata->strm = calloc(1, sizeof(z_stream));
           rb_http_threaddata->strm->zalloc = Z_NULL;
           rb_http_threaddata->strm->zfree = Z_NULL;
@@ -71,43 +451,57 @@ static size_t read_callback_batch(void *ptr, size_t size, size_t nmemb,
           deflateInit(rb_http_threaddata->strm, Z_DEFAULT_COMPRESSION);
 
           // Initialize the report queue
-          rb_http_threaddata->rfq_pending = calloc(1, sizeof(rd_fifoq_t));
-          rb_http_msg_q_init(rb_http_threaddata->rfq_pending);
+          if (rb_http_threaddata->rfq_pending == NULL) {
+            rb_http_threaddata->rfq_pending = calloc(1, sizeof(rd_fifoq_t));
+            rb_http_msg_q_init(rb_http_threaddata->rfq_pending);
+          }
+        } else if (rb_http_threaddata->options->max_batch_bytes > 0 &&
+                   rb_http_threaddata->current_bytes + message->len >
+                       (size_t)rb_http_threaddata->options->max_batch_bytes) {
+          // The message would exceed the bytes limit. Keep it for the next
+          // POST. A single message bigger than the limit is sent alone.
+          rb_http_threaddata->message_next = message;
+          break;
         }
 
-        // Update deflate buffers
-        rb_http_threaddata->strm->next_in = (Bytef *)message->payload;
-        rb_http_threaddata->strm->avail_in = message->len;
-        rb_http_threaddata->strm->next_out = (Bytef *)ptr + writed;
-        rb_http_threaddata->strm->avail_out = nmemb - (ulong)writed;
+        // The first message of a chunk waits at most post_timeout for the
+        // next ones
+        if (writed == 0) {
+          rb_http_timer_add(&rb_http_threaddata->timers,
+                            &rb_http_threaddata->flush_timer,
+                            rb_http_threaddata->timers.now +
+                                rb_http_threaddata->options->post_timeout);
+        }
 
-        deflate(rb_http_threaddata->strm, Z_SYNC_FLUSH);
+        rb_http_chunked_frame_message(rb_http_threaddata, message);
+        writed = rb_http_chunked_compress_message(rb_http_threaddata, ptr,
+                                                  nmemb, writed);
 
-        // Compute writed bytes on buffer
-        writed = nmemb - rb_http_threaddata->strm->avail_out;
+        rb_http_threaddata->current_messages++;
+        rb_http_threaddata->current_bytes += message->len;
 
         // This message hasn't been completely read. It will be read on next
         // iteration so it is necessary to break here so we don't send an
         // incomplete message
-        if (rb_http_threaddata->strm->avail_in > 0) {
-          rb_http_threaddata->message_left = message;
-          break;
-        }
-
-        rb_http_msg_q_add(rb_http_threaddata->rfq_pending, message);
-        rb_http_threaddata->current_messages++;
-
-        // Check if timeout has been triggered
-        clock_gettime(CLOCK_REALTIME, &spec);
-        now = spec.tv_sec * 1000 + spec.tv_nsec / (1000 * 1000);
-        if (now - rb_http_threaddata->post_timestamp >=
-            rb_http_handler->options->post_timeout) {
+        if (rb_http_threaddata->message_left != NULL) {
           break;
         }
       }
     }
   }
 
+  // A payload that can't be read would truncate the body. The POST fails and
+  // its messages are reported.
+  if (rb_http_threaddata->payload_failed) {
+    return CURL_READFUNC_ABORT;
+  }
+
+  // The body of the POST is closed on its own chunk
+  if (writed == 0 && rb_http_threaddata->chunks > 0 &&
+      !rb_http_threaddata->frame_closed) {
+    writed = rb_http_chunked_compress_close(rb_http_threaddata, ptr, nmemb);
+  }
+
   // If there is no data to send
   if (writed == 0) {
 
@@ -115,21 +509,41 @@ static size_t read_callback_batch(void *ptr, size_t size, size_t nmemb,
     if (rb_http_threaddata->chunks > 0) {
 
       // Send the zero-length chunk and reset chunks counter
+      rb_http_timer_cancel(&rb_http_threaddata->timers,
+                           &rb_http_threaddata->batch_timer);
+      rb_http_timer_cancel(&rb_http_threaddata->timers,
+                           &rb_http_threaddata->flush_timer);
+      rb_http_threaddata->post_end_timestamp = rb_http_now_ms();
+      rb_http_threaddata->post_messages = rb_http_threaddata->current_messages;
       deflateEnd(rb_http_threaddata->strm);
       free(rb_http_threaddata->strm);
+      rb_http_budget_release(rb_http_threaddata->rb_http_handler,
+                             RB_HTTP_DEFLATE_BYTES);
       rb_http_threaddata->current_messages = 0;
+      rb_http_threaddata->current_bytes = 0;
       rb_http_threaddata->strm = NULL;
       rb_http_threaddata->chunks = 0;
+      rb_http_threaddata->frame_closed = 0;
     } else {
 
       // Is not the first time we are not getting any data. Pause transfer.
-      rb_http_threaddata->rfq_pending = calloc(1, sizeof(rd_fifoq_t));
-      rb_http_msg_q_init(rb_http_threaddata->rfq_pending);
+      if (rb_http_threaddata->rfq_pending == NULL) {
+        rb_http_threaddata->rfq_pending = calloc(1, sizeof(rd_fifoq_t));
+        rb_http_msg_q_init(rb_http_threaddata->rfq_pending);
+      }
       return CURL_READFUNC_PAUSE;
     }
   } else {
     // If we send data increase number of chunks
     rb_http_threaddata->chunks++;
+    rb_http_fanout_append(rb_http_threaddata, ptr, writed);
+    rb_http_ratelimit_take(&rb_http_threaddata->rb_http_handler->bytes_rate,
+                           rb_http_threaddata->options->max_bytes_per_sec,
+                           rb_http_threaddata->options->bytes_burst,
+                           (long)writed, rb_http_now_ms());
+    RB_HTTP_TRACE(rb_http_threaddata->rb_http_handler, RB_HTTP_TRACE_CHUNK,
+                  chunk, rb_http_threaddata->id, writed,
+                  rb_http_threaddata->current_messages);
   }
 
   return writed;
@@ -143,6 +557,182 @@ static size_t write_null_callback(void *buffer, size_t size, size_t nmemb,
   return nmemb * size;
 }
 
+/**
+ * Keeps the response of the POST, up to RB_HTTP_MAX_RESPONSE_BYTES. The
+ * buffer of the thread is reused between POSTs.
+ */
+static size_t write_response_callback(void *buffer, size_t size, size_t nmemb,
+                                      void *opaque) {
+  struct rb_http_threaddata_s *rb_http_threaddata =
+      (struct rb_http_threaddata_s *)opaque;
+  const size_t max = (size_t)rb_http_threaddata->options->max_response_bytes;
+  size_t len = nmemb * size;
+
+  if (rb_http_threaddata->response_len + len > max) {
+    len = max - rb_http_threaddata->response_len;
+  }
+
+  if (rb_http_threaddata->response_len + len >
+      rb_http_threaddata->response_size) {
+    size_t new_size = rb_http_threaddata->response_size * 2;
+    char *response = NULL;
+
+    if (new_size < rb_http_threaddata->response_len + len) {
+      new_size = rb_http_threaddata->response_len + len;
+    }
+    response = realloc(rb_http_threaddata->response, new_size);
+    if (response == NULL) {
+      return nmemb * size;
+    }
+    rb_http_budget_charge(rb_http_threaddata->rb_http_handler,
+                          new_size - rb_http_threaddata->response_size, 1);
+    rb_http_threaddata->response = response;
+    rb_http_threaddata->response_size = new_size;
+  }
+
+  memcpy(rb_http_threaddata->response + rb_http_threaddata->response_len,
+         buffer, len);
+  rb_http_threaddata->response_len += len;
+
+  return nmemb * size;
+}
+
+void rb_http_chunked_parse_response(
+    struct rb_http_threaddata_s *rb_http_threaddata, rb_http_msg_q_t *msgs,
+    long http_code) {
+  const struct rb_http_response_parser_s *parser =
+      rb_http_threaddata->rb_http_handler->response_parser;
+  const int nmessages = rb_http_msg_q_cnt(msgs);
+  struct rb_http_message_s *message = NULL;
+  struct rb_http_message_s *next = NULL;
+  int *status = NULL;
+  int i = 0;
+
+  if (parser == NULL || nmessages == 0 ||
+      rb_http_threaddata->options->max_response_bytes <= 0) {
+    return;
+  }
+
+  status = calloc((size_t)nmessages, sizeof(int));
+  if (parser->fn(rb_http_threaddata->rb_http_handler, http_code,
+                 rb_http_threaddata->response, rb_http_threaddata->response_len,
+                 status, (size_t)nmessages, parser->opaque) != 0) {
+    free(status);
+    return;
+  }
+
+  for (message = TAILQ_FIRST(msgs); message != NULL; message = next, i++) {
+    next = TAILQ_NEXT(message, tailq);
+    message->status = status[i];
+
+    if (message->status != RB_HTTP_ERR_RETRY) {
+      continue;
+    }
+
+    if (message->retries >=
+        rb_http_threaddata->options->max_message_retries) {
+      message->status = RB_HTTP_ERR_REJECTED;
+      continue;
+    }
+
+    message->retries++;
+    message->status = 0;
+    TAILQ_REMOVE(msgs, message, tailq);
+    rb_http_lanes_add(&rb_http_threaddata->lanes, message);
+  }
+
+  free(status);
+}
+
+/**
+ * Aborts the POST in progress when the handler is destroyed after the drain
+ * timeout.
+ */
+static int xferinfo_callback(void *opaque, curl_off_t dltotal, curl_off_t dlnow,
+                             curl_off_t ultotal, curl_off_t ulnow) {
+  struct rb_http_threaddata_s *rb_http_threaddata =
+      (struct rb_http_threaddata_s *)opaque;
+
+  (void)dltotal;
+  (void)dlnow;
+  (void)ultotal;
+  (void)ulnow;
+
+  return ATOMIC_OP(add, fetch,
+                   &rb_http_threaddata->rb_http_handler->thread_running,
+                   0) == 0;
+}
+
+/**
+ * Takes the messages of a failed POST and resets the POST state, so the next
+ * one starts from scratch.
+ * @param rb_http_threaddata Thread owning the POST
+ * @param msgs               Queue where the messages of the POST are added
+ */
+static void chunked_post_abort(struct rb_http_threaddata_s *rb_http_threaddata,
+                               rb_http_msg_q_t *msgs) {
+  if (rb_http_threaddata->rfq_pending != NULL) {
+    TAILQ_CONCAT(msgs, rb_http_threaddata->rfq_pending, tailq);
+    free(rb_http_threaddata->rfq_pending);
+    rb_http_threaddata->rfq_pending = NULL;
+  }
+
+  if (rb_http_threaddata->strm != NULL) {
+    // A message partially written is not in the pending queue yet
+    if (rb_http_threaddata->message_left != NULL) {
+      rb_http_msg_q_add(msgs, rb_http_threaddata->message_left);
+    }
+    deflateEnd(rb_http_threaddata->strm);
+    free(rb_http_threaddata->strm);
+    rb_http_threaddata->strm = NULL;
+    rb_http_budget_release(rb_http_threaddata->rb_http_handler,
+                           RB_HTTP_DEFLATE_BYTES);
+  }
+
+  rb_http_threaddata->message_left = NULL;
+  rb_http_threaddata->current_messages = 0;
+  rb_http_threaddata->current_bytes = 0;
+  rb_http_threaddata->chunks = 0;
+  rb_http_threaddata->frame_closed = 0;
+  rb_http_threaddata->payload_failed = 0;
+  rb_http_timer_cancel(&rb_http_threaddata->timers,
+                       &rb_http_threaddata->batch_timer);
+  rb_http_timer_cancel(&rb_http_threaddata->timers,
+                       &rb_http_threaddata->flush_timer);
+}
+
+/**
+ * Finishes the thread if it is over the configured number of connections.
+ * The check is done with options_lock held so rb_http_handler_set_opt() sees
+ * either a running thread or a finished one. Producers that chose this thread
+ * before the connections were reduced may have queued messages since the
+ * thread found its queue empty, so it is checked again with producers out.
+ * @param  rb_http_threaddata Thread to check
+ * @return                    1 if the thread must finish
+ */
+static int
+chunked_thread_retire(struct rb_http_threaddata_s *rb_http_threaddata) {
+  struct rb_http_handler_s *rb_http_handler =
+      rb_http_threaddata->rb_http_handler;
+  int retire = 0;
+
+  pthread_mutex_lock(&rb_http_handler->options_lock);
+  if (rb_http_threaddata->id >= rb_http_handler->options->connections) {
+    pthread_rwlock_wrlock(&rb_http_handler->threads_lock);
+    retire = rb_http_threaddata->message_next == NULL &&
+             rb_http_lanes_cnt(&rb_http_threaddata->lanes) == 0;
+    if (retire) {
+      rb_http_options_release_locked(rb_http_threaddata->options);
+      rb_http_threaddata->options = NULL;
+      ATOMIC_OP(add, fetch, &rb_http_threaddata->exited, 1);
+    }
+    pthread_rwlock_unlock(&rb_http_handler->threads_lock);
+  }
+  pthread_mutex_unlock(&rb_http_handler->options_lock);
+
+  return retire;
+}
+
 void *rb_http_process_chunked(void *arg) {
 
   struct rb_http_threaddata_s *rb_http_threaddata =
@@ -153,30 +743,143 @@ void *rb_http_process_chunked(void *arg) {
 
   assert(rb_http_threaddata != NULL);
   assert(rb_http_handler != NULL);
-  assert(rb_http_handler->options != NULL);
+  assert(rb_http_threaddata->options != NULL);
+
+  rb_http_reports_set_shard(rb_http_threaddata->id);
+  rb_http_adaptive_init(&rb_http_threaddata->adaptive,
+                        rb_http_threaddata->options, rb_http_now_ms());
+  rb_http_timer_wheel_init(&rb_http_threaddata->timers, rb_http_now_ms());
+  rb_http_timer_init(&rb_http_threaddata->batch_timer, batch_timer_cb,
+                     rb_http_threaddata);
+  rb_http_timer_init(&rb_http_threaddata->flush_timer, flush_timer_cb,
+                     rb_http_threaddata);
+  rb_http_timer_init(&rb_http_threaddata->retry_timer, retry_timer_cb,
+                     rb_http_threaddata);
+  rb_http_threaddata->retry_backoff =
+      rb_http_threaddata->options->min_retry_backoff;
+
+  // Open the connection before the first message arrives
+  if (rb_http_threaddata->options->prewarm) {
+    rb_http_warm_probe(rb_http_threaddata);
+  }
 
   while (1) {
+    CURLcode res;
+    int cnt = 0;
+    long now = 0;
+    long response = 0;
+    long http_code = 0;
+
+    do {
+      // rb_http_handler_destroy() has already drained the queues
+      if (ATOMIC_OP(add, fetch,
+                    &rb_http_threaddata->rb_http_handler->thread_running,
+                    0) == 0) {
+        rb_http_options_release(rb_http_handler, rb_http_threaddata->options);
+        return NULL;
+      }
+
+      // A message delayed by the batch limits is waiting too
+      if (rb_http_threaddata->message_next != NULL) {
+        cnt = 1;
+      } else if ((cnt = rb_http_lanes_cnt(&rb_http_threaddata->lanes)) == 0 &&
+                 (cnt = chunked_thread_steal(rb_http_threaddata)) == 0) {
+        // Look for work on other threads again soon
+        cnt = rb_http_lanes_wait(&rb_http_threaddata->lanes, 0,
+                                 rb_http_threaddata->options->work_stealing
+                                     ? DEFAULT_STEAL_INTERVAL
+                                     : 1000);
+      }
+
+      // Connections have been reduced and this thread is not needed
+      if (cnt == 0 && chunked_thread_retire(rb_http_threaddata)) {
+        return NULL;
+      }
+
+      // Keep the connection open while there is nothing to send
+      if (cnt == 0 && rb_http_threaddata->options->idle_probe > 0 &&
+          rb_http_now_ms() - rb_http_threaddata->last_request >=
+              rb_http_threaddata->options->idle_probe) {
+        rb_http_warm_probe(rb_http_threaddata);
+      }
+    } while (cnt == 0);
+
+    // Wait before the next POST after a failed one, until the retry timer
+    // fires or the handler is destroyed. New messages wake the thread up, but
+    // only to wait again.
+    while (rb_http_timer_pending(&rb_http_threaddata->retry_timer)) {
+      if (ATOMIC_OP(add, fetch,
+                    &rb_http_threaddata->rb_http_handler->thread_running,
+                    0) == 0) {
+        rb_http_timer_cancel(&rb_http_threaddata->timers,
+                             &rb_http_threaddata->retry_timer);
+        break;
+      }
+
+      cnt = rb_http_lanes_wait(
+          &rb_http_threaddata->lanes, cnt,
+          (int)rb_http_timer_wheel_next(&rb_http_threaddata->timers, 1000));
+      rb_http_timer_wheel_advance(&rb_http_threaddata->timers,
+                                  rb_http_now_ms());
+    }
+
+    // Between POSTs is the only moment options can change for this thread
+    if (rb_http_options_refresh(rb_http_handler,
+                                &rb_http_threaddata->options)) {
+      rb_http_adaptive_configure(&rb_http_threaddata->adaptive,
+                                 rb_http_threaddata->options);
+    }
+
     if (curl_easy_setopt(rb_http_threaddata->easy_handle, CURLOPT_URL,
-                         rb_http_handler->options->url) != CURLE_OK) {
+                         rb_http_threaddata->options->url) != CURLE_OK) {
       struct rb_http_report_s *report =
           calloc(1, sizeof(struct rb_http_report_s));
       report->err_code = -1;
       report->http_code = 0;
       report->handler = NULL;
-      rd_fifoq_add(&rb_http_handler->rfq_reports, report);
+      rb_http_reports_add(rb_http_handler, report);
+    }
+
+    if (curl_easy_setopt(rb_http_threaddata->easy_handle,
+                         CURLOPT_UNIX_SOCKET_PATH,
+                         rb_http_threaddata->options->unix_socket) !=
+        CURLE_OK) {
+      struct rb_http_report_s *report =
+          calloc(1, sizeof(struct rb_http_report_s));
+      report->err_code = -1;
+      report->http_code = 0;
+      report->handler = NULL;
+      rb_http_reports_add(rb_http_handler, report);
     }
 
     struct curl_slist *headers = NULL;
 
     headers = curl_slist_append(headers, "Accept: application/json");
-    headers = curl_slist_append(headers, "Content-Type: application/json");
+    if (rb_http_threaddata->options->framing == RB_HTTP_FRAMING_NDJSON) {
+      headers =
+          curl_slist_append(headers, "Content-Type: application/x-ndjson");
+    } else if (rb_http_threaddata->options->framing ==
+               RB_HTTP_FRAMING_LENGTH_PREFIX) {
+      headers = curl_slist_append(headers,
+                                  "Content-Type: application/octet-stream");
+    } else {
+      headers = curl_slist_append(headers, "Content-Type: application/json");
+    }
     headers = curl_slist_append(headers, "charsets: utf-8");
     headers = curl_slist_append(headers, "Expect:");
     headers = curl_slist_append(headers, "Transfer-Encoding: chunked");
     headers = curl_slist_append(headers, "Content-Encoding: deflate");
 
-    curl_easy_setopt(rb_http_threaddata->easy_handle, CURLOPT_WRITEFUNCTION,
-                     write_null_callback);
+    if (rb_http_threaddata->options->max_response_bytes > 0) {
+      rb_http_threaddata->response_len = 0;
+      curl_easy_setopt(rb_http_threaddata->easy_handle, CURLOPT_WRITEDATA,
+                       rb_http_threaddata);
+      curl_easy_setopt(rb_http_threaddata->easy_handle, CURLOPT_WRITEFUNCTION,
+                       write_response_callback);
+    } else {
+      curl_easy_setopt(rb_http_threaddata->easy_handle, CURLOPT_WRITEFUNCTION,
+                       write_null_callback);
+    }
 
     if (curl_easy_setopt(rb_http_threaddata->easy_handle, CURLOPT_HTTPHEADER,
                          headers) != CURLE_OK) {
@@ -185,47 +888,46 @@ void *rb_http_process_chunked(void *arg) {
       report->err_code = -1;
       report->http_code = 0;
       report->handler = NULL;
-      rd_fifoq_add(&rb_http_handler->rfq_reports, report);
+      rb_http_reports_add(rb_http_handler, report);
     }
 
     curl_easy_setopt(rb_http_threaddata->easy_handle, CURLOPT_NOSIGNAL, 1);
 
     if (curl_easy_setopt(rb_http_threaddata->easy_handle, CURLOPT_VERBOSE,
-                         rb_http_handler->options->verbose) != CURLE_OK) {
+                         rb_http_threaddata->options->verbose) != CURLE_OK) {
       struct rb_http_report_s *report =
           calloc(1, sizeof(struct rb_http_report_s));
       report->err_code = -1;
       report->http_code = 0;
       report->handler = NULL;
-      rd_fifoq_add(&rb_http_handler->rfq_reports, report);
+      rb_http_reports_add(rb_http_handler, report);
     }
 
-    if (rb_http_handler->options->insecure) {
-      curl_easy_setopt(rb_http_threaddata->easy_handle, CURLOPT_SSL_VERIFYPEER,
-                       0);
-      curl_easy_setopt(rb_http_threaddata->easy_handle, CURLOPT_SSL_VERIFYHOST,
-                       0);
-    }
+    // Options may have changed since last POST, so both values are set
+    curl_easy_setopt(rb_http_threaddata->easy_handle, CURLOPT_SSL_VERIFYPEER,
+                     rb_http_threaddata->options->insecure ? 0L : 1L);
+    curl_easy_setopt(rb_http_threaddata->easy_handle, CURLOPT_SSL_VERIFYHOST,
+                     rb_http_threaddata->options->insecure ? 0L : 2L);
 
     if (curl_easy_setopt(rb_http_threaddata->easy_handle, CURLOPT_TIMEOUT_MS,
-                         rb_http_handler->options->timeout) != CURLE_OK) {
+                         rb_http_threaddata->options->timeout) != CURLE_OK) {
       struct rb_http_report_s *report =
           calloc(1, sizeof(struct rb_http_report_s));
       report->err_code = -1;
       report->http_code = 0;
       report->handler = NULL;
-      rd_fifoq_add(&rb_http_handler->rfq_reports, report);
+      rb_http_reports_add(rb_http_handler, report);
     }
 
     if (curl_easy_setopt(rb_http_threaddata->easy_handle,
                          CURLOPT_CONNECTTIMEOUT_MS,
-                         rb_http_handler->options->conntimeout) != CURLE_OK) {
+                         rb_http_threaddata->options->conntimeout) != CURLE_OK) {
       struct rb_http_report_s *report =
           calloc(1, sizeof(struct rb_http_report_s));
       report->err_code = -1;
       report->http_code = 0;
       report->handler = NULL;
-      rd_fifoq_add(&rb_http_handler->rfq_reports, report);
+      rb_http_reports_add(rb_http_handler, report);
     }
 
     curl_easy_setopt(rb_http_threaddata->easy_handle, CURLOPT_POST, 1L);
@@ -233,27 +935,80 @@ void *rb_http_process_chunked(void *arg) {
                      rb_http_threaddata);
     curl_easy_setopt(rb_http_threaddata->easy_handle, CURLOPT_READFUNCTION,
                      read_callback_batch);
-    CURLcode res;
-    int cnt = 0;
+    curl_easy_setopt(rb_http_threaddata->easy_handle, CURLOPT_XFERINFODATA,
+                     rb_http_threaddata);
+    curl_easy_setopt(rb_http_threaddata->easy_handle, CURLOPT_XFERINFOFUNCTION,
+                     xferinfo_callback);
+    curl_easy_setopt(rb_http_threaddata->easy_handle, CURLOPT_NOPROGRESS, 0L);
+    rb_http_warm_keepalive(rb_http_threaddata->easy_handle,
+                           rb_http_threaddata->options);
 
-    do {
-      pthread_mutex_lock(&rb_http_threaddata->rfq.rfq_lock);
-      cnt = rb_http_threaddata->rfq.rfq_cnt;
-      pthread_mutex_unlock(&rb_http_threaddata->rfq.rfq_lock);
-
-      if (cnt == 0) {
-        sleep(1);
-        if (ATOMIC_OP(sub, fetch,
-                      &rb_http_threaddata->rb_http_handler->thread_running,
-                      0) == 0) {
-          curl_slist_free_all(headers);
-          return NULL;
-        }
+    // Wait until the requests rate and the requests limit allow a new POST
+    rb_http_ratelimit_wait(rb_http_handler, &rb_http_handler->requests_rate,
+                           rb_http_threaddata->options->max_requests_per_sec,
+                           rb_http_threaddata->options->requests_burst);
+    rb_http_ratelimit_take(&rb_http_handler->requests_rate,
+                           rb_http_threaddata->options->max_requests_per_sec,
+                           rb_http_threaddata->options->requests_burst, 1,
+                           rb_http_now_ms());
+    while (!rb_http_limit_acquire(&rb_http_handler->limit, 1000)) {
+      if (ATOMIC_OP(add, fetch,
+                    &rb_http_threaddata->rb_http_handler->thread_running,
+                    0) == 0) {
+        curl_slist_free_all(headers);
+        rb_http_options_release(rb_http_handler, rb_http_threaddata->options);
+        return NULL;
       }
-    } while (cnt == 0);
+    }
 
+    rb_http_fanout_begin(rb_http_threaddata, headers);
+    RB_HTTP_TRACE(rb_http_handler, RB_HTTP_TRACE_POST_START, post_start,
+                  rb_http_threaddata->id,
+                  rb_http_lanes_cnt(&rb_http_threaddata->lanes), 0);
     res = curl_easy_perform(rb_http_threaddata->easy_handle);
 
+    // Feed the batch controller with the result of this POST. If the upload
+    // didn't finish the whole POST is counted as response time.
+    now = rb_http_now_ms();
+    rb_http_threaddata->last_request = now;
+    if (rb_http_threaddata->post_end_timestamp >=
+        rb_http_threaddata->post_timestamp) {
+      response = now - rb_http_threaddata->post_end_timestamp;
+    } else {
+      response = now - rb_http_threaddata->post_timestamp;
+    }
+    curl_easy_getinfo(rb_http_threaddata->easy_handle, CURLINFO_RESPONSE_CODE,
+                      &http_code);
+    RB_HTTP_TRACE(rb_http_handler, RB_HTTP_TRACE_POST_END, post_end,
+                  rb_http_threaddata->id, http_code, res);
+
+    cnt = rb_http_lanes_cnt(&rb_http_threaddata->lanes);
+
+    rb_http_adaptive_update(&rb_http_threaddata->adaptive,
+                            rb_http_threaddata->options,
+                            rb_http_threaddata->post_messages, cnt, response,
+                            res != CURLE_OK || http_code >= 400, now);
+
+    rb_http_limit_update(&rb_http_handler->limit, response, http_code, now);
+    rb_http_limit_release(&rb_http_handler->limit);
+
+    // A failed POST delays the next one, with exponential backoff
+    rb_http_timer_wheel_advance(&rb_http_threaddata->timers, now);
+    if (res == CURLE_OK) {
+      rb_http_threaddata->retry_backoff =
+          rb_http_threaddata->options->min_retry_backoff;
+    } else if (rb_http_threaddata->retry_backoff > 0) {
+      rb_http_timer_add(&rb_http_threaddata->timers,
+                        &rb_http_threaddata->retry_timer,
+                        now + rb_http_threaddata->retry_backoff);
+      rb_http_threaddata->retry_backoff *= 2;
+      if (rb_http_threaddata->retry_backoff >
+          rb_http_threaddata->options->max_retry_backoff) {
+        rb_http_threaddata->retry_backoff =
+            rb_http_threaddata->options->max_retry_backoff;
+      }
+    }
+
     if (res == CURLE_OK) {
 
       struct rb_http_report_s *report =
@@ -265,86 +1020,105 @@ void *rb_http_process_chunked(void *arg) {
       report->handler = rb_http_threaddata->easy_handle;
       curl_easy_getinfo(rb_http_threaddata->easy_handle, CURLINFO_RESPONSE_CODE,
                         &report->http_code);
+      rb_http_threaddata->rfq_pending = NULL;
 
-      rd_fifoq_add(&rb_http_handler->rfq_reports, report);
+      // The whole body has been compressed, so it can go to the extra
+      // destinations now
+      if (!rb_http_fanout_send(rb_http_threaddata, report->http_code < 400)) {
+        report->err_code = RB_HTTP_ERR_QUORUM;
+      }
+
+      if (report->rfq_msgs != NULL) {
+        rb_http_chunked_parse_response(rb_http_threaddata, report->rfq_msgs,
+                                       report->http_code);
+        ATOMIC_OP(sub, fetch, &rb_http_handler->outstanding,
+                  rb_http_msg_q_cnt(report->rfq_msgs));
+      }
+      rb_http_reports_add(rb_http_handler, report);
     } else {
-      rd_fifoq_elm_t *rfqe =
-          (rd_fifoq_elm_t *)TAILQ_FIRST(&rb_http_threaddata->rfq.rfq_q);
-      if (rfqe != NULL) {
-        struct rb_http_message_s *message =
-            (struct rb_http_message_s *)rfqe->rfqe_ptr;
-
-        if (time(NULL) - message->timestamp >
-            rb_http_handler->options->conntimeout / 1000) {
-          rd_fifoq_pop(&rb_http_threaddata->rfq);
-          struct rb_http_report_s *report =
-              calloc(1, sizeof(struct rb_http_report_s));
-          report->rfq_msgs = calloc(1, sizeof(rd_fifoq_t));
-
-          rb_http_msg_q_init(report->rfq_msgs);
-
-          report->headers = headers;
-          report->err_code = res;
-          report->handler = rb_http_threaddata->easy_handle;
-
-          curl_easy_getinfo(rb_http_threaddata->easy_handle,
-                            CURLINFO_RESPONSE_CODE, &report->http_code);
-          rb_http_msg_q_add(report->rfq_msgs, message);
-          rd_fifoq_elm_release(&rb_http_threaddata->rfq, rfqe);
-          rd_fifoq_add(&rb_http_handler->rfq_reports, report);
-        } else {
-          curl_slist_free_all(headers);
-        }
+      // Messages that expired while the endpoint was failing are not retried
+      rb_http_msg_q_t expired;
+
+      rb_http_msg_q_init(&expired);
+      rb_http_lanes_expire(&rb_http_threaddata->lanes, now, &expired);
+      rb_http_lanes_report_expired(rb_http_handler, &expired);
+
+      // A body compressed up to its end may still reach the quorum through
+      // the extra destinations, with this POST counted as not acknowledged
+      const int delivered =
+          rb_http_threaddata->strm == NULL &&
+          rb_http_threaddata->rfq_pending != NULL &&
+          !rb_http_msg_q_empty(rb_http_threaddata->rfq_pending) &&
+          rb_http_threaddata->options->fanout_cnt > 0 &&
+          rb_http_fanout_send(rb_http_threaddata, 0);
+
+      // Messages of the failed POST are reported, and so is the oldest
+      // queued message if it has been waiting longer than conntimeout
+      struct rb_http_report_s *report =
+          calloc(1, sizeof(struct rb_http_report_s));
+      report->rfq_msgs = calloc(1, sizeof(rd_fifoq_t));
+      rb_http_msg_q_init(report->rfq_msgs);
+
+      chunked_post_abort(rb_http_threaddata, report->rfq_msgs);
+
+      struct rb_http_message_s *message =
+          delivered ? NULL
+                    : rb_http_lanes_pop_older(
+                          &rb_http_threaddata->lanes,
+                          now - rb_http_threaddata->options->conntimeout);
+      if (message != NULL) {
+        rb_http_msg_q_add(report->rfq_msgs, message);
+      }
+
+      if (!rb_http_msg_q_empty(report->rfq_msgs)) {
+        report->headers = headers;
+        report->err_code = delivered ? CURLE_OK : res;
+        report->handler = rb_http_threaddata->easy_handle;
+
+        curl_easy_getinfo(rb_http_threaddata->easy_handle,
+                          CURLINFO_RESPONSE_CODE, &report->http_code);
+        ATOMIC_OP(sub, fetch, &rb_http_handler->outstanding,
+                  rb_http_msg_q_cnt(report->rfq_msgs));
+        rb_http_reports_add(rb_http_handler, report);
+      } else {
+        curl_slist_free_all(headers);
+        free(report->rfq_msgs);
+        free(report);
       }
     }
+
+    rb_http_fanout_finish(rb_http_threaddata);
   }
 
   return NULL;
 }
 
-int rb_http_get_reports_chunked(struct rb_http_handler_s *rb_http_handler,
-                                cb_report report_fn, int timeout_ms) {
-  rd_fifoq_elm_t *rfqe = NULL;
-  struct rb_http_report_s *report = NULL;
+void rb_http_report_chunked(struct rb_http_handler_s *rb_http_handler,
+                            struct rb_http_report_s *report,
+                            cb_report report_fn) {
   struct rb_http_message_s *message = NULL;
-  int nowait = 0;
-  long http_code = 0;
-  char *str_error = NULL;
-
-  if (timeout_ms == 0) {
-    nowait = 1;
-  }
-
-  if (rb_http_handler != NULL) {
-    while ((rfqe = rd_fifoq_pop0(&rb_http_handler->rfq_reports, nowait,
-                                 timeout_ms)) != NULL) {
-      if (rfqe->rfqe_ptr != NULL) {
-        report = (struct rb_http_report_s *)rfqe->rfqe_ptr;
-        http_code = report->http_code;
-        if (report->rfq_msgs != NULL) {
-
-          while (!rb_http_msg_q_empty(report->rfq_msgs)) {
-            message = rb_http_msg_q_pop(report->rfq_msgs);
-            if (message != NULL) {
-              ATOMIC_OP(sub, fetch, &rb_http_handler->left, 1);
-              str_error = strdup(curl_easy_strerror(report->err_code));
-              report_fn(rb_http_handler, report->err_code, http_code, str_error,
-                        message->payload, message->len, message->client_opaque);
-
-              if (message->free_message && message->payload != NULL) {
-                free(message->payload);
-              }
-              free(message);
-            }
-          }
-        }
-        curl_slist_free_all(report->headers);
-        free(report->rfq_msgs);
-        free(report);
+  int status = 0;
+  long http_code = report->http_code;
+
+  if (report->rfq_msgs != NULL) {
+
+    while (!rb_http_msg_q_empty(report->rfq_msgs)) {
+      message = rb_http_msg_q_pop(report->rfq_msgs);
+      if (message != NULL) {
+        rb_http_lanes_delivered(rb_http_handler, message, rb_http_now_ms());
+        ATOMIC_OP(sub, fetch, &rb_http_handler->left, 1);
+        // The response parser may have given a status to the message
+        status = message->status != 0 ? message->status : report->err_code;
+        RB_HTTP_TRACE(rb_http_handler, RB_HTTP_TRACE_REPORT, report, -1,
+                      (uintptr_t)message, status);
+        report_fn(rb_http_handler, status, http_code, rb_http_strerror(status),
+                  message->payload, message->len, message->client_opaque);
+
+        rb_http_message_free(rb_http_handler, message);
       }
-      rd_fifoq_elm_release(&rb_http_handler->rfq_reports, rfqe);
     }
   }
-
-  return rb_http_handler->left;
+  curl_slist_free_all(report->headers);
+  free(report->rfq_msgs);
+  free(report);
 }
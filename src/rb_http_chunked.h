@@ -8,11 +8,58 @@
 void *rb_http_process_chunked (void *arg);
 
 /**
- * [rb_http_get_reports  description]
- * @param  rb_http_handler [description]
- * @param  report_fn       [description]
- * @param  timeout_ms      [description]
- * @return                 [description]
+ * Delivers a report to the application and frees it
+ * @param rb_http_handler Handler
+ * @param report          Report to deliver
+ * @param report_fn       Callback for each message of the report
  */
-int rb_http_get_reports_chunked (struct rb_http_handler_s *rb_http_handler,
-                                 cb_report report_fn, int timeout_ms);
\ No newline at end of file
+void rb_http_report_chunked (struct rb_http_handler_s *rb_http_handler,
+                             struct rb_http_report_s *report,
+                             cb_report report_fn);
+
+/**
+ * Applies the status given by the response parser to the messages of a POST.
+ * Messages the server asked to resend are taken from the queue and queued
+ * again, so they are not reported yet.
+ * @param rb_http_threaddata Thread owning the POST
+ * @param msgs               Messages of the POST
+ * @param http_code          HTTP response code
+ */
+void rb_http_chunked_parse_response (
+    struct rb_http_threaddata_s *rb_http_threaddata, rb_http_msg_q_t *msgs,
+    long http_code);
+
+/**
+ * Sets the framing bytes that go before and after a message of the POST in
+ * progress, and makes it the message being compressed.
+ * @param rb_http_threaddata Thread owning the POST
+ * @param message            Next message of the POST
+ */
+void rb_http_chunked_frame_message (
+    struct rb_http_threaddata_s *rb_http_threaddata,
+    struct rb_http_message_s *message);
+
+/**
+ * Compresses the message being written and its framing into the chunk. The
+ * payload is compressed from where the producer left it, and only the last
+ * part of the message flushes the compressor.
+ * @param  rb_http_threaddata Thread owning the POST
+ * @param  ptr                Chunk buffer
+ * @param  nmemb              Size of the chunk buffer
+ * @param  writed             Bytes already in the chunk
+ * @return                    Bytes in the chunk. If the message doesn't fit it
+ *                            is kept in message_left.
+ */
+size_t rb_http_chunked_compress_message (
+    struct rb_http_threaddata_s *rb_http_threaddata, char *ptr, size_t nmemb,
+    size_t writed);
+
+/**
+ * Writes the bytes that end the body of the POST in progress
+ * @param  rb_http_threaddata Thread owning the POST
+ * @param  ptr                Chunk buffer
+ * @param  nmemb              Size of the chunk buffer
+ * @return                    Bytes in the chunk
+ */
+size_t rb_http_chunked_compress_close (
+    struct rb_http_threaddata_s *rb_http_threaddata, char *ptr, size_t nmemb);
@@ -0,0 +1,306 @@
+/**
+ * @file rb_http_fanout.c
+ * @brief Delivery of CHUNKED_MODE batches to extra destinations.
+ *
+ * Messages are queued once and every batch is compressed once. The POST to
+ * HTTP_URL streams the body as it is compressed, and the thread keeps a copy
+ * of the chunks. Once the POST is done the same body is uploaded to the
+ * RB_HTTP_FANOUT_URLS destinations in parallel. Every destination has its
+ * own retries and backoff, and the batch is reported as soon as
+ * RB_HTTP_FANOUT_QUORUM destinations acknowledged it. A failed POST to
+ * HTTP_URL counts as not acknowledged. If it failed before its body was
+ * complete, there is nothing to upload, and the batch is reported with the
+ * error of the POST.
+ */
+#include "../config.h"
+#include "rb_http_adaptive.h"
+#include "rb_http_budget.h"
+#include "rb_http_fanout.h"
+#include "rb_http_ratelimit.h"
+#include "rb_http_warm.h"
+
+// Max time (ms) to wait for upload activity before checking for retries
+#define FANOUT_MAX_WAIT 100
+
+static size_t fanout_write_null(void *buffer, size_t size, size_t nmemb,
+                                void *opaque) {
+  (void)buffer;
+  (void)opaque;
+
+  return nmemb * size;
+}
+
+void rb_http_fanout_begin(struct rb_http_threaddata_s *rb_http_threaddata,
+                          const struct curl_slist *headers) {
+  struct rb_http_fanout_s *fanout = rb_http_threaddata->fanout;
+
+  if (rb_http_threaddata->options->fanout_cnt == 0) {
+    if (fanout != NULL) {
+      fanout->cnt = 0;
+    }
+    return;
+  }
+
+  if (fanout == NULL) {
+    fanout = rb_http_threaddata->fanout =
+        calloc(1, sizeof(struct rb_http_fanout_s));
+    fanout->multi_handle = curl_multi_init();
+  }
+
+  fanout->cnt = rb_http_threaddata->options->fanout_cnt;
+  fanout->len = 0;
+
+  // The uploads know the length of the body, so they are not chunked
+  curl_slist_free_all(fanout->headers);
+  fanout->headers = NULL;
+  for (; headers != NULL; headers = headers->next) {
+    if (strncmp(headers->data, "Transfer-Encoding:", 18) != 0) {
+      fanout->headers = curl_slist_append(fanout->headers, headers->data);
+    }
+  }
+}
+
+void rb_http_fanout_append(struct rb_http_threaddata_s *rb_http_threaddata,
+                           const char *chunk, size_t len) {
+  struct rb_http_fanout_s *fanout = rb_http_threaddata->fanout;
+  size_t size = 0;
+
+  if (fanout == NULL || fanout->cnt == 0) {
+    return;
+  }
+
+  if (fanout->len + len > fanout->size) {
+    size = fanout->size > 0 ? fanout->size : RB_HTTP_PAYLOAD_BUF;
+    while (size < fanout->len + len) {
+      size *= 2;
+    }
+    fanout->body = realloc(fanout->body, size);
+    rb_http_budget_charge(rb_http_threaddata->rb_http_handler,
+                          size - fanout->size, 1);
+    fanout->size = size;
+  }
+
+  memcpy(fanout->body + fanout->len, chunk, len);
+  fanout->len += len;
+}
+
+/**
+ * Sends the body to a destination
+ * @param rb_http_threaddata Thread
+ * @param i                  Index of the destination in fanout_urls
+ */
+static void fanout_upload_start(struct rb_http_threaddata_s *rb_http_threaddata,
+                                int i) {
+  struct rb_http_handler_s *rb_http_handler =
+      rb_http_threaddata->rb_http_handler;
+  const struct rb_http_options_s *options = rb_http_threaddata->options;
+  struct rb_http_fanout_s *fanout = rb_http_threaddata->fanout;
+  struct rb_http_upload_s *upload = &fanout->uploads[i];
+
+  if (upload->easy_handle == NULL) {
+    upload->easy_handle = curl_easy_init();
+    curl_easy_setopt(upload->easy_handle, CURLOPT_WRITEFUNCTION,
+                     fanout_write_null);
+    curl_easy_setopt(upload->easy_handle, CURLOPT_NOSIGNAL, 1L);
+  }
+
+  // The body is shared, not copied
+  curl_easy_setopt(upload->easy_handle, CURLOPT_URL, options->fanout_urls[i]);
+  curl_easy_setopt(upload->easy_handle, CURLOPT_POSTFIELDSIZE_LARGE,
+                   (curl_off_t)fanout->len);
+  curl_easy_setopt(upload->easy_handle, CURLOPT_POSTFIELDS, fanout->body);
+  curl_easy_setopt(upload->easy_handle, CURLOPT_HTTPHEADER, fanout->headers);
+  curl_easy_setopt(upload->easy_handle, CURLOPT_VERBOSE, options->verbose);
+  curl_easy_setopt(upload->easy_handle, CURLOPT_SSL_VERIFYPEER,
+                   options->insecure ? 0L : 1L);
+  curl_easy_setopt(upload->easy_handle, CURLOPT_SSL_VERIFYHOST,
+                   options->insecure ? 0L : 2L);
+  curl_easy_setopt(upload->easy_handle, CURLOPT_TIMEOUT_MS, options->timeout);
+  curl_easy_setopt(upload->easy_handle, CURLOPT_CONNECTTIMEOUT_MS,
+                   options->conntimeout);
+  rb_http_warm_keepalive(upload->easy_handle, options);
+
+  // Uploads are paid, but don't wait: the next POST of the thread does
+  rb_http_ratelimit_take(&rb_http_handler->requests_rate,
+                         options->max_requests_per_sec,
+                         options->requests_burst, 1, rb_http_now_ms());
+  rb_http_ratelimit_take(&rb_http_handler->bytes_rate,
+                         options->max_bytes_per_sec, options->bytes_burst,
+                         (long)fanout->len, rb_http_now_ms());
+
+  if (upload->attempts > 0) {
+    ATOMIC_OP64(add, fetch, &rb_http_handler->fanout_stats[i].retries, 1);
+  }
+  upload->attempts++;
+  upload->state = RB_HTTP_UPLOAD_RUNNING;
+  curl_multi_add_handle(fanout->multi_handle, upload->easy_handle);
+}
+
+/**
+ * Collects the uploads that have finished
+ * @param  rb_http_threaddata Thread
+ * @param  retry              Failed uploads with attempts left wait to be
+ *                            sent again if set to 1
+ * @return                    Uploads acknowledged
+ */
+static int fanout_upload_done(struct rb_http_threaddata_s *rb_http_threaddata,
+                              int retry) {
+  struct rb_http_handler_s *rb_http_handler =
+      rb_http_threaddata->rb_http_handler;
+  const struct rb_http_options_s *options = rb_http_threaddata->options;
+  struct rb_http_fanout_s *fanout = rb_http_threaddata->fanout;
+  struct rb_http_upload_s *upload = NULL;
+  CURLMsg *msg = NULL;
+  long http_code = 0;
+  int msgs_left = 0;
+  int acked = 0;
+  int i = 0;
+
+  while ((msg = curl_multi_info_read(fanout->multi_handle, &msgs_left))) {
+    if (msg->msg != CURLMSG_DONE) {
+      continue;
+    }
+
+    for (i = 0; i < fanout->cnt; i++) {
+      if (fanout->uploads[i].easy_handle == msg->easy_handle) {
+        break;
+      }
+    }
+    if (i == fanout->cnt) {
+      continue;
+    }
+    upload = &fanout->uploads[i];
+
+    curl_easy_getinfo(upload->easy_handle, CURLINFO_RESPONSE_CODE, &http_code);
+    curl_multi_remove_handle(fanout->multi_handle, upload->easy_handle);
+
+    if (msg->data.result == CURLE_OK && http_code < 400) {
+      upload->state = RB_HTTP_UPLOAD_DONE;
+      upload->backoff = options->min_retry_backoff;
+      ATOMIC_OP64(add, fetch, &rb_http_handler->fanout_stats[i].sent, 1);
+      acked++;
+    } else if (retry && upload->attempts <= options->fanout_retries) {
+      if (upload->backoff == 0) {
+        upload->backoff = options->min_retry_backoff;
+      }
+      upload->state = RB_HTTP_UPLOAD_WAITING;
+      upload->retry_at = rb_http_now_ms() + upload->backoff;
+      upload->backoff *= 2;
+      if (upload->backoff > options->max_retry_backoff) {
+        upload->backoff = options->max_retry_backoff;
+      }
+    } else {
+      upload->state = RB_HTTP_UPLOAD_DONE;
+      ATOMIC_OP64(add, fetch, &rb_http_handler->fanout_stats[i].failed, 1);
+    }
+  }
+
+  return acked;
+}
+
+int rb_http_fanout_send(struct rb_http_threaddata_s *rb_http_threaddata,
+                        int acked) {
+  struct rb_http_fanout_s *fanout = rb_http_threaddata->fanout;
+  const int quorum = rb_http_threaddata->options->fanout_quorum;
+  int needed = 0;
+  int pending = 0;
+  int running = 0;
+  long wait_ms = 0;
+  long now = 0;
+  int i = 0;
+
+  if (fanout == NULL || fanout->cnt == 0 || fanout->len == 0) {
+    return 1;
+  }
+
+  needed = quorum > 0 && quorum <= fanout->cnt + 1 ? quorum : fanout->cnt + 1;
+
+  for (i = 0; i < fanout->cnt; i++) {
+    fanout->uploads[i].attempts = 0;
+    fanout_upload_start(rb_http_threaddata, i);
+  }
+
+  while (ATOMIC_OP(add, fetch,
+                   &rb_http_threaddata->rb_http_handler->thread_running, 0)) {
+    curl_multi_perform(fanout->multi_handle, &running);
+    acked += fanout_upload_done(rb_http_threaddata, 1);
+
+    // Start the retries that are due, and wait at most until the next one
+    now = rb_http_now_ms();
+    wait_ms = FANOUT_MAX_WAIT;
+    pending = 0;
+    for (i = 0; i < fanout->cnt; i++) {
+      struct rb_http_upload_s *upload = &fanout->uploads[i];
+
+      if (upload->state == RB_HTTP_UPLOAD_WAITING && upload->retry_at <= now) {
+        fanout_upload_start(rb_http_threaddata, i);
+      } else if (upload->state == RB_HTTP_UPLOAD_WAITING &&
+                 upload->retry_at - now < wait_ms) {
+        wait_ms = upload->retry_at - now;
+      }
+      pending += upload->state != RB_HTTP_UPLOAD_DONE;
+    }
+
+    if (acked >= needed || acked + pending < needed) {
+      break;
+    }
+
+    curl_multi_wait(fanout->multi_handle, NULL, 0, (int)wait_ms, NULL);
+  }
+
+  return acked >= needed;
+}
+
+void rb_http_fanout_finish(struct rb_http_threaddata_s *rb_http_threaddata) {
+  struct rb_http_handler_s *rb_http_handler =
+      rb_http_threaddata->rb_http_handler;
+  struct rb_http_fanout_s *fanout = rb_http_threaddata->fanout;
+  int running = 0;
+  int i = 0;
+
+  if (fanout == NULL) {
+    return;
+  }
+
+  do {
+    curl_multi_perform(fanout->multi_handle, &running);
+    fanout_upload_done(rb_http_threaddata, 0);
+  } while (running > 0 &&
+           curl_multi_wait(fanout->multi_handle, NULL, 0, FANOUT_MAX_WAIT,
+                           NULL) == CURLM_OK);
+
+  for (i = 0; i < fanout->cnt; i++) {
+    struct rb_http_upload_s *upload = &fanout->uploads[i];
+
+    if (upload->state == RB_HTTP_UPLOAD_RUNNING) {
+      curl_multi_remove_handle(fanout->multi_handle, upload->easy_handle);
+    }
+    if (upload->state != RB_HTTP_UPLOAD_DONE &&
+        upload->state != RB_HTTP_UPLOAD_IDLE) {
+      ATOMIC_OP64(add, fetch, &rb_http_handler->fanout_stats[i].failed, 1);
+    }
+    upload->state = RB_HTTP_UPLOAD_IDLE;
+  }
+  fanout->len = 0;
+}
+
+void rb_http_fanout_destroy(struct rb_http_threaddata_s *rb_http_threaddata) {
+  struct rb_http_fanout_s *fanout = rb_http_threaddata->fanout;
+  int i = 0;
+
+  if (fanout == NULL) {
+    return;
+  }
+
+  for (i = 0; i < RB_HTTP_MAX_DESTINATIONS - 1; i++) {
+    if (fanout->uploads[i].easy_handle != NULL) {
+      curl_easy_cleanup(fanout->uploads[i].easy_handle);
+    }
+  }
+  curl_multi_cleanup(fanout->multi_handle);
+  curl_slist_free_all(fanout->headers);
+  free(fanout->body);
+  rb_http_budget_release(rb_http_threaddata->rb_http_handler, fanout->size);
+  free(fanout);
+  rb_http_threaddata->fanout = NULL;
+}
@@ -0,0 +1,43 @@
+#include "rb_http_handler.h"
+
+/**
+ * Prepares a thread to record the body of its next POST, if there are extra
+ * destinations
+ * @param rb_http_threaddata Thread
+ * @param headers            Headers of the POST
+ */
+void rb_http_fanout_begin(struct rb_http_threaddata_s *rb_http_threaddata,
+                          const struct curl_slist *headers);
+
+/**
+ * Records a chunk of the body of the POST in progress
+ * @param rb_http_threaddata Thread
+ * @param chunk              Compressed chunk
+ * @param len                Bytes in chunk
+ */
+void rb_http_fanout_append(struct rb_http_threaddata_s *rb_http_threaddata,
+                           const char *chunk, size_t len);
+
+/**
+ * Uploads the body of the last POST to the extra destinations, until the
+ * quorum is reached or can't be reached anymore
+ * @param  rb_http_threaddata Thread
+ * @param  acked              1 if the POST to HTTP_URL was acknowledged
+ * @return                    1 if the quorum has been reached or there are
+ *                            no extra destinations
+ */
+int rb_http_fanout_send(struct rb_http_threaddata_s *rb_http_threaddata,
+                        int acked);
+
+/**
+ * Completes the uploads still in progress after rb_http_fanout_send(), so
+ * the body can be reused. Pending retries are dropped.
+ * @param rb_http_threaddata Thread
+ */
+void rb_http_fanout_finish(struct rb_http_threaddata_s *rb_http_threaddata);
+
+/**
+ * Frees the extra destinations state of a thread
+ * @param rb_http_threaddata Thread
+ */
+void rb_http_fanout_destroy(struct rb_http_threaddata_s *rb_http_threaddata);
@@ -5,8 +5,20 @@
  */
 #include "rb_http_handler.h"
 #include "../config.h"
+#include "rb_http_adaptive.h"
+#include "rb_http_budget.h"
 #include "rb_http_chunked.h"
+#include "rb_http_fanout.h"
+#include "rb_http_lanes.h"
 #include "rb_http_normal.h"
+#include "rb_http_options.h"
+#include "rb_http_partition.h"
+#include "rb_http_payload.h"
+#include "rb_http_pool.h"
+#include "rb_http_ratelimit.h"
+#include "rb_http_reports.h"
+#include "rb_http_runtime.h"
+#include "rb_http_trace.h"
 
 struct rb_http_handler_s *rb_http_handler_create(const char *urls_str,
                                                  char *err, size_t errsize) {
@@ -20,59 +32,277 @@ struct rb_http_handler_s *rb_http_handler_create(const char *urls_str,
   struct rb_http_handler_s *rb_http_handler =
       calloc(1, sizeof(struct rb_http_handler_s));
 
-  rb_http_handler->options = calloc(1, sizeof(struct rb_http_options_s));
+  rb_http_handler->options = rb_http_options_new(urls_str);
+  rb_http_handler->options_version = rb_http_handler->options->version;
+  rb_http_handler->max_messages = rb_http_handler->options->max_messages;
+  rb_http_handler->max_priority_messages =
+      rb_http_handler->options->max_priority_messages;
+  rb_http_handler->max_bytes = rb_http_handler->options->max_bytes;
+  pthread_mutex_init(&rb_http_handler->options_lock, NULL);
+  pthread_rwlock_init(&rb_http_handler->threads_lock, NULL);
 
-  rd_fifoq_init(&rb_http_handler->rfq_reports);
+  rb_http_reports_init(rb_http_handler);
+  rb_http_pool_init(&rb_http_handler->pool);
+  rb_http_ratelimit_init(&rb_http_handler->bytes_rate);
+  rb_http_ratelimit_init(&rb_http_handler->requests_rate);
 
   rb_http_handler->still_running = 0;
   rb_http_handler->msgs_left = 0;
   rb_http_handler->thread_running = 1;
 
-  rb_http_handler->options->max_messages = DEFAULT_MAX_MESSAGES;
-  rb_http_handler->options->conntimeout = DEFAULT_CONTTIMEOUT;
-  rb_http_handler->options->connections = DEFAULT_CONNECTIONS;
-  rb_http_handler->options->timeout = DEFAULT_TIMEOUT;
-  rb_http_handler->options->url = strdup(urls_str);
-  rb_http_handler->options->mode = NORMAL_MODE;
-  rb_http_handler->options->insecure = 0;
-
-  curl_global_init(CURL_GLOBAL_ALL);
+  rb_http_global_acquire();
 
   return rb_http_handler;
 }
 
+/**
+ * Creates a CHUNKED_MODE thread. Must be called with options_lock held.
+ * @param rb_http_handler Handler
+ * @param id              Index of the thread
+ */
+static void chunked_thread_start(struct rb_http_handler_s *rb_http_handler,
+                                 int id) {
+  struct rb_http_threaddata_s *rb_http_threaddata =
+      calloc(1, sizeof(struct rb_http_threaddata_s));
+
+  rb_http_handler->threads[id] = rb_http_threaddata;
+
+  rb_http_lanes_init(&rb_http_threaddata->lanes);
+  rb_http_threaddata->id = id;
+  rb_http_threaddata->post_timestamp = rb_http_now_ms();
+  rb_http_threaddata->rfq_pending = NULL;
+  rb_http_threaddata->rb_http_handler = rb_http_handler;
+  rb_http_threaddata->easy_handle = curl_easy_init();
+  rb_http_threaddata->chunks = 0;
+  rb_http_threaddata->opaque = NULL;
+  rb_http_threaddata->options = rb_http_handler->options;
+  rb_http_threaddata->options->refcnt++;
+
+  if (id >= rb_http_handler->nthreads) {
+    rb_http_handler->nthreads = id + 1;
+  }
+
+  pthread_create(&rb_http_threaddata->p_thread, NULL, &rb_http_process_chunked,
+                 rb_http_threaddata);
+}
+
+/**
+ * Joins a CHUNKED_MODE thread that has finished
+ * @param rb_http_handler Handler
+ * @param id              Index of the thread
+ * @param leftovers       Messages produced to the thread after it decided to
+ * finish are moved here
+ */
+static void chunked_thread_reap(struct rb_http_handler_s *rb_http_handler,
+                                int id, rb_http_msg_q_t *leftovers) {
+  struct rb_http_message_s *message = NULL;
+  struct rb_http_threaddata_s *rb_http_threaddata =
+      rb_http_handler->threads[id];
+
+  pthread_join(rb_http_threaddata->p_thread, NULL);
+  rb_http_handler->threads[id] = NULL;
+
+  if (rb_http_threaddata->message_next != NULL) {
+    rb_http_msg_q_add(leftovers, rb_http_threaddata->message_next);
+  }
+
+  while ((message = rb_http_lanes_pop(&rb_http_threaddata->lanes, 0, 0)) !=
+         NULL) {
+    rb_http_msg_q_add(leftovers, message);
+  }
+
+  rb_http_lanes_destroy(&rb_http_threaddata->lanes);
+  curl_easy_cleanup(rb_http_threaddata->easy_handle);
+  rb_http_fanout_destroy(rb_http_threaddata);
+  ATOMIC_OP(sub, fetch, &rb_http_handler->warm, rb_http_threaddata->warm);
+  free(rb_http_threaddata->response);
+  rb_http_budget_release(rb_http_handler, rb_http_threaddata->response_size);
+  if (rb_http_threaddata->payload_buf != NULL) {
+    free(rb_http_threaddata->payload_buf);
+    rb_http_budget_release(rb_http_handler, RB_HTTP_PAYLOAD_BUF);
+  }
+  free(rb_http_threaddata);
+}
+
+/**
+ * Starts or retires CHUNKED_MODE threads to match the current connections.
+ * Threads over the new number of connections finish once their queue is
+ * empty. Must be called with options_lock held.
+ * @param rb_http_handler Handler
+ */
+static void chunked_threads_resize(struct rb_http_handler_s *rb_http_handler) {
+  const int connections = rb_http_handler->options->connections;
+  struct rb_http_message_s *message = NULL;
+  rb_http_msg_q_t leftovers;
+  int i = 0;
+
+  rb_http_msg_q_init(&leftovers);
+
+  // No producer is holding a thread that is going to be freed
+  pthread_rwlock_wrlock(&rb_http_handler->threads_lock);
+
+  for (i = 0; i < rb_http_handler->nthreads; i++) {
+    if (rb_http_handler->threads[i] != NULL &&
+        ATOMIC_OP(add, fetch, &rb_http_handler->threads[i]->exited, 0)) {
+      chunked_thread_reap(rb_http_handler, i, &leftovers);
+    }
+  }
+
+  for (i = 0; i < connections; i++) {
+    if (rb_http_handler->threads[i] == NULL) {
+      chunked_thread_start(rb_http_handler, i);
+    }
+  }
+
+  for (i = 0; (message = rb_http_msg_q_pop(&leftovers)) != NULL; i++) {
+    const int worker =
+        message->keyed
+            ? rb_http_partition_worker(message->key_hash, connections)
+            : i % connections;
+    rb_http_lanes_add(&rb_http_handler->threads[worker]->lanes, message);
+  }
+
+  // Keys move to the new threads from now on
+  rb_http_handler->connections = connections;
+  pthread_rwlock_unlock(&rb_http_handler->threads_lock);
+}
+
 int rb_http_handler_set_opt(struct rb_http_handler_s *rb_http_handler,
                             const char *key, const char *val, char *err,
                             size_t errsize) {
   assert(rb_http_handler != NULL);
   assert(rb_http_handler->options != NULL);
 
-  if (key == NULL || val == NULL) {
-    snprintf(err, errsize, "Invalid option");
+  struct rb_http_options_s *options = NULL;
+
+  pthread_mutex_lock(&rb_http_handler->options_lock);
+
+  options = rb_http_options_dup(rb_http_handler->options);
+  if (rb_http_options_set(options, key, val, err, errsize) != 0) {
+    pthread_mutex_unlock(&rb_http_handler->options_lock);
+    rb_http_options_release(rb_http_handler, options);
     return -1;
   }
 
-  if (!strcmp(key, "RB_HTTP_CONNECTIONS")) {
-    rb_http_handler->options->connections = atoi(val);
-  } else if (!strcmp(key, "HTTP_VERBOSE")) {
-    rb_http_handler->options->verbose = atol(val);
-  } else if (!strcmp(key, "RB_HTTP_MODE")) {
-    rb_http_handler->options->mode = atoi(val);
-  } else if (!strcmp(key, "HTTP_TIMEOUT")) {
-    rb_http_handler->options->timeout = atol(val);
-  } else if (!strcmp(key, "HTTP_CONNTTIMEOUT")) {
-    rb_http_handler->options->conntimeout = atol(val);
-  } else if (!strcmp(key, "RB_HTTP_MAX_MESSAGES")) {
-    rb_http_handler->options->max_messages = atoi(val);
-  } else if (!strcmp(key, "RB_HTTP_BATCH_TIMEOUT")) {
-    rb_http_handler->options->batch_timeout = atoi(val);
-  } else if (!strcmp(key, "HTTP_INSECURE")) {
-    rb_http_handler->options->insecure = atol(val);
-  } else {
-    snprintf(err, errsize, "Error decoding option: \"%s: %s\"", key, val);
+  if (options->connections < 1 || options->connections > MAX_CONNECTIONS) {
+    pthread_mutex_unlock(&rb_http_handler->options_lock);
+    rb_http_options_release(rb_http_handler, options);
+    snprintf(err, errsize, "RB_HTTP_CONNECTIONS must be between 1 and %d",
+             MAX_CONNECTIONS);
+    return -1;
+  }
+
+  // The adaptive limit never goes below min_connections, nor above the
+  // threads there are
+  if (options->min_connections < 1 ||
+      options->min_connections > options->connections) {
+    pthread_mutex_unlock(&rb_http_handler->options_lock);
+    rb_http_options_release(rb_http_handler, options);
+    snprintf(err, errsize,
+             "RB_HTTP_MIN_CONNECTIONS must be between 1 and "
+             "RB_HTTP_CONNECTIONS");
+    return -1;
+  }
+
+  // The adaptive batch limits are clamped between their bounds
+  if ((!options->max_batch_messages_auto &&
+       options->min_batch_messages > options->max_batch_messages) ||
+      options->min_batch_timeout > options->max_batch_timeout) {
+    pthread_mutex_unlock(&rb_http_handler->options_lock);
+    rb_http_options_release(rb_http_handler, options);
+    snprintf(err, errsize, "RB_HTTP_MIN_BATCH_* must not exceed "
+                           "RB_HTTP_MAX_BATCH_*");
+    return -1;
+  }
+
+  if (rb_http_handler->runtime != NULL && options->mode == CHUNKED_MODE) {
+    pthread_mutex_unlock(&rb_http_handler->options_lock);
+    rb_http_options_release(rb_http_handler, options);
+    snprintf(err, errsize, "CHUNKED_MODE handlers can't use a runtime");
+    return -1;
+  }
+
+  if (rb_http_handler->running && options->mode != rb_http_handler->mode) {
+    pthread_mutex_unlock(&rb_http_handler->options_lock);
+    rb_http_options_release(rb_http_handler, options);
+    snprintf(err, errsize, "RB_HTTP_MODE can't be changed on a running handler");
     return -1;
   }
 
+  // Stop sending new messages to the threads that are going to be retired
+  // before they see the new options
+  if (rb_http_handler->running &&
+      options->connections < rb_http_handler->options->connections) {
+    rb_http_limit_configure(&rb_http_handler->limit, options);
+  }
+
+  rb_http_options_publish(rb_http_handler, options);
+
+  if (rb_http_handler->running) {
+    if (rb_http_handler->mode == CHUNKED_MODE) {
+      chunked_threads_resize(rb_http_handler);
+    }
+    rb_http_limit_configure(&rb_http_handler->limit, options);
+  }
+
+  pthread_mutex_unlock(&rb_http_handler->options_lock);
+
+  return 0;
+}
+
+void rb_http_handler_set_response_parser(
+    struct rb_http_handler_s *rb_http_handler, cb_response parser_fn,
+    void *opaque) {
+  assert(!rb_http_handler->running);
+
+  free(rb_http_handler->response_parser);
+  rb_http_handler->response_parser = NULL;
+
+  if (parser_fn != NULL) {
+    rb_http_handler->response_parser =
+        calloc(1, sizeof(struct rb_http_response_parser_s));
+    rb_http_handler->response_parser->fn = parser_fn;
+    rb_http_handler->response_parser->opaque = opaque;
+  }
+}
+
+void rb_http_handler_set_payload_free(
+    struct rb_http_handler_s *rb_http_handler, cb_payload_free free_fn,
+    void *opaque) {
+  assert(!rb_http_handler->running);
+
+  free(rb_http_handler->payload_free);
+  rb_http_handler->payload_free = NULL;
+
+  if (free_fn != NULL) {
+    rb_http_handler->payload_free =
+        calloc(1, sizeof(struct rb_http_payload_free_s));
+    rb_http_handler->payload_free->fn = free_fn;
+    rb_http_handler->payload_free->opaque = opaque;
+  }
+}
+
+void rb_http_handler_set_inline_reports(
+    struct rb_http_handler_s *rb_http_handler, cb_report report_fn) {
+  assert(!rb_http_handler->running);
+
+  rb_http_handler->inline_report_fn = report_fn;
+}
+
+int rb_http_handler_set_runtime(struct rb_http_handler_s *rb_http_handler,
+                                struct rb_http_runtime_s *runtime, char *err,
+                                size_t errsize) {
+  assert(!rb_http_handler->running);
+
+  pthread_mutex_lock(&rb_http_handler->options_lock);
+  if (runtime != NULL && rb_http_handler->options->mode == CHUNKED_MODE) {
+    pthread_mutex_unlock(&rb_http_handler->options_lock);
+    snprintf(err, errsize, "CHUNKED_MODE handlers can't use a runtime");
+    return -1;
+  }
+  rb_http_handler->runtime = runtime;
+  pthread_mutex_unlock(&rb_http_handler->options_lock);
+
   return 0;
 }
 
@@ -80,58 +310,51 @@ void rb_http_handler_run(struct rb_http_handler_s *rb_http_handler) {
   assert(rb_http_handler != NULL);
   assert(rb_http_handler->options != NULL);
 
-  int i = 0;
   struct rb_http_threaddata_s *rb_http_threaddata = NULL;
 
-  switch (rb_http_handler->options->mode) {
+  pthread_mutex_lock(&rb_http_handler->options_lock);
+
+  rb_http_handler->mode = rb_http_handler->options->mode;
+  rb_http_limit_init(&rb_http_handler->limit, rb_http_handler->options);
+
+  switch (rb_http_handler->mode) {
   case NORMAL_MODE:
   default:
+    rb_http_handler->mode = NORMAL_MODE;
     rb_http_threaddata = calloc(1, sizeof(struct rb_http_threaddata_s));
     rb_http_handler->threads[0] = rb_http_threaddata;
+    rb_http_handler->nthreads = 1;
 
-    rd_fifoq_init(&rb_http_threaddata->rfq);
-    rd_fifoq_init(&rb_http_handler->rfq_reports);
+    rb_http_lanes_init(&rb_http_threaddata->lanes);
+    rb_http_msg_q_init(&rb_http_threaddata->inflight);
     rb_http_threaddata->rfq_pending = NULL;
     rb_http_threaddata->rb_http_handler = rb_http_handler;
     rb_http_threaddata->opaque = NULL;
-    rb_http_handler->options->max_batch_messages =
-        rb_http_handler->options->max_messages / 10;
+    rb_http_threaddata->options = rb_http_handler->options;
+    rb_http_threaddata->options->refcnt++;
     rb_http_handler->multi_handle = curl_multi_init();
 
     curl_multi_setopt(rb_http_handler->multi_handle,
                       CURLMOPT_MAX_TOTAL_CONNECTIONS,
-                      rb_http_handler->options->connections);
-    pthread_create(&rb_http_threaddata->p_thread, NULL, &rb_http_process_normal,
-                   rb_http_threaddata);
-    break;
-  case CHUNKED_MODE:
-    for (i = 0; i < rb_http_handler->options->connections; i++) {
-      rb_http_threaddata = calloc(1, sizeof(struct rb_http_threaddata_s));
-      rb_http_handler->threads[i] = rb_http_threaddata;
-      rb_http_handler->options->max_batch_messages =
-          rb_http_handler->options->max_messages / 10;
-      rb_http_handler->options->post_timeout =
-          rb_http_handler->options->batch_timeout;
-
-      rd_fifoq_init(&rb_http_threaddata->rfq);
-      rb_http_threaddata->post_timestamp = time(NULL);
-      rb_http_threaddata->rfq_pending = NULL;
-      rb_http_threaddata->rb_http_handler = rb_http_handler;
-      rb_http_threaddata->easy_handle = curl_easy_init();
-      rb_http_threaddata->chunks = 0;
-      rb_http_threaddata->opaque = NULL;
-
-      if (rb_http_handler->options->insecure) {
-        curl_easy_setopt(rb_http_threaddata->easy_handle,
-                         CURLOPT_SSL_VERIFYPEER, 0);
-        curl_easy_setopt(rb_http_threaddata->easy_handle,
-                         CURLOPT_SSL_VERIFYHOST, 0);
-      }
-
+                      (long)rb_http_handler->limit.limit);
+    if (rb_http_handler->runtime == NULL) {
       pthread_create(&rb_http_threaddata->p_thread, NULL,
-                     &rb_http_process_chunked, rb_http_threaddata);
+                     &rb_http_process_normal, rb_http_threaddata);
     }
     break;
+  case CHUNKED_MODE:
+    chunked_threads_resize(rb_http_handler);
+    break;
+  }
+
+  rb_http_handler->running = 1;
+
+  pthread_mutex_unlock(&rb_http_handler->options_lock);
+
+  // The worker may refresh the options as soon as it has the handler
+  if (rb_http_handler->mode == NORMAL_MODE &&
+      rb_http_handler->runtime != NULL) {
+    rb_http_runtime_attach(rb_http_handler->runtime, rb_http_threaddata);
   }
 }
 
@@ -143,71 +366,239 @@ void rb_http_handler_destroy(struct rb_http_handler_s *rb_http_handler,
   (void)errsize;
 
   int i = 0;
-  ATOMIC_OP(sub, fetch, &rb_http_handler->thread_running, 1);
 
-  rd_fifoq_destroy(&rb_http_handler->rfq_reports);
-  if (rb_http_handler->options->url != NULL) {
-    free(rb_http_handler->options->url);
+  // Give queued messages a chance to be sent before stopping the threads
+  if (rb_http_handler->running) {
+    rb_http_flush(rb_http_handler, NULL,
+                  (int)rb_http_handler->options->drain_timeout);
   }
 
-  if (rb_http_handler->options->mode == NORMAL_MODE) {
-    pthread_join(rb_http_handler->threads[0]->p_thread, NULL);
-    curl_multi_cleanup(rb_http_handler->multi_handle);
-    free(rb_http_handler->threads[0]);
+  pthread_mutex_lock(&rb_http_handler->options_lock);
+  ATOMIC_OP(sub, fetch, &rb_http_handler->thread_running, 1);
+  for (i = 0; i < rb_http_handler->nthreads; i++) {
+    if (rb_http_handler->threads[i] != NULL) {
+      rb_http_lanes_wake(&rb_http_handler->threads[i]->lanes);
+    }
+  }
+  pthread_mutex_unlock(&rb_http_handler->options_lock);
+
+  if (rb_http_handler->mode == NORMAL_MODE) {
+    if (rb_http_handler->threads[0] != NULL &&
+        rb_http_handler->threads[0]->worker != NULL) {
+      rb_http_runtime_detach(rb_http_handler->threads[0]);
+    } else if (rb_http_handler->threads[0] != NULL) {
+      pthread_join(rb_http_handler->threads[0]->p_thread, NULL);
+      rb_http_normal_abort(rb_http_handler->threads[0]);
+      curl_multi_cleanup(rb_http_handler->multi_handle);
+    }
   } else {
-    for (i = 0; i < rb_http_handler->options->connections; i++) {
+    for (i = 0; i < rb_http_handler->nthreads; i++) {
+      if (rb_http_handler->threads[i] == NULL) {
+        continue;
+      }
       pthread_join(rb_http_handler->threads[i]->p_thread, NULL);
       curl_easy_cleanup(rb_http_handler->threads[i]->easy_handle);
-      free(rb_http_handler->threads[i]);
+      rb_http_fanout_destroy(rb_http_handler->threads[i]);
     }
   }
 
-  free(rb_http_handler->options);
+  // Messages not sent before the drain timeout are discarded
+  for (i = 0; i < rb_http_handler->nthreads; i++) {
+    struct rb_http_message_s *message = NULL;
+
+    if (rb_http_handler->threads[i] == NULL) {
+      continue;
+    }
+    if (rb_http_handler->threads[i]->message_next != NULL) {
+      rb_http_lanes_add(&rb_http_handler->threads[i]->lanes,
+                        rb_http_handler->threads[i]->message_next);
+    }
+    while ((message = rb_http_lanes_pop(&rb_http_handler->threads[i]->lanes,
+                                        0, 0)) != NULL) {
+      rb_http_message_free(rb_http_handler, message);
+    }
+    rb_http_lanes_destroy(&rb_http_handler->threads[i]->lanes);
+    free(rb_http_handler->threads[i]->response);
+    free(rb_http_handler->threads[i]->payload_buf);
+    free(rb_http_handler->threads[i]->probe_handles);
+    free(rb_http_handler->threads[i]);
+  }
+
+  rb_http_reports_destroy(rb_http_handler);
+
+  if (rb_http_handler->running) {
+    rb_http_limit_destroy(&rb_http_handler->limit);
+  }
+
+  rb_http_options_release(rb_http_handler, rb_http_handler->options);
+  pthread_mutex_destroy(&rb_http_handler->options_lock);
+  pthread_rwlock_destroy(&rb_http_handler->threads_lock);
+  rb_http_pool_destroy(&rb_http_handler->pool);
+  rb_http_ratelimit_destroy(&rb_http_handler->bytes_rate);
+  rb_http_ratelimit_destroy(&rb_http_handler->requests_rate);
+  rb_http_trace_destroy(rb_http_handler->trace);
+  free(rb_http_handler->response_parser);
+  free(rb_http_handler->payload_free);
   free(rb_http_handler);
 
-  curl_global_cleanup();
+  rb_http_global_release();
 }
 
-int rb_http_produce(struct rb_http_handler_s *handler, char *buff, size_t len,
-                    int flags, char *err, size_t errsize, void *opaque) {
+/**
+ * Queues a message
+ * @param  handler Handler
+ * @param  payload Message with the payload fields set: payload and len, or
+ * len and the source fields
+ * @param  flags   RB_HTTP_MESSAGE_F_* flags
+ * @param  ttl_ms  Time to live (ms). 0 uses RB_HTTP_MESSAGE_TTL option.
+ * @param  key     Partitioning key, NULL to spread messages over workers
+ * @param  keylen  Length of the key
+ * @param  err     Error string
+ * @param  errsize Length of the error string
+ * @param  opaque  Opaque passed to the report callback
+ * @return         0 if the message has been queued
+ */
+static int produce0(struct rb_http_handler_s *handler,
+                    const struct rb_http_message_s *payload, int flags,
+                    long ttl_ms, const char *key, size_t keylen, char *err,
+                    size_t errsize, void *opaque) {
 
   int error = 0;
-  if (ATOMIC_OP(add, fetch, &handler->left, 1) <
-      handler->options->max_messages) {
-    struct rb_http_message_s *message =
-        calloc(1, sizeof(struct rb_http_message_s) +
-                      ((flags & RB_HTTP_MESSAGE_F_COPY) ? len : 0));
+  const size_t len = payload->len;
+  const int lane = (flags & RB_HTTP_MESSAGE_F_PRIORITY) ? RB_HTTP_LANE_PRIORITY
+                                                         : RB_HTTP_LANE_NORMAL;
+  const int max_messages =
+      lane == RB_HTTP_LANE_PRIORITY
+          ? ATOMIC_OP(add, fetch, &handler->max_priority_messages, 0)
+          : ATOMIC_OP(add, fetch, &handler->max_messages, 0);
+  const size_t bytes =
+      sizeof(struct rb_http_message_s) +
+      ((payload->source == RB_HTTP_SOURCE_MEMORY &&
+        (flags & (RB_HTTP_MESSAGE_F_COPY | RB_HTTP_MESSAGE_F_FREE |
+                  RB_HTTP_MESSAGE_F_POOL)))
+           ? len
+           : 0);
+
+  // Empty messages would never be reported
+  if (len == 0 || (payload->payload == NULL &&
+                   (payload->source == RB_HTTP_SOURCE_MEMORY ||
+                    payload->source == RB_HTTP_SOURCE_MMAP))) {
+    snprintf(err, errsize, "librbhttp empty message");
+    return 1;
+  }
 
+  // The length of a message must fit in its 32 bits prefix
+  if (ATOMIC_OP(add, fetch, &handler->framing, 0) ==
+          RB_HTTP_FRAMING_LENGTH_PREFIX &&
+      len > UINT32_MAX) {
+    snprintf(err, errsize, "librbhttp message too big for its length prefix");
+    return 1;
+  }
+
+  // Only buffers can be copied or pooled, and only the library can release
+  // them
+  if ((payload->source != RB_HTTP_SOURCE_MEMORY &&
+       (flags & (RB_HTTP_MESSAGE_F_COPY | RB_HTTP_MESSAGE_F_POOL))) ||
+      ((flags & RB_HTTP_MESSAGE_F_COPY) && (flags & RB_HTTP_MESSAGE_F_POOL)) ||
+      (payload->source == RB_HTTP_SOURCE_PULL &&
+       (flags & RB_HTTP_MESSAGE_F_FREE))) {
+    snprintf(err, errsize, "librbhttp invalid flags for this payload");
+    return 1;
+  }
+
+  if (!rb_http_budget_charge(handler, bytes, 0)) {
+    ATOMIC_OP64(add, fetch, &handler->lane_stats[lane].rejected, 1);
+    snprintf(err, errsize, "librbhttp memory budget exceeded");
+    return 1;
+  }
+
+  if (ATOMIC_OP(add, fetch, &handler->lane_left[lane], 1) < max_messages) {
+    // Messages are recycled, and so are copied payloads with them
+    struct rb_http_message_s *message = rb_http_pool_get(
+        &handler->pool, sizeof(struct rb_http_message_s) +
+                            ((flags & RB_HTTP_MESSAGE_F_COPY) ? len : 0));
+
+    if (message == NULL) {
+      ATOMIC_OP(sub, fetch, &handler->lane_left[lane], 1);
+      rb_http_budget_release(handler, bytes);
+      snprintf(err, errsize, "librbhttp can't allocate message");
+      return 1;
+    }
+
+    // Counted once the message can't fail anymore
+    ATOMIC_OP(add, fetch, &handler->left, 1);
+    ATOMIC_OP(add, fetch, &handler->outstanding, 1);
+    ATOMIC_OP64(add, fetch, &handler->lane_stats[lane].produced, 1);
+
+    memset(message, 0, sizeof(*message));
     message->len = len;
+    message->bytes = bytes;
     message->client_opaque = opaque;
+    message->lane = lane;
+    message->produced = rb_http_now_ms();
+    message->source = payload->source;
+    message->fd = payload->fd;
+    message->offset = payload->offset;
+    message->read_fn = payload->read_fn;
+
+    if (ttl_ms == 0) {
+      ttl_ms = ATOMIC_OP(add, fetch, &handler->message_ttl, 0);
+    }
+    if (ttl_ms > 0) {
+      message->expires = message->produced + ttl_ms;
+    }
+
+    if (key != NULL) {
+      message->keyed = 1;
+      message->key_hash = rb_http_partition_hash(key, keylen);
+    }
 
     if (flags & RB_HTTP_MESSAGE_F_COPY) {
       message->payload = (char *)&message[1];
-      memcpy(message->payload, buff, len);
+      memcpy(message->payload, payload->payload, len);
     } else {
-      message->payload = buff;
+      message->payload = payload->payload;
     }
 
-    if (flags & RB_HTTP_MESSAGE_F_FREE) {
+    // A copied payload is freed with its message
+    if (!(flags & RB_HTTP_MESSAGE_F_COPY) &&
+        (flags & (RB_HTTP_MESSAGE_F_FREE | RB_HTTP_MESSAGE_F_POOL))) {
       message->free_message = 1;
     } else {
       message->free_message = 0;
     }
-
-    if (message != NULL && message->len > 0 && message->payload != NULL) {
-      if (handler->options->mode == CHUNKED_MODE) {
-        const uint64_t next_thread =
-            ATOMIC_OP(fetch, add, &handler->next_thread, 1) %
-            handler->options->connections;
-
-        message->timestamp = time(NULL);
-        rd_fifoq_add(&handler->threads[next_thread]->rfq, message);
-      } else {
-        rd_fifoq_add(&handler->threads[0]->rfq, message);
+    message->pooled = (flags & RB_HTTP_MESSAGE_F_POOL) != 0;
+    message->marked = (flags & RB_HTTP_MESSAGE_F_MARK) != 0;
+
+    if (handler->mode == CHUNKED_MODE) {
+      // The thread chosen is not retired until the message is queued
+      pthread_rwlock_rdlock(&handler->threads_lock);
+
+      // Keys keep their thread while the requests limit changes. Other
+      // messages only go to threads allowed to send by the limit.
+      const uint64_t next_thread =
+          message->keyed
+              ? (uint64_t)rb_http_partition_worker(message->key_hash,
+                                                   handler->connections)
+              : ATOMIC_OP(fetch, add, &handler->next_thread, 1) %
+                    (uint64_t)ATOMIC_OP(add, fetch, &handler->limit.limit, 0);
+
+      RB_HTTP_TRACE(handler, RB_HTTP_TRACE_ENQUEUE, enqueue, (int)next_thread,
+                    (uintptr_t)message, len);
+      rb_http_lanes_add(&handler->threads[next_thread]->lanes, message);
+      pthread_rwlock_unlock(&handler->threads_lock);
+    } else {
+      RB_HTTP_TRACE(handler, RB_HTTP_TRACE_ENQUEUE, enqueue, 0,
+                    (uintptr_t)message, len);
+      rb_http_lanes_add(&handler->threads[0]->lanes, message);
+      if (handler->threads[0]->worker != NULL) {
+        rb_http_runtime_wake(handler->threads[0]->worker);
       }
     }
   } else {
-    ATOMIC_OP(sub, fetch, &handler->left, 1);
+    ATOMIC_OP(sub, fetch, &handler->lane_left[lane], 1);
+    rb_http_budget_release(handler, bytes);
+    ATOMIC_OP64(add, fetch, &handler->lane_stats[lane].rejected, 1);
     error++;
     snprintf(err, errsize, "librbhttp internal queue full");
   }
@@ -215,6 +606,64 @@ int rb_http_produce(struct rb_http_handler_s *handler, char *buff, size_t len,
   return error;
 }
 
+int rb_http_produce(struct rb_http_handler_s *handler, char *buff, size_t len,
+                    int flags, char *err, size_t errsize, void *opaque) {
+  const struct rb_http_message_s payload = {.payload = buff, .len = len};
+
+  return produce0(handler, &payload, flags, 0, NULL, 0, err, errsize, opaque);
+}
+
+int rb_http_produce_ttl(struct rb_http_handler_s *handler, char *buff,
+                        size_t len, int flags, long ttl_ms, char *err,
+                        size_t errsize, void *opaque) {
+  const struct rb_http_message_s payload = {.payload = buff, .len = len};
+
+  return produce0(handler, &payload, flags, ttl_ms, NULL, 0, err, errsize,
+                  opaque);
+}
+
+int rb_http_produce_key(struct rb_http_handler_s *handler, char *buff,
+                        size_t len, int flags, const char *key,
+                        size_t keylen, char *err, size_t errsize,
+                        void *opaque) {
+  const struct rb_http_message_s payload = {.payload = buff, .len = len};
+
+  return produce0(handler, &payload, flags, 0, key, keylen, err, errsize,
+                  opaque);
+}
+
+int rb_http_produce_mmap(struct rb_http_handler_s *handler, void *addr,
+                         size_t len, int flags, char *err, size_t errsize,
+                         void *opaque) {
+  const struct rb_http_message_s payload = {
+      .payload = addr, .len = len, .source = RB_HTTP_SOURCE_MMAP};
+
+  return produce0(handler, &payload, flags, 0, NULL, 0, err, errsize, opaque);
+}
+
+int rb_http_produce_fd(struct rb_http_handler_s *handler, int fd, off_t offset,
+                       size_t len, int flags, char *err, size_t errsize,
+                       void *opaque) {
+  const struct rb_http_message_s payload = {
+      .len = len, .source = RB_HTTP_SOURCE_FD, .fd = fd, .offset = offset};
+
+  return produce0(handler, &payload, flags, 0, NULL, 0, err, errsize, opaque);
+}
+
+int rb_http_produce_pull(struct rb_http_handler_s *handler, cb_payload read_fn,
+                         size_t len, int flags, char *err, size_t errsize,
+                         void *opaque) {
+  const struct rb_http_message_s payload = {
+      .len = len, .source = RB_HTTP_SOURCE_PULL, .read_fn = read_fn};
+
+  if (read_fn == NULL) {
+    snprintf(err, errsize, "librbhttp empty message");
+    return 1;
+  }
+
+  return produce0(handler, &payload, flags, 0, NULL, 0, err, errsize, opaque);
+}
+
 int rb_http_batch_produce(struct rb_http_handler_s *handler, char *buff,
                           size_t len, int flags, char *err, size_t errsize,
                           void *opaque) {
@@ -231,18 +680,235 @@ int rb_http_batch_produce(struct rb_http_handler_s *handler, char *buff,
   return 0;
 }
 
+int rb_http_handler_get_stats(struct rb_http_handler_s *rb_http_handler,
+                              char *buf, size_t bufsiz) {
+  assert(rb_http_handler != NULL);
+  assert(rb_http_handler->options != NULL);
+
+  int i = 0;
+  int len = 0;
+  int first = 1;
+  int queued = 0;
+  int min_queued = -1;
+  int max_queued = 0;
+  struct rb_http_threaddata_s *rb_http_threaddata = NULL;
+  struct rb_http_options_s *options = NULL;
+  struct rb_http_ratelimit_s *bytes_rate = &rb_http_handler->bytes_rate;
+  struct rb_http_ratelimit_s *requests_rate = &rb_http_handler->requests_rate;
+
+#define STATS_PRINTF(...)                                                      \
+  len += snprintf(buf + ((size_t)len < bufsiz ? (size_t)len : bufsiz),        \
+                  (size_t)len < bufsiz ? bufsiz - (size_t)len : 0,             \
+                  __VA_ARGS__)
+
+  // Threads are not started or retired while the lock is held
+  pthread_mutex_lock(&rb_http_handler->options_lock);
+  options = rb_http_handler->options;
+
+  STATS_PRINTF("{\"mode\":%d,\"options_version\":%" PRIu64 ",\"left\":%d,"
+               "\"warm\":%d,",
+               options->mode, options->version,
+               ATOMIC_OP(add, fetch, &rb_http_handler->left, 0),
+               ATOMIC_OP(add, fetch, &rb_http_handler->warm, 0));
+
+  STATS_PRINTF("\"memory\":{\"used\":%" PRIu64 ",\"max\":%ld,"
+               "\"pool_misses\":%" PRIu64 "},",
+               ATOMIC_OP64(add, fetch, &rb_http_handler->bytes, 0),
+               options->max_bytes,
+               ATOMIC_OP64(add, fetch, &rb_http_handler->pool.misses, 0));
+
+  STATS_PRINTF(
+      "\"rate_limit\":{\"bytes_per_sec\":%ld,\"requests_per_sec\":%ld,"
+      "\"bytes_throttled\":%" PRIu64 ",\"bytes_throttled_ms\":%" PRIu64
+      ",\"requests_throttled\":%" PRIu64 ",\"requests_throttled_ms\":%" PRIu64
+      "},",
+      options->max_bytes_per_sec, options->max_requests_per_sec,
+      ATOMIC_OP64(add, fetch, &bytes_rate->throttled, 0),
+      ATOMIC_OP64(add, fetch, &bytes_rate->throttled_ms, 0),
+      ATOMIC_OP64(add, fetch, &requests_rate->throttled, 0),
+      ATOMIC_OP64(add, fetch, &requests_rate->throttled_ms, 0));
+
+  STATS_PRINTF("\"destinations\":[");
+  for (i = 0; i < options->fanout_cnt; i++) {
+    struct rb_http_destination_stats_s *stats =
+        &rb_http_handler->fanout_stats[i];
+
+    STATS_PRINTF("%s{\"url\":\"%s\",\"sent\":%" PRIu64
+                 ",\"failed\":%" PRIu64 ",\"retries\":%" PRIu64 "}",
+                 i == 0 ? "" : ",", options->fanout_urls[i],
+                 ATOMIC_OP64(add, fetch, &stats->sent, 0),
+                 ATOMIC_OP64(add, fetch, &stats->failed, 0),
+                 ATOMIC_OP64(add, fetch, &stats->retries, 0));
+  }
+  STATS_PRINTF("],");
+
+  pthread_mutex_lock(&rb_http_handler->limit.lock);
+  STATS_PRINTF("\"connections\":{\"limit\":%d,\"min\":%d,\"max\":%d,"
+               "\"in_flight\":%d,\"latency\":%.1f,\"base_latency\":%.1f,"
+               "\"increases\":%" PRIu64 ",\"decreases\":%" PRIu64 "},",
+               rb_http_handler->limit.limit, rb_http_handler->limit.min,
+               rb_http_handler->limit.max,
+               rb_http_handler->mode == CHUNKED_MODE
+                   ? rb_http_handler->limit.in_flight
+                   : rb_http_handler->still_running,
+               rb_http_handler->limit.latency,
+               rb_http_handler->limit.base_latency,
+               rb_http_handler->limit.increases,
+               rb_http_handler->limit.decreases);
+  pthread_mutex_unlock(&rb_http_handler->limit.lock);
+
+  STATS_PRINTF("\"lanes\":[");
+  for (i = 0; i < RB_HTTP_LANES; i++) {
+    struct rb_http_lane_stats_s *stats = &rb_http_handler->lane_stats[i];
+    const uint64_t dequeued = ATOMIC_OP64(add, fetch, &stats->dequeued, 0);
+    const uint64_t delivered = ATOMIC_OP64(add, fetch, &stats->delivered, 0);
+
+    STATS_PRINTF("%s{\"lane\":\"%s\",\"left\":%d,\"produced\":%" PRIu64
+                 ",\"rejected\":%" PRIu64 ",\"expired\":%" PRIu64
+                 ",\"queue_latency\":%.1f,"
+                 "\"delivery_latency\":%.1f}",
+                 i == 0 ? "" : ",",
+                 i == RB_HTTP_LANE_PRIORITY ? "priority" : "normal",
+                 ATOMIC_OP(add, fetch, &rb_http_handler->lane_left[i], 0),
+                 ATOMIC_OP64(add, fetch, &stats->produced, 0),
+                 ATOMIC_OP64(add, fetch, &stats->rejected, 0),
+                 ATOMIC_OP64(add, fetch, &stats->expired, 0),
+                 dequeued ? (double)ATOMIC_OP64(add, fetch, &stats->queue_time,
+                                                0) /
+                                (double)dequeued
+                          : 0.0,
+                 delivered ? (double)ATOMIC_OP64(add, fetch,
+                                                 &stats->delivery_time, 0) /
+                                 (double)delivered
+                           : 0.0);
+  }
+  STATS_PRINTF("],");
+
+  STATS_PRINTF("\"workers\":[");
+
+  for (i = 0; rb_http_handler->mode == CHUNKED_MODE &&
+              i < rb_http_handler->nthreads;
+       i++) {
+    rb_http_threaddata = rb_http_handler->threads[i];
+    if (rb_http_threaddata == NULL) {
+      continue;
+    }
+
+    queued = rb_http_lanes_cnt(&rb_http_threaddata->lanes);
+    if (i < options->connections) {
+      if (min_queued < 0 || queued < min_queued) {
+        min_queued = queued;
+      }
+      if (queued > max_queued) {
+        max_queued = queued;
+      }
+    }
+
+    STATS_PRINTF("%s{\"id\":%d,\"options_version\":%" PRIu64 ","
+                 "\"retiring\":%d,\"queued\":%d,\"steals\":%" PRIu64
+                 ",\"stolen\":%" PRIu64 ",\"batch_messages\":%d,"
+                 "\"batch_timeout\":%ld,\"arrival_rate\":%.3f,"
+                 "\"latency\":%.1f,\"error_rate\":%.3f}",
+                 first ? "" : ",", i,
+                 rb_http_threaddata->options != NULL
+                     ? rb_http_threaddata->options->version
+                     : 0,
+                 i >= options->connections, queued,
+                 ATOMIC_OP64(add, fetch, &rb_http_threaddata->steals, 0),
+                 ATOMIC_OP64(add, fetch, &rb_http_threaddata->stolen, 0),
+                 rb_http_threaddata->adaptive.batch_messages,
+                 rb_http_threaddata->adaptive.batch_timeout,
+                 rb_http_threaddata->adaptive.rate * 1000,
+                 rb_http_threaddata->adaptive.latency,
+                 rb_http_threaddata->adaptive.errors);
+    first = 0;
+  }
+
+  // Difference between the most and the least loaded threads
+  STATS_PRINTF("],\"imbalance\":%d}",
+               min_queued < 0 ? 0 : max_queued - min_queued);
+
+  pthread_mutex_unlock(&rb_http_handler->options_lock);
+
+#undef STATS_PRINTF
+
+  return len;
+}
+
 int rb_http_get_reports(struct rb_http_handler_s *rb_http_handler,
                         cb_report report_fn, int timeout_ms) {
 
-  switch (rb_http_handler->options->mode) {
-  case NORMAL_MODE:
-    return rb_http_get_reports_normal(rb_http_handler, report_fn, timeout_ms);
-    break;
-  case CHUNKED_MODE:
-    return rb_http_get_reports_chunked(rb_http_handler, report_fn, timeout_ms);
-    break;
+  rb_http_reports_clear_fd(rb_http_handler);
+
+  return rb_http_reports_get(rb_http_handler, report_fn, timeout_ms, 0, 1);
+}
+
+int rb_http_get_reports_consumer(struct rb_http_handler_s *rb_http_handler,
+                                 cb_report report_fn, int timeout_ms,
+                                 int consumer, int nconsumers) {
+  assert(nconsumers > 0 && consumer >= 0 && consumer < nconsumers);
+
+  return rb_http_reports_get(rb_http_handler, report_fn, timeout_ms, consumer,
+                             nconsumers);
+}
+
+int rb_http_flush(struct rb_http_handler_s *rb_http_handler,
+                  cb_report report_fn, int timeout_ms) {
+  const long deadline = rb_http_now_ms() + timeout_ms;
+  long now = 0;
+  int i = 0;
+  int left = 0;
+
+  if (!rb_http_handler->running) {
+    return ATOMIC_OP(add, fetch, &rb_http_handler->left, 0);
+  }
+
+  // Open batches are closed as soon as their workers run out of messages
+  pthread_mutex_lock(&rb_http_handler->options_lock);
+  ATOMIC_OP(add, fetch, &rb_http_handler->flushing, 1);
+  for (i = 0; i < rb_http_handler->nthreads; i++) {
+    if (rb_http_handler->threads[i] != NULL) {
+      rb_http_lanes_wake(&rb_http_handler->threads[i]->lanes);
+    }
+  }
+  pthread_mutex_unlock(&rb_http_handler->options_lock);
+
+  while (1) {
+    // rb_http_get_reports() only returns when no report arrives on time, so
+    // it is not allowed to wait to keep the deadline
+    left = report_fn != NULL
+               ? rb_http_get_reports(rb_http_handler, report_fn, 0)
+               : ATOMIC_OP(add, fetch, &rb_http_handler->outstanding, 0);
+    now = rb_http_now_ms();
+    if (left == 0 || now >= deadline) {
+      break;
+    }
+
+    // Woken up by every report, so the deadline is the only wait left
+    rb_http_reports_wait_cnt(rb_http_handler,
+                             report_fn != NULL ? &rb_http_handler->left
+                                               : &rb_http_handler->outstanding,
+                             report_fn != NULL, (int)(deadline - now));
+  }
+
+  ATOMIC_OP(sub, fetch, &rb_http_handler->flushing, 1);
+
+  return left;
+}
+
+const char *rb_http_strerror(int status_code) {
+  switch (status_code) {
+  case RB_HTTP_ERR_EXPIRED:
+    return "Message expired before it could be sent";
+  case RB_HTTP_ERR_REJECTED:
+    return "Message rejected by the server";
+  case RB_HTTP_ERR_RETRY:
+    return "Message to be sent again";
+  case RB_HTTP_ERR_QUORUM:
+    return "Message not acknowledged by enough destinations";
+  case RB_HTTP_ERR_ABORTED:
+    return "Message request aborted when the handler was destroyed";
   default:
-    return rb_http_get_reports_normal(rb_http_handler, report_fn, timeout_ms);
-    break;
+    return curl_easy_strerror((CURLcode)status_code);
   }
 }
@@ -16,20 +16,352 @@
 
 #define RB_HTTP_MESSAGE_F_FREE 1
 #define RB_HTTP_MESSAGE_F_COPY 2
+#define RB_HTTP_MESSAGE_F_PRIORITY 4
+#define RB_HTTP_MESSAGE_F_POOL 8
+#define RB_HTTP_MESSAGE_F_MARK 16
 #define DEFAULT_MAX_TOTAL_CONNECTIONS 4
 #define DEFAULT_MAX_MESSAGES 5000
+#define DEFAULT_MAX_PRIORITY_MESSAGES 1000
+#define DEFAULT_PRIORITY_WEIGHT 4
 #define DEFAULT_TIMEOUT 10000L
 #define DEFAULT_CONTTIMEOUT 3000L
 #define DEFAULT_CONNECTIONS 4
+#define DEFAULT_MIN_CONNECTIONS 1
+#define DEFAULT_MIN_BATCH_MESSAGES 1
+#define DEFAULT_MIN_BATCH_TIMEOUT 10L
+#define DEFAULT_MAX_BATCH_TIMEOUT 1000L
+#define DEFAULT_MIN_RETRY_BACKOFF 100L
+#define DEFAULT_MAX_RETRY_BACKOFF 5000L
+#define DEFAULT_STEAL_INTERVAL 100
+#define DEFAULT_DRAIN_TIMEOUT 10000L
+#define DEFAULT_MAX_MESSAGE_RETRIES 3
+#define DEFAULT_FANOUT_RETRIES 2
 #define MAX_CONNECTIONS 4096
+#define RB_HTTP_REPORT_SHARDS 16
+// Memory of a deflate stream with the default windowBits and memLevel
+#define RB_HTTP_DEFLATE_BYTES (sizeof(z_stream) + (1 << 17) + (1 << 17))
+
+// Report status of messages dropped because their TTL expired before they
+// could be sent
+#define RB_HTTP_ERR_EXPIRED -2
+
+// Statuses a response parser can give to a message. Rejected messages are
+// reported with RB_HTTP_ERR_REJECTED, and so are messages to resend once
+// RB_HTTP_MAX_MESSAGE_RETRIES is reached.
+#define RB_HTTP_ERR_REJECTED -3
+#define RB_HTTP_ERR_RETRY -4
+
+// Report status of messages that less than RB_HTTP_FANOUT_QUORUM destinations
+// acknowledged
+#define RB_HTTP_ERR_QUORUM -5
+
+// Report status of messages whose request was still in progress when the
+// handler was destroyed
+#define RB_HTTP_ERR_ABORTED -6
+
+// CHUNKED_MODE: Destinations of a handler, HTTP_URL included
+#define RB_HTTP_MAX_DESTINATIONS 8
+
+// State of the upload of a batch body to an extra destination
+#define RB_HTTP_UPLOAD_IDLE 0    // No body to upload
+#define RB_HTTP_UPLOAD_RUNNING 1 // Request in progress
+#define RB_HTTP_UPLOAD_WAITING 2 // Waiting to retry a failed request
+#define RB_HTTP_UPLOAD_DONE 3    // Acknowledged, or out of retries
+
+// Where the payload of a message is read from
+#define RB_HTTP_SOURCE_MEMORY 0 // Buffer given to rb_http_produce()
+#define RB_HTTP_SOURCE_MMAP 1   // Mapped region, munmap()'ed if owned
+#define RB_HTTP_SOURCE_FD 2     // Range of a file, close()'d if owned
+#define RB_HTTP_SOURCE_PULL 3   // Read with a callback
+
+// Recycled buffers of 256 B to 64 KB. Bigger ones are malloc()'ed.
+#define RB_HTTP_POOL_MIN_SHIFT 8
+#define RB_HTTP_POOL_CLASSES 9
+#define RB_HTTP_POOL_CACHED_BYTES (2 << 20) // Free bytes kept per size class
+
+// Buffer a connection thread reads file and callback payloads into
+#define RB_HTTP_PAYLOAD_BUF (64 * 1024)
+
+// Runtime workers: messages a handler can start before the next handler of
+// the worker gets its turn, and max sleep between looks at the queues and
+// the options (ms)
+#define RB_HTTP_RUNTIME_QUANTUM 16
+#define RB_HTTP_RUNTIME_MAX_WAIT 100
+#define MAX_RUNTIME_WORKERS 256
 
 #define NORMAL_MODE 0
 #define CHUNKED_MODE 1
 
+// CHUNKED_MODE: How messages are delimited in the body of a POST
+#define RB_HTTP_FRAMING_NONE 0          // Payloads are concatenated
+#define RB_HTTP_FRAMING_NDJSON 1        // Every payload ends with '\n'
+#define RB_HTTP_FRAMING_JSON_ARRAY 2    // [payload,payload]
+#define RB_HTTP_FRAMING_LENGTH_PREFIX 3 // 32 bits big endian length + payload
+
+// Parts of a framed message, in the order they are compressed
+#define RB_HTTP_FRAME_HEAD 0
+#define RB_HTTP_FRAME_PAYLOAD 1
+#define RB_HTTP_FRAME_TAIL 2
+
+// Events of the trace ring, and USDT probes of the same name
+#define RB_HTTP_TRACE_ENQUEUE 0    // Message queued: message, length
+#define RB_HTTP_TRACE_DEQUEUE 1    // Message taken to send: message, wait ms
+#define RB_HTTP_TRACE_COMPRESS 2   // Deflate call: bytes in, bytes out
+#define RB_HTTP_TRACE_CHUNK 3      // Chunk given to curl: bytes, messages
+#define RB_HTTP_TRACE_POST_START 4 // POST started: message or messages, bytes
+#define RB_HTTP_TRACE_POST_END 5   // POST done: HTTP code, curl code
+#define RB_HTTP_TRACE_REPORT 6     // Message reported: message, status
+
+#define RB_HTTP_LANE_NORMAL 0
+#define RB_HTTP_LANE_PRIORITY 1
+#define RB_HTTP_LANES 2
+
+#define RB_HTTP_TIMER_LEVELS 4
+#define RB_HTTP_TIMER_SLOT_BITS 6
+#define RB_HTTP_TIMER_SLOTS (1 << RB_HTTP_TIMER_SLOT_BITS)
+
+////////////////////////////////////////////////////////////////////////////////
+/// Types
+////////////////////////////////////////////////////////////////////////////////
+
+struct rb_http_handler_s;
+
+/**
+ * [void  description]
+ * @param  opaque [description]
+ * @return        [description]
+ */
+typedef void (*cb_report)(struct rb_http_handler_s *rb_http_handler,
+                          int status_code, long http_code,
+                          const char *status_code_str, char *buff,
+                          size_t bufsiz, void *opaque);
+
+/**
+ * Parses the response of a CHUNKED_MODE POST to get the result of every
+ * message in it.
+ * @param  rb_http_handler Handler
+ * @param  http_code       HTTP response code
+ * @param  body            Response, truncated to RB_HTTP_MAX_RESPONSE_BYTES
+ * @param  len             Length of the response
+ * @param  status          Array to fill with the status of each message, in
+ * the order they were produced: 0 if delivered, RB_HTTP_ERR_RETRY to send it
+ * again, or any other value to report it with.
+ * @param  nmessages       Messages in the POST
+ * @param  opaque          Opaque given to rb_http_handler_set_response_parser()
+ * @return                 0 if status has been filled. Otherwise the status
+ * of the POST is reported for all the messages.
+ */
+typedef int (*cb_response)(struct rb_http_handler_s *rb_http_handler,
+                           long http_code, const char *body, size_t len,
+                           int *status, size_t nmessages, void *opaque);
+
+/**
+ * Reads part of a payload produced with rb_http_produce_pull(). It can be
+ * called from any connection thread, and the same range can be read again
+ * if the message is resent.
+ * @param  buf    Buffer to fill
+ * @param  size   Bytes to read, never past the length of the message
+ * @param  offset Offset in the payload to read from
+ * @param  opaque Opaque given to rb_http_produce_pull()
+ * @return        Bytes read, or -1 to fail the request sending it
+ */
+typedef ssize_t (*cb_payload)(char *buf, size_t size, size_t offset,
+                              void *opaque);
+
+/**
+ * Releases a payload produced with RB_HTTP_MESSAGE_F_FREE, instead of free().
+ * It is called once the message has been reported, from the thread that
+ * reports it, or when the handler is destroyed if it was never sent.
+ * @param  rb_http_handler Handler
+ * @param  payload         Payload of the message
+ * @param  len             Length of the payload
+ * @param  marked          If produced with RB_HTTP_MESSAGE_F_MARK, so
+ * payloads of different producers can be told apart
+ * @param  message_opaque  Opaque the message was produced with
+ * @param  opaque          Opaque given to rb_http_handler_set_payload_free()
+ */
+typedef void (*cb_payload_free)(struct rb_http_handler_s *rb_http_handler,
+                                char *payload, size_t len, int marked,
+                                void *message_opaque, void *opaque);
+
 ////////////////////////////////////////////////////////////////////////////////
 // Structures
 ////////////////////////////////////////////////////////////////////////////////
 
+// @brief Response parser registered on a handler.
+struct rb_http_response_parser_s {
+  cb_response fn;
+  void *opaque;
+};
+
+// @brief Payload deallocator registered on a handler.
+struct rb_http_payload_free_s {
+  cb_payload_free fn;
+  void *opaque;
+};
+
+// @brief Free buffers of one size class.
+struct rb_http_pool_class_s {
+  pthread_mutex_t lock;
+  struct rb_http_pool_buf_s *free; // Free buffers
+  int cnt;                         // Buffers in free
+};
+
+// @brief Recycled buffers of a handler.
+struct rb_http_pool_s {
+  struct rb_http_pool_class_s classes[RB_HTTP_POOL_CLASSES];
+  uint64_t misses; // Buffers that had to be allocated
+};
+
+// @brief An event of the trace ring.
+struct rb_http_trace_event_s {
+  uint64_t seq;   // Odd while the slot is being written
+  uint64_t index; // Position of the event since the ring was created
+  uint64_t ts;    // CLOCK_MONOTONIC time (ns)
+  int event;      // RB_HTTP_TRACE_*
+  int thread;     // Connection thread, -1 if none
+  uint64_t arg0;
+  uint64_t arg1;
+};
+
+// @brief Last events of the message path, overwritten in a circle.
+struct rb_http_trace_s {
+  uint64_t head;  // Events recorded
+  uint64_t mask;  // Slots - 1, slots is a power of two
+  struct rb_http_trace_event_s *events;
+};
+
+// @brief Token bucket of an egress rate limit.
+struct rb_http_ratelimit_s {
+  pthread_mutex_t lock;
+  double tokens;         // Tokens available, negative if in debt
+  long last;             // Time (ms) tokens were last added, 0 if never
+  uint64_t throttled;    // Times a thread waited for the bucket
+  uint64_t throttled_ms; // Time (ms) threads waited for the bucket
+};
+
+// @brief Counters of an extra destination.
+struct rb_http_destination_stats_s {
+  uint64_t sent;    // Batch bodies acknowledged
+  uint64_t failed;  // Batch bodies not acknowledged
+  uint64_t retries; // Requests sent again after a failure
+};
+
+// @brief Upload of the batch bodies of a thread to an extra destination.
+struct rb_http_upload_s {
+  CURL *easy_handle; // Reused, so the connection is kept
+  int state;         // RB_HTTP_UPLOAD_*
+  int attempts;      // Requests sent with the current body
+  long retry_at;     // Time (ms) of the next request if waiting
+  long backoff;      // Next wait (ms) after a failure, kept between bodies
+};
+
+// @brief Compressed body of the last POST of a thread, uploaded to the extra
+// destinations.
+struct rb_http_fanout_s {
+  CURLM *multi_handle;              // Drives the uploads
+  struct rb_http_upload_s uploads[RB_HTTP_MAX_DESTINATIONS - 1];
+  int cnt;                          // Uploads of the current body
+  struct curl_slist *headers;       // Headers of the uploads
+  char *body;                       // Body, shared by all the uploads
+  size_t len;                       // Bytes in body
+  size_t size;                      // Allocated bytes in body
+};
+
+// @brief Limit of simultaneous requests.
+struct rb_http_limit_s {
+  pthread_mutex_t lock;
+  pthread_cond_t cond; // Signaled when a request can be started
+  int limit;           // Max requests in flight
+  int min;             // Lower bound of the limit
+  int max;             // Upper bound of the limit
+  int adaptive;        // Limit follows latency if set to 1
+  int in_flight;       // CHUNKED_MODE: Requests in flight
+  int successes;       // Successful requests since last change
+  double latency;      // Average response latency (ms)
+  double base_latency; // Long term average response latency (ms)
+  uint64_t samples;    // Number of latency samples
+  long last_decrease;  // Time (ms) of last decrease
+  uint64_t increases;  // Number of times the limit has grown
+  uint64_t decreases;  // Number of times the limit has been cut
+};
+
+// @brief Message queues of a thread, one per lane.
+struct rb_http_lanes_s {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;               // Signaled when a message is added
+  rb_http_msg_q_t q[RB_HTTP_LANES];  // Messages waiting to be sent
+  int cnt[RB_HTTP_LANES];            // Messages on each queue
+  int served;                        // Consecutive priority messages served
+  int woken;                         // Set by rb_http_lanes_wake() until a
+                                     // wait returns
+};
+
+// @brief A timer of a timer wheel.
+struct rb_http_timer_s {
+  long expires;                   // Time (ms) the timer fires
+  void (*cb)(void *opaque);       // Called when the timer fires
+  void *opaque;                   // Passed to cb
+  struct rb_http_timer_q_s *q;    // Slot the timer is in, NULL if not pending
+  TAILQ_ENTRY(rb_http_timer_s) tailq;
+};
+
+TAILQ_HEAD(rb_http_timer_q_s, rb_http_timer_s);
+
+// @brief Hierarchical timer wheel. Level 0 slots are 1 ms wide and every
+// level is RB_HTTP_TIMER_SLOTS times wider than the previous one.
+struct rb_http_timer_wheel_s {
+  long now;     // Cached time (ms) of the last advance
+  long current; // Next time (ms) to be processed
+  int cnt;      // Pending timers
+  struct rb_http_timer_q_s slots[RB_HTTP_TIMER_LEVELS][RB_HTTP_TIMER_SLOTS];
+};
+
+// @brief Socket of a handler watched by a runtime worker.
+struct rb_http_runtime_socket_s {
+  curl_socket_t fd;
+  struct rb_http_threaddata_s *rb_http_threaddata; // NULL once closed
+  TAILQ_ENTRY(rb_http_runtime_socket_s) tailq;
+};
+
+TAILQ_HEAD(rb_http_runtime_socket_q_s, rb_http_runtime_socket_s);
+
+// @brief Event loop of a runtime, serving the transfers of many handlers.
+struct rb_http_worker_s {
+  struct rb_http_runtime_s *runtime;
+  pthread_t p_thread;
+  pthread_mutex_t lock;  // Protects handlers, taken by the loop while working
+  pthread_cond_t cond;   // Signaled when a handler has been detached
+  int epoll_fd;          // Sockets of the handlers, and wake_fd
+  int wake_fd;           // eventfd written to wake the loop up
+  int sleeping;          // Loop is waiting for events
+  int running;           // Keep the loop running if set to 1
+  struct rb_http_threaddata_s **handlers; // Attached handlers
+  int nhandlers;                          // Handlers attached
+  int handlers_size;                      // Allocated handlers
+  int next;                               // First handler served next turn
+  struct rb_http_runtime_socket_q_s closed; // Freed after each turn
+};
+
+// @brief Worker pool shared by many NORMAL_MODE handlers.
+struct rb_http_runtime_s {
+  pthread_mutex_t lock;              // Protects handlers count
+  int nworkers;                      // Event loop threads
+  int handlers;                      // Handlers attached
+  struct rb_http_worker_s *workers;  // nworkers event loops
+};
+
+// @brief Counters of a lane. Times are the sum for all messages, in ms.
+struct rb_http_lane_stats_s {
+  uint64_t produced;      // Messages accepted
+  uint64_t rejected;      // Messages rejected because the lane was full
+  uint64_t expired;       // Messages dropped because their TTL expired
+  uint64_t dequeued;      // Messages taken from the queue to be sent
+  uint64_t delivered;     // Messages reported to the application
+  uint64_t queue_time;    // Time between produce and dequeue
+  uint64_t delivery_time; // Time between produce and report
+};
+
 // @brief Contains the "handler" information.
 struct rb_http_handler_s {
   CURLM *multi_handle; // NORMAL_MODE: Curl multi handler
@@ -38,39 +370,160 @@ struct rb_http_handler_s {
   int left;            // NORMAL_MODE
   uint64_t next_thread;
 
-  struct rb_http_options_s *options; // Options
+  int mode;             // Mode, fixed at rb_http_handler_run()
+  int max_messages;     // Copy of current options max_messages
+  int max_priority_messages; // Copy of current options max_priority_messages
+  long message_ttl;     // Copy of current options message_ttl
+  int framing;          // Copy of current options framing
+  long max_bytes;       // Copy of current options max_bytes
+  uint64_t bytes;       // Memory charged to the budget
+  int lane_left[RB_HTTP_LANES]; // Messages not reported yet, per lane
+  struct rb_http_lane_stats_s lane_stats[RB_HTTP_LANES];
+  struct rb_http_response_parser_s *response_parser; // Set before run
+  cb_report inline_report_fn; // Called by the threads instead of queuing
+  struct rb_http_payload_free_s *payload_free; // Set before run
+  struct rb_http_pool_s pool; // Recycled messages and payloads
+  struct rb_http_trace_s *trace; // Set before run, NULL if disabled
+  struct rb_http_runtime_s *runtime; // Set before run, NULL for own thread
+  int outstanding;      // Messages produced whose report is not queued yet
+  int warm;             // Connections opened and validated by pre-warming
+  int flushing;         // rb_http_flush() calls in progress
+  int running;          // Set to 1 by rb_http_handler_run()
+  int nthreads;         // Threads created, including retired ones
+  int connections;      // CHUNKED_MODE: Threads keys are hashed over
+
+  struct rb_http_options_s *options; // Current options
+  pthread_mutex_t options_lock;      // Protects options publication
+  pthread_rwlock_t threads_lock;     // Read by producers queuing to threads,
+                                     // written to start or free threads
+  uint64_t options_version;          // Version of current options
   int thread_running;                // Keep threads running if set to 1
-  rd_fifoq_t rfq_reports;            // Reports queue
+  struct rb_http_limit_s limit;      // Simultaneous requests limit
+  struct rb_http_ratelimit_s bytes_rate;    // Bytes sent per second
+  struct rb_http_ratelimit_s requests_rate; // Requests started per second
+  struct rb_http_destination_stats_s fanout_stats[RB_HTTP_MAX_DESTINATIONS - 1];
+  rd_fifoq_t rfq_reports[RB_HTTP_REPORT_SHARDS]; // Reports queues
+  pthread_mutex_t reports_lock;      // Protects reports_cond
+  pthread_cond_t reports_cond;       // Signaled on new reports if waiting
+  int reports_waiting;               // Consumers waiting for reports
+  int report_fd;                     // Signaled on new reports, -1 if unused
   struct rb_http_threaddata_s *threads[MAX_CONNECTIONS]; // For GZIP_MODE
 };
 
-// @brief Contains the "handler" options.
+// @brief Contains the "handler" options. Once published a snapshot is not
+// modified; changes create a new snapshot with the next version.
 struct rb_http_options_s {
+  uint64_t version;       // Snapshot version
+  int refcnt;             // References to this snapshot
   char *url;              // Endpoint URL
+  char *unix_socket;      // Unix socket to reach url through, NULL for TCP
+  char *fanout_urls[RB_HTTP_MAX_DESTINATIONS - 1]; // Extra destinations
+  int fanout_cnt;         // CHUNKED_MODE: Extra destinations in fanout_urls
+  int fanout_quorum;      // Destinations that must acknowledge, 0 all
+  int fanout_retries;     // Requests sent again to a failing destination
   int mode;               // NORMAL_MODE or GZIP_MODE
+  int framing;            // CHUNKED_MODE: RB_HTTP_FRAMING_* of POST bodies
   int max_messages;       // Max messages in queue
+  int max_priority_messages; // Max messages in priority queue
+  int priority_weight;    // Priority messages sent per normal message
+  long message_ttl;       // Max time (ms) a message waits to be sent, 0 no limit
+  long max_bytes;         // Memory budget of messages and buffers, 0 no limit
+  long max_bytes_per_sec; // Bytes sent per second, 0 no limit
+  long bytes_burst;       // Bytes sent at once after idling, 0 one second
+  long max_requests_per_sec; // Requests started per second, 0 no limit
+  long requests_burst;    // Requests started at once after idling
   int max_batch_messages; // Max messages per POST
+  int max_batch_messages_auto; // max_batch_messages is max_messages / 10
+  long max_batch_bytes;   // Max uncompressed payload bytes per POST
+  long max_batch_compressed_bytes; // Max compressed bytes per POST
+  long max_post_duration; // Max time (ms) a chunked POST is kept open
   int batch_timeout;      // Max time to wait before send data
+  int adaptive_batch;     // Tune batch size and timeout if set to 1
+  int min_batch_messages; // ADAPTIVE: Lower bound of messages per POST
+  long min_batch_timeout; // ADAPTIVE: Lower bound of POST duration (ms)
+  long max_batch_timeout; // ADAPTIVE: Upper bound of POST duration (ms)
   int connections;        // Number of simultaneous connections
+  int adaptive_connections; // Tune simultaneous requests if set to 1
+  int min_connections;    // ADAPTIVE: Lower bound of simultaneous requests
+  int work_stealing;      // Idle threads take messages from loaded ones
+  long drain_timeout;     // Max time (ms) destroy waits for queued messages
+  long max_response_bytes; // CHUNKED_MODE: Response bytes kept, 0 discards
+  int max_message_retries; // Resends of a message the server asked for
+  long min_retry_backoff; // Wait (ms) after a failed POST, 0 none
+  long max_retry_backoff; // Upper bound of the doubling wait (ms)
   long post_timeout;      //
   long timeout;           // Total timeout
   long conntimeout;       // Connection timeout
+  int prewarm;            // Open connections at rb_http_handler_run() if 1
+  long idle_probe;        // Probe connections idle this long (ms), 0 never
+  long tcp_keepalive;     // TCP keepalive idle and interval (s), 0 disabled
   long verbose;           // Curl verbose mode if set to 1
   int insecure;           // Curl certificate insecure
 };
 
+// @brief Batch limits chosen for a thread and the data used to compute them.
+struct rb_http_adaptive_s {
+  int batch_messages; // Max messages on next POST
+  long batch_timeout; // Max duration (ms) of next POST, 0 for no limit
+  double rate;        // Average arrival rate (messages/ms)
+  double latency;     // Average response latency (ms)
+  double errors;      // Average error rate (0-1)
+  long last_update;   // Time (ms) of the last update
+};
+
 // @brief Contains information per thread.
 struct rb_http_threaddata_s {
+  int id;                             // Index in handler threads
+  int exited;                         // Set to 1 when the thread has finished
+  struct rb_http_options_s *options;  // Options used by this thread
   int chunks;
   int current_messages;         // Messages in POST
-  rd_fifoq_t rfq;               // Message queue
+  size_t current_bytes;         // Uncompressed payload bytes in POST
+  int post_messages;            // Messages sent on the last POST
+  struct rb_http_lanes_s lanes; // Message queues
   z_stream *strm;               //
   rb_http_msg_q_t *rfq_pending; // Chunks writed waiting for response
   CURL *easy_handle;            // Curl easy handler
   long post_timestamp;          //
+  long post_end_timestamp;      // Time when last chunk was written
+  struct rb_http_adaptive_s adaptive; // Batch limits for this thread
+  struct rb_http_timer_wheel_s timers; // Timers of this thread
+  struct rb_http_timer_s batch_timer;  // Ends the POST in progress
+  struct rb_http_timer_s flush_timer;  // Ends the chunk in progress
+  struct rb_http_timer_s retry_timer;  // Ends the wait after a failed POST
+  int batch_expired;                   // Set when batch_timer fires
+  int flush_expired;                   // Set when flush_timer fires
+  long retry_backoff;                  // Next wait (ms) after a failed POST
+  uint64_t steals;                     // Times this thread has stolen work
+  uint64_t stolen;                     // Messages stolen by this thread
+  long steal_checked;                  // Time (ms) of last look for work
+  char *response;                      // Response of the POST, reused
+  size_t response_len;                 // Bytes in response
+  size_t response_size;                // Allocated bytes in response
+  char *payload_buf;                   // RB_HTTP_PAYLOAD_BUF bytes, or NULL
+  int payload_failed;                  // A payload source failed to read
+  struct rb_http_fanout_s *fanout;     // Extra destinations, or NULL
+  int warm;                            // Connections opened by pre-warming
+  long last_request;                   // Time (ms) of the last request
+  int probes;                          // Pre-warm probes in flight
+  CURL **probe_handles;                // Probes in flight, NULL once done
+  int probe_handles_cnt;               // Entries in probe_handles
+  rb_http_msg_q_t inflight;            // NORMAL_MODE: Messages being sent
+  int probes_ok;                       // Probes answered in this round
+  struct rb_http_worker_s *worker;     // Runtime worker, NULL for own thread
+  int detaching;                       // Worker must let the handler go
+  struct rb_http_ratelimit_s *throttled; // Bucket holding requests, or NULL
+  struct rb_http_runtime_socket_q_s sockets; // Watched by the worker
   pthread_t p_thread;           // Thread id
   struct rb_http_handler_s *rb_http_handler; // Ref to the handler
-  struct rb_http_message_s *message_left;    //
+  struct rb_http_message_s *message_left;    // Message being compressed
+  int frame_part;                            // RB_HTTP_FRAME_* of message_left
+  char frame_head[4];                        // Framing before message_left
+  size_t frame_head_len;                     //
+  char frame_tail[1];                        // Framing after message_left
+  size_t frame_tail_len;                     //
+  int frame_closed;                          // POST body has been closed
+  struct rb_http_message_s *message_next;    // Didn't fit on previous POST
   void *opaque;                              // Opaque
 };
 
@@ -83,20 +536,6 @@ struct rb_http_report_s {
   CURL *handler;              // Curl handler used for messages
 };
 
-////////////////////////////////////////////////////////////////////////////////
-/// Types
-////////////////////////////////////////////////////////////////////////////////
-
-/**
- * [void  description]
- * @param  opaque [description]
- * @return        [description]
- */
-typedef void (*cb_report)(struct rb_http_handler_s *rb_http_handler,
-                          int status_code, long http_code,
-                          const char *status_code_str, char *buff,
-                          size_t bufsiz, void *opaque);
-
 ////////////////////////////////////////////////////////////////////////////////
 /// Functions
 ////////////////////////////////////////////////////////////////////////////////
@@ -117,7 +556,9 @@ struct rb_http_handler_s *rb_http_handler_create(const char *urls_str,
 void rb_http_handler_run(struct rb_http_handler_s *rb_http_handler);
 
 /**
- * Destroy and cleans the Handler
+ * Destroy and cleans the Handler. Queued messages are sent first, waiting
+ * up to RB_HTTP_DRAIN_TIMEOUT ms. Call rb_http_flush() before to get their
+ * reports.
  * @param  rb_http_handler Handler to destroy
  * @param  err             Error string
  * @param  errsize         Length of the error
@@ -139,6 +580,108 @@ void rb_http_handler_destroy(struct rb_http_handler_s *rb_http_handler,
 int rb_http_produce(struct rb_http_handler_s *handler, char *buff, size_t len,
                     int flags, char *err, size_t errsize, void *opaque);
 
+/**
+ * Produces a message that is dropped if it can't be sent within ttl_ms.
+ * Expired messages are reported with RB_HTTP_ERR_EXPIRED status and they are
+ * never compressed nor sent.
+ * @param  handler Handler
+ * @param  buff    Message payload
+ * @param  len     Length of the payload
+ * @param  flags   RB_HTTP_MESSAGE_F_* flags
+ * @param  ttl_ms  Time to live (ms). 0 uses RB_HTTP_MESSAGE_TTL option.
+ * @param  err     Error string
+ * @param  errsize Length of the error string
+ * @param  opaque  Opaque passed to the report callback
+ * @return         0 if the message has been queued
+ */
+int rb_http_produce_ttl(struct rb_http_handler_s *handler, char *buff,
+                        size_t len, int flags, long ttl_ms, char *err,
+                        size_t errsize, void *opaque);
+
+/**
+ * Produces a message that is sent by the worker its key maps to. In
+ * CHUNKED_MODE all messages with the same key go through the same connection
+ * in order, and share the deflate window. Keys are mapped with consistent
+ * hashing over RB_HTTP_CONNECTIONS, so only 1/N of the keys move when it
+ * changes, and none when the adaptive requests limit does.
+ * @param  handler Handler
+ * @param  buff    Message payload
+ * @param  len     Length of the payload
+ * @param  flags   RB_HTTP_MESSAGE_F_* flags
+ * @param  key     Partitioning key, like a sensor uuid
+ * @param  keylen  Length of the key
+ * @param  err     Error string
+ * @param  errsize Length of the error string
+ * @param  opaque  Opaque passed to the report callback
+ * @return         0 if the message has been queued
+ */
+int rb_http_produce_key(struct rb_http_handler_s *handler, char *buff,
+                        size_t len, int flags, const char *key,
+                        size_t keylen, char *err, size_t errsize,
+                        void *opaque);
+
+/**
+ * Produces a message whose payload is a memory mapped region. The region is
+ * sent in place, and if RB_HTTP_MESSAGE_F_FREE is set it is munmap()'ed once
+ * reported. RB_HTTP_MESSAGE_F_COPY is not allowed.
+ * @param  handler Handler
+ * @param  addr    Start of the payload
+ * @param  len     Length of the payload
+ * @param  flags   RB_HTTP_MESSAGE_F_* flags
+ * @param  err     Error string
+ * @param  errsize Length of the error string
+ * @param  opaque  Opaque passed to the report callback
+ * @return         0 if the message has been queued
+ */
+int rb_http_produce_mmap(struct rb_http_handler_s *handler, void *addr,
+                         size_t len, int flags, char *err, size_t errsize,
+                         void *opaque);
+
+/**
+ * Produces a message whose payload is a range of a file. It is read with
+ * pread() while the request is written, so the file is never loaded in
+ * memory, and if RB_HTTP_MESSAGE_F_FREE is set fd is closed once reported.
+ * The report callback receives a NULL buffer. RB_HTTP_MESSAGE_F_COPY is not
+ * allowed.
+ * @param  handler Handler
+ * @param  fd      File with the payload
+ * @param  offset  Offset of the payload in the file
+ * @param  len     Length of the payload
+ * @param  flags   RB_HTTP_MESSAGE_F_* flags
+ * @param  err     Error string
+ * @param  errsize Length of the error string
+ * @param  opaque  Opaque passed to the report callback
+ * @return         0 if the message has been queued
+ */
+int rb_http_produce_fd(struct rb_http_handler_s *handler, int fd, off_t offset,
+                       size_t len, int flags, char *err, size_t errsize,
+                       void *opaque);
+
+/**
+ * Produces a message whose payload is read with a callback while the request
+ * is written. The report callback receives a NULL buffer, and it is the
+ * place to release what read_fn uses. RB_HTTP_MESSAGE_F_COPY and
+ * RB_HTTP_MESSAGE_F_FREE are not allowed.
+ * @param  handler Handler
+ * @param  read_fn Payload reader
+ * @param  len     Length of the payload
+ * @param  flags   RB_HTTP_MESSAGE_F_* flags
+ * @param  err     Error string
+ * @param  errsize Length of the error string
+ * @param  opaque  Opaque passed to read_fn and to the report callback
+ * @return         0 if the message has been queued
+ */
+int rb_http_produce_pull(struct rb_http_handler_s *handler, cb_payload read_fn,
+                         size_t len, int flags, char *err, size_t errsize,
+                         void *opaque);
+
+/**
+ * Returns a description of a report status code
+ * @param  status_code Status code received in the report callback
+ * @return             Description of the status
+ */
+const char *rb_http_strerror(int status_code);
+
 /**
  * [rb_http_batch_produce  description]
  * @param  handler [description]
@@ -164,6 +707,184 @@ int rb_http_batch_produce(struct rb_http_handler_s *handler, char *buff,
 int rb_http_get_reports(struct rb_http_handler_s *rb_http_handler,
                         cb_report report_fn, int timeout_ms);
 
+/**
+ * Like rb_http_get_reports(), but only takes the reports of a subset of the
+ * report queues, so nconsumers threads can take reports at the same time.
+ * Every thread must use a different consumer number. Reports of messages
+ * sent by the same connection always go to the same consumer.
+ * @param  rb_http_handler Handler
+ * @param  report_fn       Callback for each message
+ * @param  timeout_ms      Max time to wait for a report, 0 to not wait
+ * @param  consumer        Consumer number, from 0 to nconsumers - 1
+ * @param  nconsumers      Threads taking reports
+ * @return                 Messages waiting for a report
+ */
+int rb_http_get_reports_consumer(struct rb_http_handler_s *rb_http_handler,
+                                 cb_report report_fn, int timeout_ms,
+                                 int consumer, int nconsumers);
+
+/**
+ * Gets a file descriptor that becomes readable when there are reports to
+ * take, so the handler can be added to an epoll or libevent loop. When it is
+ * readable, call rb_http_get_reports() with timeout_ms 0. The fd is owned by
+ * the handler and closed by rb_http_handler_destroy().
+ * @param  rb_http_handler Handler
+ * @return                 The fd, or -1 if it could not be created
+ */
+int rb_http_get_report_fd(struct rb_http_handler_s *rb_http_handler);
+
+/**
+ * Sends all the messages produced so far without waiting for batches to
+ * fill, and waits for their reports.
+ * @param  rb_http_handler Handler
+ * @param  report_fn       Reports are delivered to this callback while
+ * waiting. If NULL, another thread must be calling rb_http_get_reports(), and
+ * rb_http_flush() only waits until all reports are queued.
+ * @param  timeout_ms      Max time to wait
+ * @return                 Messages still waiting for a report, 0 if the
+ * flush has completed.
+ */
+int rb_http_flush(struct rb_http_handler_s *rb_http_handler,
+                  cb_report report_fn, int timeout_ms);
+
+/**
+ * Writes handler statistics as a JSON object
+ * @param  rb_http_handler Handler to get stats from
+ * @param  buf             Buffer for the JSON
+ * @param  bufsiz          Size of the buffer
+ * @return                 Length of the JSON, as snprintf(). If it is greater
+ * or equal than bufsiz the output has been truncated.
+ */
+int rb_http_handler_get_stats(struct rb_http_handler_s *rb_http_handler,
+                              char *buf, size_t bufsiz);
+
+/**
+ * Sets the function that maps a CHUNKED_MODE response to the result of each
+ * message, so only the messages rejected by the server fail or are resent.
+ * Responses are only kept if RB_HTTP_MAX_RESPONSE_BYTES is set.
+ * @param  rb_http_handler Handler, before rb_http_handler_run()
+ * @param  parser_fn       Parser, NULL to report the POST status
+ * @param  opaque          Passed to parser_fn
+ */
+void rb_http_handler_set_response_parser(
+    struct rb_http_handler_s *rb_http_handler, cb_response parser_fn,
+    void *opaque);
+
+/**
+ * Makes the library call report_fn as soon as a transfer completes, on the
+ * thread that did the transfer, instead of queuing the report for
+ * rb_http_get_reports(). report_fn is called concurrently from every
+ * CHUNKED_MODE connection thread, so it must be thread safe, and it delays
+ * the next POST of that thread until it returns. It must not call
+ * rb_http_flush() or rb_http_handler_destroy(). rb_http_get_reports() and
+ * rb_http_flush() still wait for the reports, without calling their own
+ * report_fn.
+ * @param  rb_http_handler Handler, before rb_http_handler_run()
+ * @param  report_fn       Callback, NULL to queue the reports
+ */
+void rb_http_handler_set_inline_reports(
+    struct rb_http_handler_s *rb_http_handler, cb_report report_fn);
+
+/**
+ * Sets the function that releases the payloads produced with
+ * RB_HTTP_MESSAGE_F_FREE, so they can come from the producer allocator.
+ * Producers sharing the handler can tell their payloads apart producing
+ * them with RB_HTTP_MESSAGE_F_MARK.
+ * @param  rb_http_handler Handler, before rb_http_handler_run()
+ * @param  free_fn         Deallocator, NULL to use free()
+ * @param  opaque          Passed to free_fn
+ */
+void rb_http_handler_set_payload_free(
+    struct rb_http_handler_s *rb_http_handler, cb_payload_free free_fn,
+    void *opaque);
+
+/**
+ * Gets a buffer from the recycled buffers of the handler. Produce it with
+ * RB_HTTP_MESSAGE_F_POOL and it goes back to the pool once reported, so a
+ * steady flow of messages doesn't allocate memory. Buffers not produced
+ * must be returned with rb_http_buffer_free() before destroying the handler.
+ * @param  rb_http_handler Handler
+ * @param  len             Bytes needed
+ * @return                 Buffer, or NULL if it can't be allocated
+ */
+char *rb_http_buffer_alloc(struct rb_http_handler_s *rb_http_handler,
+                           size_t len);
+
+/**
+ * Returns a buffer got with rb_http_buffer_alloc() that has not been
+ * produced
+ * @param rb_http_handler Handler
+ * @param buff            Buffer to return
+ */
+void rb_http_buffer_free(struct rb_http_handler_s *rb_http_handler,
+                         char *buff);
+
+/**
+ * Records the last events of every message in a ring, to be written with
+ * rb_http_trace_dump(). The same events are USDT probes of the librbhttp
+ * provider if the library was built with <sys/sdt.h>.
+ * @param  rb_http_handler Handler, before rb_http_handler_run()
+ * @param  events          Events kept, rounded up to a power of two. 0
+ * disables the ring.
+ */
+void rb_http_handler_set_trace_ring(struct rb_http_handler_s *rb_http_handler,
+                                    size_t events);
+
+/**
+ * Writes the events of the trace ring as text, one per line and oldest
+ * first. Events overwritten while dumping are skipped.
+ * @param  rb_http_handler Handler
+ * @param  path            File to write
+ * @return                 Events written, -1 if there is no ring or the file
+ * can't be written
+ */
+int rb_http_trace_dump(struct rb_http_handler_s *rb_http_handler,
+                       const char *path);
+
+/**
+ * Waits until the connections opened by RB_HTTP_PREWARM are ready, so the
+ * first messages don't wait for DNS, TCP and TLS setup
+ * @param  rb_http_handler Handler, after rb_http_handler_run()
+ * @param  timeout_ms      Max wait
+ * @return                 Connections ready. Less than RB_HTTP_CONNECTIONS
+ * if the endpoint didn't answer on time, 0 if RB_HTTP_PREWARM is not set.
+ */
+int rb_http_handler_wait_ready(struct rb_http_handler_s *rb_http_handler,
+                               int timeout_ms);
+
+/**
+ * Creates a runtime: a fixed pool of event loops that NORMAL_MODE handlers
+ * attached with rb_http_handler_set_runtime() share, instead of starting a
+ * thread each. Handlers of a worker take turns to start up to
+ * RB_HTTP_RUNTIME_QUANTUM requests, so a busy handler can't starve the
+ * others.
+ * @param  workers Event loop threads, 1 to MAX_RUNTIME_WORKERS
+ * @param  err     Error string
+ * @param  errsize Length of the error string
+ * @return         Runtime, or NULL on error
+ */
+struct rb_http_runtime_s *rb_http_runtime_create(int workers, char *err,
+                                                 size_t errsize);
+
+/**
+ * Stops the workers of a runtime. Its handlers must have been destroyed.
+ * @param runtime Runtime to destroy
+ */
+void rb_http_runtime_destroy(struct rb_http_runtime_s *runtime);
+
+/**
+ * Makes a NORMAL_MODE handler send through the workers of a runtime. The
+ * runtime must outlive the handler.
+ * @param  rb_http_handler Handler, before rb_http_handler_run()
+ * @param  runtime         Runtime, NULL for a thread of its own
+ * @param  err             Error string
+ * @param  errsize         Length of the error string
+ * @return                 0 on success, -1 if the handler is in CHUNKED_MODE
+ */
+int rb_http_handler_set_runtime(struct rb_http_handler_s *rb_http_handler,
+                                struct rb_http_runtime_s *runtime, char *err,
+                                size_t errsize);
+
 /**
  * [rb_http_handler_set_opt  description]
  * @param  rb_http_handler [description]
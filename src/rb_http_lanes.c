@@ -0,0 +1,296 @@
+/**
+ * @file rb_http_lanes.c
+ * @brief Per thread message queues, one per priority.
+ *
+ * Messages are linked through their own tailq entry, so queuing a message
+ * doesn't allocate. All lanes of a thread share one lock and one condition
+ * so a thread waiting for messages wakes up for any of them.
+ */
+#include "../config.h"
+#include "rb_http_budget.h"
+#include "rb_http_lanes.h"
+#include "rb_http_reports.h"
+
+void rb_http_lanes_init(struct rb_http_lanes_s *lanes) {
+  int i = 0;
+
+  memset(lanes, 0, sizeof(*lanes));
+  pthread_mutex_init(&lanes->lock, NULL);
+  pthread_cond_init(&lanes->cond, NULL);
+
+  for (i = 0; i < RB_HTTP_LANES; i++) {
+    rb_http_msg_q_init(&lanes->q[i]);
+  }
+}
+
+void rb_http_lanes_destroy(struct rb_http_lanes_s *lanes) {
+  pthread_cond_destroy(&lanes->cond);
+  pthread_mutex_destroy(&lanes->lock);
+}
+
+void rb_http_lanes_add(struct rb_http_lanes_s *lanes,
+                       struct rb_http_message_s *message) {
+  pthread_mutex_lock(&lanes->lock);
+  rb_http_msg_q_add(&lanes->q[message->lane], message);
+  lanes->cnt[message->lane]++;
+  pthread_cond_signal(&lanes->cond);
+  pthread_mutex_unlock(&lanes->lock);
+}
+
+/**
+ * Pops the next message. Must be called with the lanes lock held.
+ */
+static struct rb_http_message_s *lanes_pop0(struct rb_http_lanes_s *lanes,
+                                            int weight) {
+  struct rb_http_message_s *message = NULL;
+  int lane = RB_HTTP_LANE_NORMAL;
+
+  if (lanes->cnt[RB_HTTP_LANE_PRIORITY] > 0 &&
+      (lanes->served < weight || lanes->cnt[RB_HTTP_LANE_NORMAL] == 0)) {
+    lane = RB_HTTP_LANE_PRIORITY;
+  }
+
+  message = rb_http_msg_q_pop(&lanes->q[lane]);
+  if (message != NULL) {
+    lanes->cnt[lane]--;
+    lanes->served = lane == RB_HTTP_LANE_PRIORITY ? lanes->served + 1 : 0;
+  }
+
+  return message;
+}
+
+/**
+ * Computes the absolute time to pass to pthread_cond_timedwait()
+ */
+static void lanes_deadline(struct timespec *deadline, int timeout_ms) {
+  clock_gettime(CLOCK_REALTIME, deadline);
+  deadline->tv_sec += timeout_ms / 1000;
+  deadline->tv_nsec += (timeout_ms % 1000) * 1000 * 1000;
+  if (deadline->tv_nsec >= 1000 * 1000 * 1000) {
+    deadline->tv_sec++;
+    deadline->tv_nsec -= 1000 * 1000 * 1000;
+  }
+}
+
+struct rb_http_message_s *rb_http_lanes_pop(struct rb_http_lanes_s *lanes,
+                                            int weight, int timeout_ms) {
+  struct rb_http_message_s *message = NULL;
+  struct timespec deadline;
+
+  pthread_mutex_lock(&lanes->lock);
+
+  message = lanes_pop0(lanes, weight);
+  if (message == NULL && timeout_ms > 0) {
+    lanes_deadline(&deadline, timeout_ms);
+
+    while ((message = lanes_pop0(lanes, weight)) == NULL && !lanes->woken) {
+      if (pthread_cond_timedwait(&lanes->cond, &lanes->lock, &deadline) ==
+          ETIMEDOUT) {
+        message = lanes_pop0(lanes, weight);
+        break;
+      }
+    }
+    lanes->woken = 0;
+  }
+
+  pthread_mutex_unlock(&lanes->lock);
+
+  return message;
+}
+
+struct rb_http_message_s *
+rb_http_lanes_pop_older(struct rb_http_lanes_s *lanes, long before) {
+  struct rb_http_message_s *message = NULL;
+  struct rb_http_message_s *oldest = NULL;
+  int i = 0;
+
+  pthread_mutex_lock(&lanes->lock);
+
+  for (i = 0; i < RB_HTTP_LANES; i++) {
+    message = TAILQ_FIRST(&lanes->q[i]);
+    if (message != NULL && message->produced < before &&
+        (oldest == NULL || message->produced < oldest->produced)) {
+      oldest = message;
+    }
+  }
+
+  if (oldest != NULL) {
+    TAILQ_REMOVE(&lanes->q[oldest->lane], oldest, tailq);
+    lanes->cnt[oldest->lane]--;
+  }
+
+  pthread_mutex_unlock(&lanes->lock);
+
+  return oldest;
+}
+
+int rb_http_lanes_expire(struct rb_http_lanes_s *lanes, long now,
+                         rb_http_msg_q_t *expired) {
+  struct rb_http_message_s *message = NULL;
+  struct rb_http_message_s *next = NULL;
+  int cnt = 0;
+  int i = 0;
+
+  pthread_mutex_lock(&lanes->lock);
+
+  for (i = 0; i < RB_HTTP_LANES; i++) {
+    for (message = TAILQ_FIRST(&lanes->q[i]); message != NULL;
+         message = next) {
+      next = TAILQ_NEXT(message, tailq);
+      if (rb_http_msg_expired(message, now)) {
+        TAILQ_REMOVE(&lanes->q[i], message, tailq);
+        lanes->cnt[i]--;
+        rb_http_msg_q_add(expired, message);
+        cnt++;
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&lanes->lock);
+
+  return cnt;
+}
+
+int rb_http_lanes_steal(struct rb_http_lanes_s *from,
+                        struct rb_http_lanes_s *to, int max) {
+  rb_http_msg_q_t stolen[RB_HTTP_LANES];
+  struct rb_http_message_s *message = NULL;
+  struct rb_http_message_s *prev = NULL;
+  int cnt = 0;
+  int i = 0;
+
+  pthread_mutex_lock(&from->lock);
+
+  // The victim keeps at least half of its messages
+  for (i = 0, cnt = 0; i < RB_HTTP_LANES; i++) {
+    cnt += from->cnt[i];
+  }
+  if (max > cnt / 2) {
+    max = cnt / 2;
+  }
+  cnt = 0;
+
+  // Priority messages are the most urgent to get out of a slow worker
+  for (i = RB_HTTP_LANES - 1; i >= 0; i--) {
+    rb_http_msg_q_init(&stolen[i]);
+    for (message = TAILQ_LAST(&from->q[i], rb_http_msg_q_s);
+         message != NULL && cnt < max; message = prev) {
+      prev = TAILQ_PREV(message, rb_http_msg_q_s, tailq);
+      if (!message->keyed) {
+        TAILQ_REMOVE(&from->q[i], message, tailq);
+        TAILQ_INSERT_HEAD(&stolen[i], message, tailq);
+        from->cnt[i]--;
+        cnt++;
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&from->lock);
+
+  if (cnt > 0) {
+    pthread_mutex_lock(&to->lock);
+    for (i = 0; i < RB_HTTP_LANES; i++) {
+      while ((message = rb_http_msg_q_pop(&stolen[i])) != NULL) {
+        rb_http_msg_q_add(&to->q[i], message);
+        to->cnt[i]++;
+      }
+    }
+    pthread_cond_signal(&to->cond);
+    pthread_mutex_unlock(&to->lock);
+  }
+
+  return cnt;
+}
+
+void rb_http_lanes_report_expired(struct rb_http_handler_s *rb_http_handler,
+                                  rb_http_msg_q_t *expired) {
+  struct rb_http_message_s *message = NULL;
+  struct rb_http_report_s *report = NULL;
+
+  if (rb_http_msg_q_empty(expired)) {
+    return;
+  }
+
+  report = calloc(1, sizeof(struct rb_http_report_s));
+  report->rfq_msgs = calloc(1, sizeof(rb_http_msg_q_t));
+  report->err_code = RB_HTTP_ERR_EXPIRED;
+  rb_http_msg_q_init(report->rfq_msgs);
+
+  while ((message = rb_http_msg_q_pop(expired)) != NULL) {
+    ATOMIC_OP64(add, fetch, &rb_http_handler->lane_stats[message->lane].expired,
+                1);
+    ATOMIC_OP(sub, fetch, &rb_http_handler->outstanding, 1);
+    rb_http_msg_q_add(report->rfq_msgs, message);
+  }
+
+  rb_http_reports_add(rb_http_handler, report);
+}
+
+int rb_http_lanes_cnt(struct rb_http_lanes_s *lanes) {
+  int cnt = 0;
+  int i = 0;
+
+  pthread_mutex_lock(&lanes->lock);
+  for (i = 0; i < RB_HTTP_LANES; i++) {
+    cnt += lanes->cnt[i];
+  }
+  pthread_mutex_unlock(&lanes->lock);
+
+  return cnt;
+}
+
+void rb_http_lanes_dequeued(struct rb_http_handler_s *rb_http_handler,
+                            const struct rb_http_message_s *message, long now) {
+  struct rb_http_lane_stats_s *stats =
+      &rb_http_handler->lane_stats[message->lane];
+
+  ATOMIC_OP64(add, fetch, &stats->dequeued, 1);
+  ATOMIC_OP64(add, fetch, &stats->queue_time,
+              (uint64_t)(now - message->produced));
+}
+
+void rb_http_lanes_delivered(struct rb_http_handler_s *rb_http_handler,
+                             const struct rb_http_message_s *message,
+                             long now) {
+  struct rb_http_lane_stats_s *stats =
+      &rb_http_handler->lane_stats[message->lane];
+
+  ATOMIC_OP(sub, fetch, &rb_http_handler->lane_left[message->lane], 1);
+  rb_http_budget_release(rb_http_handler, message->bytes);
+  ATOMIC_OP64(add, fetch, &stats->delivered, 1);
+  ATOMIC_OP64(add, fetch, &stats->delivery_time,
+              (uint64_t)(now - message->produced));
+}
+
+void rb_http_lanes_wake(struct rb_http_lanes_s *lanes) {
+  pthread_mutex_lock(&lanes->lock);
+  lanes->woken = 1;
+  pthread_cond_broadcast(&lanes->cond);
+  pthread_mutex_unlock(&lanes->lock);
+}
+
+int rb_http_lanes_wait(struct rb_http_lanes_s *lanes, int cnt,
+                       int timeout_ms) {
+  struct timespec deadline;
+  int now_cnt = 0;
+  int i = 0;
+
+  lanes_deadline(&deadline, timeout_ms);
+
+  pthread_mutex_lock(&lanes->lock);
+  while (1) {
+    for (now_cnt = 0, i = 0; i < RB_HTTP_LANES; i++) {
+      now_cnt += lanes->cnt[i];
+    }
+
+    if (now_cnt > cnt || lanes->woken ||
+        pthread_cond_timedwait(&lanes->cond, &lanes->lock, &deadline) ==
+            ETIMEDOUT) {
+      break;
+    }
+  }
+  lanes->woken = 0;
+  pthread_mutex_unlock(&lanes->lock);
+
+  return now_cnt;
+}
@@ -0,0 +1,115 @@
+#include "rb_http_handler.h"
+
+/**
+ * Initializes the message lanes of a thread
+ * @param lanes Lanes to initialize
+ */
+void rb_http_lanes_init(struct rb_http_lanes_s *lanes);
+
+/**
+ * Destroys the message lanes of a thread. Lanes must be empty.
+ * @param lanes Lanes to destroy
+ */
+void rb_http_lanes_destroy(struct rb_http_lanes_s *lanes);
+
+/**
+ * Adds a message at the end of its lane
+ * @param lanes   Lanes of the thread
+ * @param message Message to add. message->lane selects the lane.
+ */
+void rb_http_lanes_add(struct rb_http_lanes_s *lanes,
+                       struct rb_http_message_s *message);
+
+/**
+ * Gets the next message to send. The priority lane is served first, but
+ * after `weight` consecutive priority messages one normal message is served
+ * if there is any, so normal traffic is never starved.
+ * @param  lanes      Lanes of the thread
+ * @param  weight     Priority messages served per normal message
+ * @param  timeout_ms Max time to wait for a message, 0 to not wait
+ * @return            Next message or NULL if there are none
+ */
+struct rb_http_message_s *rb_http_lanes_pop(struct rb_http_lanes_s *lanes,
+                                            int weight, int timeout_ms);
+
+/**
+ * Gets the oldest message of the lanes if it was produced before a given time
+ * @param  lanes  Lanes of the thread
+ * @param  before Time (ms)
+ * @return        The message or NULL if there are none that old
+ */
+struct rb_http_message_s *
+rb_http_lanes_pop_older(struct rb_http_lanes_s *lanes, long before);
+
+/**
+ * Removes the expired messages of all lanes
+ * @param  lanes   Lanes of the thread
+ * @param  now     Current time (ms)
+ * @param  expired Queue where expired messages are added
+ * @return         Number of expired messages
+ */
+int rb_http_lanes_expire(struct rb_http_lanes_s *lanes, long now,
+                         rb_http_msg_q_t *expired);
+
+/**
+ * Queues a report with RB_HTTP_ERR_EXPIRED status for expired messages
+ * @param rb_http_handler Handler
+ * @param expired         Expired messages. The queue is left empty.
+ */
+void rb_http_lanes_report_expired(struct rb_http_handler_s *rb_http_handler,
+                                  rb_http_msg_q_t *expired);
+
+/**
+ * Moves messages without partitioning key from the tail of the lanes of a
+ * thread to another thread, priority ones first. Each lane keeps its order,
+ * and no more than half of the messages are moved.
+ * @param  from Lanes to take messages from
+ * @param  to   Lanes to add messages to
+ * @param  max  Max messages to move
+ * @return      Number of messages moved
+ */
+int rb_http_lanes_steal(struct rb_http_lanes_s *from,
+                        struct rb_http_lanes_s *to, int max);
+
+/**
+ * Number of messages waiting in all lanes
+ * @param  lanes Lanes of the thread
+ * @return       Number of messages
+ */
+int rb_http_lanes_cnt(struct rb_http_lanes_s *lanes);
+
+/**
+ * Wakes up the thread waiting on the lanes, even if no message has arrived
+ * @param lanes Lanes of the thread
+ */
+void rb_http_lanes_wake(struct rb_http_lanes_s *lanes);
+
+/**
+ * Waits until there are more than cnt messages in the lanes, or the lanes
+ * are woken up
+ * @param  lanes      Lanes of the thread
+ * @param  cnt        Messages already known to the caller
+ * @param  timeout_ms Max time to wait
+ * @return            Number of messages
+ */
+int rb_http_lanes_wait(struct rb_http_lanes_s *lanes, int cnt, int timeout_ms);
+
+/**
+ * Accounts a message taken from the lanes to be sent
+ * @param rb_http_handler Handler
+ * @param message         Message
+ * @param now             Current time (ms)
+ */
+void rb_http_lanes_dequeued(struct rb_http_handler_s *rb_http_handler,
+                            const struct rb_http_message_s *message, long now);
+
+/**
+ * Accounts a message whose report has been delivered to the application, and
+ * frees its place in the lane and its memory budget
+ * @param rb_http_handler Handler
+ * @param message         Message
+ * @param now             Current time (ms)
+ */
+void rb_http_lanes_delivered(struct rb_http_handler_s *rb_http_handler,
+                             const struct rb_http_message_s *message,
+                             long now);
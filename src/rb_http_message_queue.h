@@ -1,5 +1,7 @@
 #include <sys/queue.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <sys/types.h>
 
 // @brief The message to send.
 struct rb_http_message_s {
@@ -7,13 +9,30 @@ struct rb_http_message_s {
 	struct curl_slist *headers;
 	size_t len;                   // Length of the message
 	int free_message;             // If message should be free'd by the library
+	int pooled;                   // Payload goes back to the handler pool
+	int marked;                   // Produced with RB_HTTP_MESSAGE_F_MARK
 	int copy;                     // If message should be copied by the library
 	void *client_opaque;          // Opaque
-	time_t timestamp;
+	int lane;                     // RB_HTTP_LANE_NORMAL or RB_HTTP_LANE_PRIORITY
+	long produced;                // Time (ms) the message was produced
+	long expires;                 // Time (ms) the message expires, 0 for never
+	int keyed;                    // If the message has a partitioning key
+	uint64_t key_hash;            // Hash of the partitioning key
+	int status;                   // Set by the response parser, 0 to use the
+	                              // status of the POST
+	int retries;                  // Times the server asked to resend it
+	size_t bytes;                 // Memory charged to the handler budget
+	int source;                   // RB_HTTP_SOURCE_* of the payload
+	int fd;                       // RB_HTTP_SOURCE_FD: File with the payload
+	off_t offset;                 // RB_HTTP_SOURCE_FD: Payload offset in fd
+	ssize_t (*read_fn)(char *buf, size_t size, size_t offset,
+	                   void *opaque); // RB_HTTP_SOURCE_PULL: Payload reader
+	size_t read;                  // Payload bytes already sent
+	void *easy_handle;            // NORMAL_MODE: Request in progress, or NULL
 	TAILQ_ENTRY(rb_http_message_s) tailq;
 };
 
-typedef TAILQ_HEAD(, rb_http_message_s) rb_http_msg_q_t;
+typedef TAILQ_HEAD(rb_http_msg_q_s, rb_http_message_s) rb_http_msg_q_t;
 
 #define rb_http_msg_q_init(q) TAILQ_INIT(q)
 
@@ -21,6 +40,8 @@ typedef TAILQ_HEAD(, rb_http_message_s) rb_http_msg_q_t;
 
 #define rb_http_msg_q_empty(q) TAILQ_EMPTY(q)
 
+#define rb_http_msg_expired(m, now) ((m)->expires != 0 && (m)->expires <= (now))
+
 static struct rb_http_message_s *rb_http_msg_q_pop(rb_http_msg_q_t *q)
 __attribute__((unused));
 
@@ -33,4 +54,17 @@ static struct rb_http_message_s *rb_http_msg_q_pop(rb_http_msg_q_t *q) {
 	}
 
 	return p;
+}
+
+static int rb_http_msg_q_cnt(rb_http_msg_q_t *q) __attribute__((unused));
+
+static int rb_http_msg_q_cnt(rb_http_msg_q_t *q) {
+	struct rb_http_message_s *p = NULL;
+	int cnt = 0;
+
+	TAILQ_FOREACH(p, q, tailq) {
+		cnt++;
+	}
+
+	return cnt;
 }
\ No newline at end of file
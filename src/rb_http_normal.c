@@ -1,5 +1,13 @@
 #include "../config.h"
+#include "rb_http_adaptive.h"
+#include "rb_http_lanes.h"
 #include "rb_http_normal.h"
+#include "rb_http_options.h"
+#include "rb_http_payload.h"
+#include "rb_http_ratelimit.h"
+#include "rb_http_reports.h"
+#include "rb_http_trace.h"
+#include "rb_http_warm.h"
 
 static size_t write_null_callback(void *buffer, size_t size, size_t nmemb,
                                   void *opaque) {
@@ -8,7 +16,29 @@ static size_t write_null_callback(void *buffer, size_t size, size_t nmemb,
   return nmemb * size;
 }
 
+/**
+ * Writes the body of a message whose payload is not in memory
+ */
+static size_t read_payload_callback(char *buffer, size_t size, size_t nmemb,
+                                    void *opaque) {
+  struct rb_http_message_s *message = (struct rb_http_message_s *)opaque;
+  ssize_t ret = 0;
+
+  if (message->read == message->len) {
+    return 0;
+  }
+
+  ret = rb_http_payload_read(message, buffer, size * nmemb, message->read);
+  if (ret < 0) {
+    return CURL_READFUNC_ABORT;
+  }
+  message->read += (size_t)ret;
+
+  return (size_t)ret;
+}
+
 static void rb_http_send_message(struct rb_http_handler_s *rb_http_handler,
+                                 const struct rb_http_options_s *options,
                                  struct rb_http_message_s *message) {
   CURL *handler;
   handler = curl_easy_init();
@@ -19,17 +49,26 @@ static void rb_http_send_message(struct rb_http_handler_s *rb_http_handler,
     report->err_code = -1;
     report->http_code = 0;
     report->handler = NULL;
-    rd_fifoq_add(&rb_http_handler->rfq_reports, report);
+    rb_http_reports_add(rb_http_handler, report);
   }
 
-  if (curl_easy_setopt(handler, CURLOPT_URL, rb_http_handler->options->url) !=
-      CURLE_OK) {
+  if (curl_easy_setopt(handler, CURLOPT_URL, options->url) != CURLE_OK) {
+    struct rb_http_report_s *report =
+        calloc(1, sizeof(struct rb_http_report_s));
+    report->err_code = -1;
+    report->http_code = 0;
+    report->handler = NULL;
+    rb_http_reports_add(rb_http_handler, report);
+  }
+
+  if (curl_easy_setopt(handler, CURLOPT_UNIX_SOCKET_PATH,
+                       options->unix_socket) != CURLE_OK) {
     struct rb_http_report_s *report =
         calloc(1, sizeof(struct rb_http_report_s));
     report->err_code = -1;
     report->http_code = 0;
     report->handler = NULL;
-    rd_fifoq_add(&rb_http_handler->rfq_reports, report);
+    rb_http_reports_add(rb_http_handler, report);
   }
 
   message->headers = NULL;
@@ -45,7 +84,7 @@ static void rb_http_send_message(struct rb_http_handler_s *rb_http_handler,
     report->err_code = -1;
     report->http_code = 0;
     report->handler = NULL;
-    rd_fifoq_add(&rb_http_handler->rfq_reports, report);
+    rb_http_reports_add(rb_http_handler, report);
   }
   curl_easy_setopt(handler, CURLOPT_WRITEFUNCTION, write_null_callback);
 
@@ -56,37 +95,37 @@ static void rb_http_send_message(struct rb_http_handler_s *rb_http_handler,
     report->err_code = -1;
     report->http_code = 0;
     report->handler = NULL;
-    rd_fifoq_add(&rb_http_handler->rfq_reports, report);
+    rb_http_reports_add(rb_http_handler, report);
   }
 
   if (curl_easy_setopt(handler, CURLOPT_VERBOSE,
-                       rb_http_handler->options->verbose) != CURLE_OK) {
+                       options->verbose) != CURLE_OK) {
     struct rb_http_report_s *report =
         calloc(1, sizeof(struct rb_http_report_s));
     report->err_code = -1;
     report->http_code = 0;
     report->handler = NULL;
-    rd_fifoq_add(&rb_http_handler->rfq_reports, report);
+    rb_http_reports_add(rb_http_handler, report);
   }
 
   if (curl_easy_setopt(handler, CURLOPT_TIMEOUT_MS,
-                       rb_http_handler->options->timeout) != CURLE_OK) {
+                       options->timeout) != CURLE_OK) {
     struct rb_http_report_s *report =
         calloc(1, sizeof(struct rb_http_report_s));
     report->err_code = -1;
     report->http_code = 0;
     report->handler = NULL;
-    rd_fifoq_add(&rb_http_handler->rfq_reports, report);
+    rb_http_reports_add(rb_http_handler, report);
   }
 
   if (curl_easy_setopt(handler, CURLOPT_CONNECTTIMEOUT_MS,
-                       rb_http_handler->options->conntimeout) != CURLE_OK) {
+                       options->conntimeout) != CURLE_OK) {
     struct rb_http_report_s *report =
         calloc(1, sizeof(struct rb_http_report_s));
     report->err_code = -1;
     report->http_code = 0;
     report->handler = NULL;
-    rd_fifoq_add(&rb_http_handler->rfq_reports, report);
+    rb_http_reports_add(rb_http_handler, report);
   }
 
   if (curl_easy_setopt(handler, CURLOPT_POSTFIELDSIZE, message->len) !=
@@ -96,23 +135,34 @@ static void rb_http_send_message(struct rb_http_handler_s *rb_http_handler,
     report->err_code = -1;
     report->http_code = 0;
     report->handler = NULL;
-    rd_fifoq_add(&rb_http_handler->rfq_reports, report);
+    rb_http_reports_add(rb_http_handler, report);
   }
 
-  if (curl_easy_setopt(handler, CURLOPT_POSTFIELDS, message->payload) !=
-      CURLE_OK) {
+  if (message->source == RB_HTTP_SOURCE_FD ||
+      message->source == RB_HTTP_SOURCE_PULL) {
+    // The payload is read as the request is written
+    message->read = 0;
+    curl_easy_setopt(handler, CURLOPT_POST, 1L);
+    curl_easy_setopt(handler, CURLOPT_POSTFIELDSIZE_LARGE,
+                     (curl_off_t)message->len);
+    curl_easy_setopt(handler, CURLOPT_READDATA, message);
+    curl_easy_setopt(handler, CURLOPT_READFUNCTION, read_payload_callback);
+  } else if (curl_easy_setopt(handler, CURLOPT_POSTFIELDS, message->payload) !=
+             CURLE_OK) {
     struct rb_http_report_s *report =
         calloc(1, sizeof(struct rb_http_report_s));
     report->err_code = -1;
     report->http_code = 0;
     report->handler = NULL;
-    rd_fifoq_add(&rb_http_handler->rfq_reports, report);
+    rb_http_reports_add(rb_http_handler, report);
   }
 
-  if (rb_http_handler->options->insecure) {
+  if (options->insecure) {
     curl_easy_setopt(handler, CURLOPT_SSL_VERIFYPEER, 0);
     curl_easy_setopt(handler, CURLOPT_SSL_VERIFYHOST, 0);
   }
+  rb_http_warm_keepalive(handler, options);
+  message->easy_handle = handler;
 
   if (curl_multi_add_handle(rb_http_handler->multi_handle, handler) !=
       CURLM_OK) {
@@ -121,16 +171,93 @@ static void rb_http_send_message(struct rb_http_handler_s *rb_http_handler,
     report->err_code = -1;
     report->http_code = 0;
     report->handler = NULL;
-    rd_fifoq_add(&rb_http_handler->rfq_reports, report);
+    rb_http_reports_add(rb_http_handler, report);
   }
-  if (curl_multi_perform(rb_http_handler->multi_handle,
-                         &rb_http_handler->still_running) != CURLM_OK) {
+
+  // A runtime worker drives the transfer when curl asks for it
+  if (rb_http_handler->runtime != NULL) {
+    rb_http_handler->still_running++;
+  } else if (curl_multi_perform(rb_http_handler->multi_handle,
+                                &rb_http_handler->still_running) !=
+             CURLM_OK) {
     struct rb_http_report_s *report =
         calloc(1, sizeof(struct rb_http_report_s));
     report->err_code = -1;
     report->http_code = 0;
     report->handler = NULL;
-    rd_fifoq_add(&rb_http_handler->rfq_reports, report);
+    rb_http_reports_add(rb_http_handler, report);
+  }
+}
+
+void rb_http_normal_done(struct rb_http_handler_s *rb_http_handler) {
+  struct rb_http_report_s *report = NULL;
+  struct rb_http_message_s *message = NULL;
+  CURLMsg *msg = NULL;
+  double pretransfer_time = 0;
+  double starttransfer_time = 0;
+  int limit = 0;
+  int last_limit = rb_http_handler->limit.limit;
+
+  while ((msg = curl_multi_info_read(rb_http_handler->multi_handle,
+                                     &rb_http_handler->msgs_left))) {
+    if (msg->msg == CURLMSG_DONE) {
+      message = NULL;
+      if (curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE,
+                            (char **)&message) == CURLE_OK &&
+          message == NULL) {
+        // Pre-warm probe started on a runtime worker
+        rb_http_warm_done(rb_http_handler->threads[0], msg->easy_handle,
+                          msg->data.result);
+        continue;
+      }
+
+      report = calloc(1, sizeof(struct rb_http_report_s));
+      if (message == NULL) {
+        report->err_code = -1;
+        report->http_code = 0;
+        report->handler = NULL;
+        rb_http_reports_add(rb_http_handler, report);
+        continue;
+      }
+
+      TAILQ_REMOVE(&rb_http_handler->threads[0]->inflight, message, tailq);
+      message->easy_handle = NULL;
+      ATOMIC_OP(sub, fetch, &rb_http_handler->outstanding, 1);
+      report->err_code = msg->data.result;
+      report->handler = msg->easy_handle;
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE,
+                        &report->http_code);
+      RB_HTTP_TRACE(rb_http_handler, RB_HTTP_TRACE_POST_END, post_end, 0,
+                    report->http_code, msg->data.result);
+
+      // Let the requests limit follow the collector latency: from the
+      // request being sent to the first response byte. Time waiting for a
+      // free connection is not counted.
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRETRANSFER_TIME,
+                        &pretransfer_time);
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_STARTTRANSFER_TIME,
+                        &starttransfer_time);
+      limit = rb_http_limit_update(
+          &rb_http_handler->limit,
+          (long)((starttransfer_time - pretransfer_time) * 1000),
+          report->http_code, rb_http_now_ms());
+      if (limit != last_limit) {
+        curl_multi_setopt(rb_http_handler->multi_handle,
+                          CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)limit);
+        last_limit = limit;
+      }
+
+      if (curl_multi_remove_handle(rb_http_handler->multi_handle,
+                                   msg->easy_handle) != CURLM_OK) {
+        report->err_code = -1;
+        report->http_code = 0;
+        report->handler = msg->easy_handle;
+        rb_http_reports_add(rb_http_handler, report);
+        continue;
+      }
+
+      rb_http_reports_add(rb_http_handler, report);
+    }
   }
 }
 
@@ -141,10 +268,6 @@ static void rb_http_send_message(struct rb_http_handler_s *rb_http_handler,
  */
 static void rb_http_recv_message(struct rb_http_handler_s *rb_http_handler) {
 
-  struct rb_http_report_s *report = NULL;
-  struct rb_http_message_s *message = NULL;
-  CURLMsg *msg = NULL;
-
   struct timeval timeout;
   int rc;       /* select() return code */
   CURLMcode mc; /* curl_multi_fdset() return code */
@@ -171,7 +294,7 @@ static void rb_http_recv_message(struct rb_http_handler_s *rb_http_handler) {
     ireport->err_code = -1;
     ireport->http_code = 0;
     ireport->handler = NULL;
-    rd_fifoq_add(&rb_http_handler->rfq_reports, ireport);
+    rb_http_reports_add(rb_http_handler, ireport);
   }
 
   if (curl_timeo >= 0) {
@@ -193,7 +316,7 @@ static void rb_http_recv_message(struct rb_http_handler_s *rb_http_handler) {
     ireport->err_code = -1;
     ireport->http_code = 0;
     ireport->handler = NULL;
-    rd_fifoq_add(&rb_http_handler->rfq_reports, ireport);
+    rb_http_reports_add(rb_http_handler, ireport);
   }
 
   /* On success the value of maxfd is guaranteed to be >= -1. We call
@@ -225,43 +348,130 @@ static void rb_http_recv_message(struct rb_http_handler_s *rb_http_handler) {
       ireport->err_code = -1;
       ireport->http_code = 0;
       ireport->handler = NULL;
-      rd_fifoq_add(&rb_http_handler->rfq_reports, ireport);
+      rb_http_reports_add(rb_http_handler, ireport);
     }
     break;
   }
 
-  /* See how the transfers went */
-  while ((msg = curl_multi_info_read(rb_http_handler->multi_handle,
-                                     &rb_http_handler->msgs_left))) {
-    if (msg->msg == CURLMSG_DONE) {
-      report = calloc(1, sizeof(struct rb_http_report_s));
+  rb_http_normal_done(rb_http_handler);
+}
 
-      if (curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE,
-                            (char **)&message) != CURLE_OK) {
-        report->err_code = -1;
-        report->http_code = 0;
-        report->handler = NULL;
-        rd_fifoq_add(&rb_http_handler->rfq_reports, report);
-        continue;
-      }
+/**
+ * Checks if new requests must wait for the rate limits
+ * @param  rb_http_handler Handler
+ * @param  options         Options of the thread
+ * @return                 Bucket in debt, NULL if a request can be started
+ */
+static struct rb_http_ratelimit_s *
+normal_throttled(struct rb_http_handler_s *rb_http_handler,
+                 const struct rb_http_options_s *options) {
+  const long now = rb_http_now_ms();
+
+  if (rb_http_ratelimit_take(&rb_http_handler->requests_rate,
+                             options->max_requests_per_sec,
+                             options->requests_burst, 0, now) > 0) {
+    return &rb_http_handler->requests_rate;
+  }
+  if (rb_http_ratelimit_take(&rb_http_handler->bytes_rate,
+                             options->max_bytes_per_sec, options->bytes_burst,
+                             0, now) > 0) {
+    return &rb_http_handler->bytes_rate;
+  }
 
-      report->err_code = msg->data.result;
-      report->handler = msg->easy_handle;
-      curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE,
-                        &report->http_code);
+  return NULL;
+}
 
-      if (curl_multi_remove_handle(rb_http_handler->multi_handle,
-                                   msg->easy_handle) != CURLM_OK) {
-        report->err_code = -1;
-        report->http_code = 0;
-        report->handler = msg->easy_handle;
-        rd_fifoq_add(&rb_http_handler->rfq_reports, report);
-        continue;
+/**
+ * Starts the request of a message taken from the lanes
+ * @param rb_http_threaddata Thread
+ * @param message            Message
+ */
+static void normal_send(struct rb_http_threaddata_s *rb_http_threaddata,
+                        struct rb_http_message_s *message) {
+  struct rb_http_handler_s *rb_http_handler =
+      rb_http_threaddata->rb_http_handler;
+  const struct rb_http_options_s *options = rb_http_threaddata->options;
+  const long now = rb_http_now_ms();
+
+  RB_HTTP_TRACE(rb_http_handler, RB_HTTP_TRACE_DEQUEUE, dequeue, 0,
+                (uintptr_t)message, now - message->produced);
+  rb_http_lanes_dequeued(rb_http_handler, message, now);
+  rb_http_ratelimit_take(&rb_http_handler->requests_rate,
+                         options->max_requests_per_sec,
+                         options->requests_burst, 1, now);
+  rb_http_ratelimit_take(&rb_http_handler->bytes_rate,
+                         options->max_bytes_per_sec, options->bytes_burst,
+                         (long)message->len, now);
+  RB_HTTP_TRACE(rb_http_handler, RB_HTTP_TRACE_POST_START, post_start, 0,
+                (uintptr_t)message, message->len);
+  rb_http_send_message(rb_http_handler, options, message);
+  rb_http_msg_q_add(&rb_http_threaddata->inflight, message);
+  rb_http_threaddata->last_request = now;
+}
+
+int rb_http_normal_dispatch(struct rb_http_threaddata_s *rb_http_threaddata,
+                            int max) {
+  struct rb_http_handler_s *rb_http_handler =
+      rb_http_threaddata->rb_http_handler;
+  struct rb_http_message_s *message = NULL;
+  struct rb_http_ratelimit_s *bucket = NULL;
+  int limit = 0;
+  int sent = 0;
+
+  if (rb_http_options_refresh(rb_http_handler, &rb_http_threaddata->options)) {
+    curl_multi_setopt(
+        rb_http_handler->multi_handle, CURLMOPT_MAX_TOTAL_CONNECTIONS,
+        (long)ATOMIC_OP(add, fetch, &rb_http_handler->limit.limit, 0));
+  }
+  limit = ATOMIC_OP(add, fetch, &rb_http_handler->limit.limit, 0);
+
+  // Open the connections before the first message
+  if (rb_http_threaddata->last_request == 0) {
+    rb_http_threaddata->last_request = rb_http_now_ms();
+    if (rb_http_threaddata->options->prewarm) {
+      rb_http_warm_start(rb_http_threaddata, limit);
+    }
+  }
+
+  // Requests beyond the limit would only wait inside curl, out of turn
+  while (sent < max && rb_http_handler->still_running < limit) {
+    bucket = normal_throttled(rb_http_handler, rb_http_threaddata->options);
+    if (bucket != NULL) {
+      if (bucket != rb_http_threaddata->throttled) {
+        ATOMIC_OP64(add, fetch, &bucket->throttled, 1);
       }
+      break;
+    }
+
+    message = rb_http_lanes_pop(&rb_http_threaddata->lanes,
+                                rb_http_threaddata->options->priority_weight,
+                                0);
+    if (message == NULL) {
+      break;
+    }
+    if (rb_http_msg_expired(message, rb_http_now_ms())) {
+      rb_http_msg_q_t expired;
 
-      rd_fifoq_add(&rb_http_handler->rfq_reports, report);
+      rb_http_msg_q_init(&expired);
+      rb_http_msg_q_add(&expired, message);
+      rb_http_lanes_report_expired(rb_http_handler, &expired);
+      continue;
     }
+
+    normal_send(rb_http_threaddata, message);
+    sent++;
   }
+  rb_http_threaddata->throttled = bucket;
+
+  // Keep the connections open while there is nothing to send
+  if (sent == 0 && rb_http_threaddata->options->idle_probe > 0 &&
+      rb_http_handler->still_running == 0 &&
+      rb_http_now_ms() - rb_http_threaddata->last_request >=
+          rb_http_threaddata->options->idle_probe) {
+    rb_http_warm_start(rb_http_threaddata, limit);
+  }
+
+  return sent;
 }
 
 void *rb_http_process_normal(void *arg) {
@@ -274,70 +484,142 @@ void *rb_http_process_normal(void *arg) {
 
   assert(rb_http_threaddata != NULL);
   assert(rb_http_handler != NULL);
-  assert(rb_http_handler->options != NULL);
+  assert(rb_http_threaddata->options != NULL);
 
-  rd_fifoq_elm_t *rfqe = NULL;
+  struct rb_http_message_s *message = NULL;
+  struct rb_http_ratelimit_s *bucket = NULL;
+  struct rb_http_ratelimit_s *throttled = NULL; // Bucket holding requests
 
   if (arg != NULL) {
+    // Open the connections before the first message arrives
+    if (rb_http_threaddata->options->prewarm) {
+      rb_http_warm_multi(
+          rb_http_threaddata,
+          ATOMIC_OP(add, fetch, &rb_http_handler->limit.limit, 0));
+    }
+
     while (rb_http_handler->thread_running) {
-      rfqe = rd_fifoq_pop(&rb_http_threaddata->rfq);
-      if (rfqe != NULL && rfqe->rfqe_ptr != NULL) {
-        rb_http_send_message(rb_http_handler, rfqe->rfqe_ptr);
-        rd_fifoq_elm_release(&rb_http_threaddata->rfq, rfqe);
+      // Every message is a request of its own, so new options are applied
+      // to the next message
+      if (rb_http_options_refresh(rb_http_handler,
+                                  &rb_http_threaddata->options)) {
+        curl_multi_setopt(
+            rb_http_handler->multi_handle, CURLMOPT_MAX_TOTAL_CONNECTIONS,
+            (long)ATOMIC_OP(add, fetch, &rb_http_handler->limit.limit, 0));
+      }
+
+      // New requests wait for the rate limits, the ones in flight don't
+      bucket = normal_throttled(rb_http_handler, rb_http_threaddata->options);
+      if (bucket != NULL) {
+        const long start = rb_http_now_ms();
+
+        if (bucket != throttled) {
+          ATOMIC_OP64(add, fetch, &bucket->throttled, 1);
+        }
+        throttled = bucket;
+        rb_http_recv_message(rb_http_handler);
+        ATOMIC_OP64(add, fetch, &bucket->throttled_ms,
+                    (uint64_t)(rb_http_now_ms() - start));
+        continue;
+      }
+      throttled = NULL;
+
+      message = rb_http_lanes_pop(&rb_http_threaddata->lanes,
+                                  rb_http_threaddata->options->priority_weight,
+                                  0);
+      if (message != NULL && rb_http_msg_expired(message, rb_http_now_ms())) {
+        rb_http_msg_q_t expired;
+
+        rb_http_msg_q_init(&expired);
+        rb_http_msg_q_add(&expired, message);
+        rb_http_lanes_report_expired(rb_http_handler, &expired);
+      } else if (message != NULL) {
+        normal_send(rb_http_threaddata, message);
+      } else if (rb_http_threaddata->options->idle_probe > 0 &&
+                 rb_http_handler->still_running == 0 &&
+                 rb_http_now_ms() - rb_http_threaddata->last_request >=
+                     rb_http_threaddata->options->idle_probe) {
+        // Keep the connections open while there is nothing to send
+        rb_http_warm_multi(
+            rb_http_threaddata,
+            ATOMIC_OP(add, fetch, &rb_http_handler->limit.limit, 0));
       } else {
         rb_http_recv_message(rb_http_handler);
       }
     }
+
+    rb_http_options_release(rb_http_handler, rb_http_threaddata->options);
   }
 
   return NULL;
 }
 
-int rb_http_get_reports_normal(struct rb_http_handler_s *rb_http_handler,
-                               cb_report report_fn, int timeout_ms) {
-  rd_fifoq_elm_t *rfqe;
-  struct rb_http_report_s *report = NULL;
+void rb_http_normal_abort(struct rb_http_threaddata_s *rb_http_threaddata) {
+  struct rb_http_handler_s *rb_http_handler =
+      rb_http_threaddata->rb_http_handler;
   struct rb_http_message_s *message = NULL;
-  int nowait = 0;
-  long http_code = 0;
-  char *str_error = NULL;
+  struct rb_http_report_s *report = NULL;
+  int i = 0;
 
-  if (timeout_ms == 0) {
-    nowait = 1;
+  for (i = 0; i < rb_http_threaddata->probe_handles_cnt; i++) {
+    if (rb_http_threaddata->probe_handles[i] != NULL) {
+      rb_http_warm_done(rb_http_threaddata,
+                        rb_http_threaddata->probe_handles[i],
+                        CURLE_ABORTED_BY_CALLBACK);
+    }
   }
 
-  while ((rfqe = rd_fifoq_pop0(&rb_http_handler->rfq_reports, nowait,
-                               timeout_ms)) != NULL) {
-    if (rfqe->rfqe_ptr != NULL) {
-      report = rfqe->rfqe_ptr;
+  while ((message = rb_http_msg_q_pop(&rb_http_threaddata->inflight)) !=
+         NULL) {
+    curl_multi_remove_handle(rb_http_handler->multi_handle,
+                             message->easy_handle);
+    report = calloc(1, sizeof(struct rb_http_report_s));
+    report->err_code = RB_HTTP_ERR_ABORTED;
+    report->handler = message->easy_handle;
+    message->easy_handle = NULL;
+    ATOMIC_OP(sub, fetch, &rb_http_handler->outstanding, 1);
+    rb_http_reports_add(rb_http_handler, report);
+  }
+}
 
-      if (report->handler != NULL) {
-        curl_easy_getinfo(report->handler, CURLINFO_PRIVATE, (char **)&message);
+void rb_http_report_normal(struct rb_http_handler_s *rb_http_handler,
+                           struct rb_http_report_s *report,
+                           cb_report report_fn) {
+  struct rb_http_message_s *message = NULL;
+  long http_code = 0;
 
-        http_code = report->http_code;
+  if (report->handler != NULL) {
+    curl_easy_getinfo(report->handler, CURLINFO_PRIVATE, (char **)&message);
 
-        if (message != NULL) {
-          ATOMIC_OP(sub, fetch, &rb_http_handler->left, 1);
-          str_error = strdup(curl_easy_strerror(report->err_code));
-          report_fn(rb_http_handler, report->err_code, http_code, str_error,
-                    message->payload, message->len, message->client_opaque);
-          curl_slist_free_all(message->headers);
+    http_code = report->http_code;
 
-          if (message->free_message && message->payload != NULL) {
-            free(message->payload);
-            message->payload = NULL;
-            free(message);
-            message = NULL;
-          }
+    if (message != NULL) {
+      rb_http_lanes_delivered(rb_http_handler, message, rb_http_now_ms());
+      ATOMIC_OP(sub, fetch, &rb_http_handler->left, 1);
+      RB_HTTP_TRACE(rb_http_handler, RB_HTTP_TRACE_REPORT, report, -1,
+                    (uintptr_t)message, report->err_code);
+      report_fn(rb_http_handler, report->err_code, http_code,
+                rb_http_strerror(report->err_code), message->payload,
+                message->len, message->client_opaque);
+      curl_slist_free_all(message->headers);
+      rb_http_message_free(rb_http_handler, message);
 
-          curl_easy_cleanup(report->handler);
-        }
-      }
-      free(report);
-      report = NULL;
-      rd_fifoq_elm_release(&rb_http_handler->rfq_reports, rfqe);
+      curl_easy_cleanup(report->handler);
     }
+  } else if (report->rfq_msgs != NULL) {
+    // Messages that were never sent, like expired ones
+    while ((message = rb_http_msg_q_pop(report->rfq_msgs)) != NULL) {
+      rb_http_lanes_delivered(rb_http_handler, message, rb_http_now_ms());
+      ATOMIC_OP(sub, fetch, &rb_http_handler->left, 1);
+      RB_HTTP_TRACE(rb_http_handler, RB_HTTP_TRACE_REPORT, report, -1,
+                    (uintptr_t)message, report->err_code);
+      report_fn(rb_http_handler, report->err_code, report->http_code,
+                rb_http_strerror(report->err_code), message->payload,
+                message->len, message->client_opaque);
+
+      rb_http_message_free(rb_http_handler, message);
+    }
+    free(report->rfq_msgs);
   }
-
-  return rb_http_handler->left;
+  free(report);
 }
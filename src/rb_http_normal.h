@@ -8,11 +8,35 @@
 void *rb_http_process_normal (void *arg);
 
 /**
- * [rb_http_get_reports_normal  description]
- * @param  rb_http_handler [description]
- * @param  report_fn       [description]
- * @param  timeout_ms      [description]
- * @return                 [description]
+ * Starts the requests of the next messages of a handler served by a runtime
+ * worker, up to the requests limit
+ * @param  rb_http_threaddata Thread data of the handler
+ * @param  max                Max requests to start
+ * @return                    Requests started
  */
-int rb_http_get_reports_normal (struct rb_http_handler_s *rb_http_handler,
-                                cb_report report_fn, int timeout_ms);
\ No newline at end of file
+int rb_http_normal_dispatch (struct rb_http_threaddata_s *rb_http_threaddata,
+                             int max);
+
+/**
+ * Queues the reports of the finished transfers of the multi handle
+ * @param rb_http_handler Handler
+ */
+void rb_http_normal_done (struct rb_http_handler_s *rb_http_handler);
+
+/**
+ * Delivers a report to the application and frees it
+ * @param rb_http_handler Handler
+ * @param report          Report to deliver
+ * @param report_fn       Callback for each message of the report
+ */
+void rb_http_report_normal (struct rb_http_handler_s *rb_http_handler,
+                            struct rb_http_report_s *report,
+                            cb_report report_fn);
+
+/**
+ * Removes the requests still in progress from the multi handle, so it can
+ * be cleaned up. Their messages are reported with RB_HTTP_ERR_ABORTED, and
+ * pre-warm probes are dropped.
+ * @param rb_http_threaddata Thread data of the handler
+ */
+void rb_http_normal_abort (struct rb_http_threaddata_s *rb_http_threaddata);
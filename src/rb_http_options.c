@@ -0,0 +1,291 @@
+/**
+ * @file rb_http_options.c
+ * @brief Versioned handler options.
+ *
+ * Options are immutable snapshots. rb_http_handler_set_opt() copies the
+ * current snapshot, modifies the copy and publishes it. Worker threads hold
+ * a reference to the snapshot they are using and switch to the new one
+ * between POSTs, so a POST is always sent with a consistent set of options.
+ * A snapshot is freed when its last reference is released.
+ */
+#include "../config.h"
+#include "rb_http_options.h"
+
+static void options_free(struct rb_http_options_s *options) {
+  int i = 0;
+
+  free(options->url);
+  free(options->unix_socket);
+  for (i = 0; i < options->fanout_cnt; i++) {
+    free(options->fanout_urls[i]);
+  }
+  free(options);
+}
+
+/**
+ * Sets the extra destinations of a snapshot
+ * @param  options Snapshot
+ * @param  val     Comma separated URLs, empty for none
+ * @param  err     Error description
+ * @param  errsize Size of err
+ * @return         0 if set, -1 if there are too many destinations
+ */
+static int options_set_fanout(struct rb_http_options_s *options,
+                              const char *val, char *err, size_t errsize) {
+  char *urls = strdup(val);
+  char *saveptr = NULL;
+  char *url = NULL;
+  int i = 0;
+
+  for (i = 0; i < options->fanout_cnt; i++) {
+    free(options->fanout_urls[i]);
+  }
+  options->fanout_cnt = 0;
+
+  for (url = strtok_r(urls, ",", &saveptr); url != NULL;
+       url = strtok_r(NULL, ",", &saveptr)) {
+    if (options->fanout_cnt == RB_HTTP_MAX_DESTINATIONS - 1) {
+      snprintf(err, errsize, "Too many destinations, max is %d",
+               RB_HTTP_MAX_DESTINATIONS);
+      free(urls);
+      return -1;
+    }
+    options->fanout_urls[options->fanout_cnt++] = strdup(url);
+  }
+
+  free(urls);
+  return 0;
+}
+
+/**
+ * Computes the options that depend on other options
+ * @param options Snapshot to update
+ */
+static void options_finalize(struct rb_http_options_s *options) {
+  if (options->max_batch_messages_auto) {
+    options->max_batch_messages = options->max_messages / 10;
+  }
+  options->post_timeout = options->batch_timeout;
+}
+
+struct rb_http_options_s *rb_http_options_new(const char *url) {
+  struct rb_http_options_s *options =
+      calloc(1, sizeof(struct rb_http_options_s));
+
+  options->refcnt = 1;
+  options->version = 1;
+  options->max_messages = DEFAULT_MAX_MESSAGES;
+  options->max_priority_messages = DEFAULT_MAX_PRIORITY_MESSAGES;
+  options->priority_weight = DEFAULT_PRIORITY_WEIGHT;
+  options->conntimeout = DEFAULT_CONTTIMEOUT;
+  options->connections = DEFAULT_CONNECTIONS;
+  options->timeout = DEFAULT_TIMEOUT;
+  options->url = strdup(url);
+  options->mode = NORMAL_MODE;
+  options->insecure = 0;
+  options->min_connections = DEFAULT_MIN_CONNECTIONS;
+  options->min_batch_messages = DEFAULT_MIN_BATCH_MESSAGES;
+  options->min_batch_timeout = DEFAULT_MIN_BATCH_TIMEOUT;
+  options->max_batch_timeout = DEFAULT_MAX_BATCH_TIMEOUT;
+  options->min_retry_backoff = DEFAULT_MIN_RETRY_BACKOFF;
+  options->max_retry_backoff = DEFAULT_MAX_RETRY_BACKOFF;
+  options->work_stealing = 1;
+  options->drain_timeout = DEFAULT_DRAIN_TIMEOUT;
+  options->max_message_retries = DEFAULT_MAX_MESSAGE_RETRIES;
+  options->fanout_retries = DEFAULT_FANOUT_RETRIES;
+  options->max_batch_messages_auto = 1;
+
+  options_finalize(options);
+
+  return options;
+}
+
+struct rb_http_options_s *
+rb_http_options_dup(const struct rb_http_options_s *options) {
+  struct rb_http_options_s *dup = calloc(1, sizeof(struct rb_http_options_s));
+  int i = 0;
+
+  memcpy(dup, options, sizeof(*dup));
+  dup->refcnt = 1;
+  dup->version = options->version + 1;
+  dup->url = strdup(options->url);
+  if (options->unix_socket != NULL) {
+    dup->unix_socket = strdup(options->unix_socket);
+  }
+  for (i = 0; i < options->fanout_cnt; i++) {
+    dup->fanout_urls[i] = strdup(options->fanout_urls[i]);
+  }
+
+  return dup;
+}
+
+int rb_http_options_set(struct rb_http_options_s *options, const char *key,
+                        const char *val, char *err, size_t errsize) {
+  if (key == NULL || val == NULL) {
+    snprintf(err, errsize, "Invalid option");
+    return -1;
+  }
+
+  if (!strcmp(key, "RB_HTTP_CONNECTIONS")) {
+    options->connections = atoi(val);
+  } else if (!strcmp(key, "RB_HTTP_ADAPTIVE_CONNECTIONS")) {
+    options->adaptive_connections = atoi(val);
+  } else if (!strcmp(key, "RB_HTTP_MIN_CONNECTIONS")) {
+    options->min_connections = atoi(val);
+  } else if (!strcmp(key, "HTTP_VERBOSE")) {
+    options->verbose = atol(val);
+  } else if (!strcmp(key, "RB_HTTP_MODE")) {
+    options->mode = atoi(val);
+  } else if (!strcmp(key, "RB_HTTP_FRAMING")) {
+    options->framing = atoi(val);
+  } else if (!strcmp(key, "HTTP_URL")) {
+    free(options->url);
+    options->url = strdup(val);
+  } else if (!strcmp(key, "HTTP_UNIX_SOCKET_PATH")) {
+    free(options->unix_socket);
+    options->unix_socket = val[0] != '\0' ? strdup(val) : NULL;
+  } else if (!strcmp(key, "RB_HTTP_FANOUT_URLS")) {
+    return options_set_fanout(options, val, err, errsize);
+  } else if (!strcmp(key, "RB_HTTP_FANOUT_QUORUM")) {
+    options->fanout_quorum = atoi(val);
+  } else if (!strcmp(key, "RB_HTTP_FANOUT_RETRIES")) {
+    options->fanout_retries = atoi(val);
+  } else if (!strcmp(key, "HTTP_TIMEOUT")) {
+    options->timeout = atol(val);
+  } else if (!strcmp(key, "HTTP_CONNTTIMEOUT")) {
+    options->conntimeout = atol(val);
+  } else if (!strcmp(key, "RB_HTTP_MAX_MESSAGES")) {
+    options->max_messages = atoi(val);
+  } else if (!strcmp(key, "RB_HTTP_MAX_PRIORITY_MESSAGES")) {
+    options->max_priority_messages = atoi(val);
+  } else if (!strcmp(key, "RB_HTTP_PRIORITY_WEIGHT")) {
+    options->priority_weight = atoi(val);
+  } else if (!strcmp(key, "RB_HTTP_MESSAGE_TTL")) {
+    options->message_ttl = atol(val);
+  } else if (!strcmp(key, "RB_HTTP_MAX_BYTES")) {
+    options->max_bytes = atol(val);
+  } else if (!strcmp(key, "RB_HTTP_MAX_BYTES_PER_SEC")) {
+    options->max_bytes_per_sec = atol(val);
+  } else if (!strcmp(key, "RB_HTTP_BYTES_BURST")) {
+    options->bytes_burst = atol(val);
+  } else if (!strcmp(key, "RB_HTTP_MAX_REQUESTS_PER_SEC")) {
+    options->max_requests_per_sec = atol(val);
+  } else if (!strcmp(key, "RB_HTTP_REQUESTS_BURST")) {
+    options->requests_burst = atol(val);
+  } else if (!strcmp(key, "RB_HTTP_MAX_BATCH_MESSAGES")) {
+    options->max_batch_messages = atoi(val);
+    options->max_batch_messages_auto = options->max_batch_messages <= 0;
+  } else if (!strcmp(key, "RB_HTTP_MAX_BATCH_BYTES")) {
+    options->max_batch_bytes = atol(val);
+  } else if (!strcmp(key, "RB_HTTP_MAX_BATCH_COMPRESSED_BYTES")) {
+    options->max_batch_compressed_bytes = atol(val);
+  } else if (!strcmp(key, "RB_HTTP_MAX_POST_DURATION")) {
+    options->max_post_duration = atol(val);
+  } else if (!strcmp(key, "RB_HTTP_ADAPTIVE_BATCH")) {
+    options->adaptive_batch = atoi(val);
+  } else if (!strcmp(key, "RB_HTTP_MIN_BATCH_MESSAGES")) {
+    options->min_batch_messages = atoi(val);
+  } else if (!strcmp(key, "RB_HTTP_MIN_BATCH_TIMEOUT")) {
+    options->min_batch_timeout = atol(val);
+  } else if (!strcmp(key, "RB_HTTP_MAX_BATCH_TIMEOUT")) {
+    options->max_batch_timeout = atol(val);
+  } else if (!strcmp(key, "RB_HTTP_DRAIN_TIMEOUT")) {
+    options->drain_timeout = atol(val);
+  } else if (!strcmp(key, "RB_HTTP_MAX_RESPONSE_BYTES")) {
+    options->max_response_bytes = atol(val);
+  } else if (!strcmp(key, "RB_HTTP_MAX_MESSAGE_RETRIES")) {
+    options->max_message_retries = atoi(val);
+  } else if (!strcmp(key, "RB_HTTP_WORK_STEALING")) {
+    options->work_stealing = atoi(val);
+  } else if (!strcmp(key, "RB_HTTP_MIN_RETRY_BACKOFF")) {
+    options->min_retry_backoff = atol(val);
+  } else if (!strcmp(key, "RB_HTTP_MAX_RETRY_BACKOFF")) {
+    options->max_retry_backoff = atol(val);
+  } else if (!strcmp(key, "RB_HTTP_BATCH_TIMEOUT")) {
+    options->batch_timeout = atoi(val);
+  } else if (!strcmp(key, "RB_HTTP_PREWARM")) {
+    options->prewarm = atoi(val);
+  } else if (!strcmp(key, "RB_HTTP_IDLE_PROBE")) {
+    options->idle_probe = atol(val);
+  } else if (!strcmp(key, "RB_HTTP_TCP_KEEPALIVE")) {
+    options->tcp_keepalive = atol(val);
+  } else if (!strcmp(key, "HTTP_INSECURE")) {
+    options->insecure = atol(val);
+  } else {
+    snprintf(err, errsize, "Error decoding option: \"%s: %s\"", key, val);
+    return -1;
+  }
+
+  return 0;
+}
+
+struct rb_http_options_s *
+rb_http_options_acquire(struct rb_http_handler_s *rb_http_handler) {
+  struct rb_http_options_s *options = NULL;
+
+  pthread_mutex_lock(&rb_http_handler->options_lock);
+  options = rb_http_handler->options;
+  options->refcnt++;
+  pthread_mutex_unlock(&rb_http_handler->options_lock);
+
+  return options;
+}
+
+void rb_http_options_release(struct rb_http_handler_s *rb_http_handler,
+                             struct rb_http_options_s *options) {
+  int refcnt = 0;
+
+  pthread_mutex_lock(&rb_http_handler->options_lock);
+  refcnt = --options->refcnt;
+  pthread_mutex_unlock(&rb_http_handler->options_lock);
+
+  if (refcnt == 0) {
+    options_free(options);
+  }
+}
+
+void rb_http_options_release_locked(struct rb_http_options_s *options) {
+  if (--options->refcnt == 0) {
+    options_free(options);
+  }
+}
+
+void rb_http_options_publish(struct rb_http_handler_s *rb_http_handler,
+                             struct rb_http_options_s *options) {
+  struct rb_http_options_s *old = rb_http_handler->options;
+
+  options_finalize(options);
+  rb_http_handler->options = options;
+  rb_http_handler->max_messages = options->max_messages;
+  rb_http_handler->max_priority_messages = options->max_priority_messages;
+  rb_http_handler->message_ttl = options->message_ttl;
+  rb_http_handler->framing = options->framing;
+  rb_http_handler->max_bytes = options->max_bytes;
+  ATOMIC_OP(add, fetch, &rb_http_handler->options_version, 1);
+
+  rb_http_options_release_locked(old);
+}
+
+int rb_http_options_refresh(struct rb_http_handler_s *rb_http_handler,
+                            struct rb_http_options_s **options) {
+  struct rb_http_options_s *old = *options;
+  int refcnt = 0;
+
+  // Fast path: nothing has been published since the thread got its snapshot
+  if (old->version ==
+      ATOMIC_OP(add, fetch, &rb_http_handler->options_version, 0)) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&rb_http_handler->options_lock);
+  *options = rb_http_handler->options;
+  (*options)->refcnt++;
+  refcnt = --old->refcnt;
+  pthread_mutex_unlock(&rb_http_handler->options_lock);
+
+  if (refcnt == 0) {
+    options_free(old);
+  }
+
+  return 1;
+}
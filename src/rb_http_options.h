@@ -0,0 +1,73 @@
+#include "rb_http_handler.h"
+
+/**
+ * Creates an options snapshot with default values
+ * @param  url Endpoint URL
+ * @return     New snapshot, with one reference owned by the caller
+ */
+struct rb_http_options_s *rb_http_options_new(const char *url);
+
+/**
+ * Copies an options snapshot. The copy gets the next version number.
+ * @param  options Snapshot to copy
+ * @return         New snapshot, with one reference owned by the caller
+ */
+struct rb_http_options_s *
+rb_http_options_dup(const struct rb_http_options_s *options);
+
+/**
+ * Sets an option on a snapshot that has not been published yet
+ * @param  options Snapshot to modify
+ * @param  key     Option name
+ * @param  val     Option value
+ * @param  err     Error string
+ * @param  errsize Length of the error
+ * @return         0 on success, -1 if the option is unknown
+ */
+int rb_http_options_set(struct rb_http_options_s *options, const char *key,
+                        const char *val, char *err, size_t errsize);
+
+/**
+ * Gets a reference to the current options of the handler. The snapshot will
+ * not change or be freed until it is released.
+ * @param  rb_http_handler Handler
+ * @return                 Current options
+ */
+struct rb_http_options_s *
+rb_http_options_acquire(struct rb_http_handler_s *rb_http_handler);
+
+/**
+ * Releases a reference got with rb_http_options_acquire()
+ * @param rb_http_handler Handler
+ * @param options         Snapshot to release
+ */
+void rb_http_options_release(struct rb_http_handler_s *rb_http_handler,
+                             struct rb_http_options_s *options);
+
+/**
+ * Releases a reference to a snapshot. Must be called with the handler
+ * options_lock held.
+ * @param options Snapshot to release
+ */
+void rb_http_options_release_locked(struct rb_http_options_s *options);
+
+/**
+ * Replaces the current options of the handler. Threads keep using the
+ * previous snapshot until they call rb_http_options_refresh(). Must be
+ * called with the handler options_lock held.
+ * @param rb_http_handler Handler
+ * @param options         New snapshot. The caller reference is transferred to
+ * the handler.
+ */
+void rb_http_options_publish(struct rb_http_handler_s *rb_http_handler,
+                             struct rb_http_options_s *options);
+
+/**
+ * Replaces the snapshot used by a thread with the current one, if it has
+ * changed. Threads call this between POSTs.
+ * @param  rb_http_handler Handler
+ * @param  options         Snapshot used by the thread
+ * @return                 1 if the snapshot has been replaced
+ */
+int rb_http_options_refresh(struct rb_http_handler_s *rb_http_handler,
+                            struct rb_http_options_s **options);
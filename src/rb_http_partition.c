@@ -0,0 +1,36 @@
+/**
+ * @file rb_http_partition.c
+ * @brief Maps partitioning keys to CHUNKED_MODE threads.
+ *
+ * Keys are hashed over the configured connections, never over the adaptive
+ * requests limit, so a key only moves to another thread when connections
+ * are reconfigured, and then only 1/N of the keys do.
+ */
+#include "../config.h"
+#include "rb_http_partition.h"
+
+uint64_t rb_http_partition_hash(const char *key, size_t keylen) {
+  uint64_t hash = 14695981039346656037ULL;
+  size_t i = 0;
+
+  for (i = 0; i < keylen; i++) {
+    hash ^= (uint8_t)key[i];
+    hash *= 1099511628211ULL;
+  }
+
+  return hash;
+}
+
+int rb_http_partition_worker(uint64_t hash, int workers) {
+  int64_t worker = -1;
+  int64_t next = 0;
+
+  while (next < workers) {
+    worker = next;
+    hash = hash * 2862933555777941757ULL + 1;
+    next = (int64_t)((double)(worker + 1) *
+                     ((double)(1LL << 31) / (double)((hash >> 33) + 1)));
+  }
+
+  return (int)worker;
+}
@@ -0,0 +1,19 @@
+#include "rb_http_handler.h"
+
+/**
+ * Hashes a partitioning key (FNV-1a)
+ * @param  key    Key
+ * @param  keylen Length of the key
+ * @return        Key hash
+ */
+uint64_t rb_http_partition_hash(const char *key, size_t keylen);
+
+/**
+ * Maps a key hash to a worker with jump consistent hashing. When the number
+ * of workers grows or shrinks by one only the keys of one worker move, and
+ * workers are always the first ones of the handler.
+ * @param  hash    Key hash
+ * @param  workers Number of workers
+ * @return         Worker index
+ */
+int rb_http_partition_worker(uint64_t hash, int workers);
@@ -0,0 +1,73 @@
+/**
+ * @file rb_http_payload.c
+ * @brief Payload sources of a message.
+ *
+ * A payload is a buffer in memory, a mapped region, a range of a file or a
+ * callback that reads it. Mapped regions are sent in place like buffers.
+ * Files and callbacks are read by the connection threads a few KB at a time
+ * as the body is written, so big payloads are never held in memory. They
+ * are read by offset, so a message can be sent again from the start.
+ */
+#include "../config.h"
+#include "rb_http_payload.h"
+#include "rb_http_pool.h"
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+ssize_t rb_http_payload_read(struct rb_http_message_s *message, char *buf,
+                             size_t size, size_t offset) {
+  ssize_t ret = 0;
+
+  if (offset >= message->len) {
+    return 0;
+  }
+  if (size > message->len - offset) {
+    size = message->len - offset;
+  }
+
+  if (message->source == RB_HTTP_SOURCE_FD) {
+    do {
+      ret = pread(message->fd, buf, size,
+                  message->offset + (off_t)offset);
+    } while (ret < 0 && errno == EINTR);
+  } else if (message->source == RB_HTTP_SOURCE_PULL) {
+    ret = message->read_fn(buf, size, offset, message->client_opaque);
+  } else {
+    memcpy(buf, message->payload + offset, size);
+    ret = (ssize_t)size;
+  }
+
+  // A source shorter than the message would send a truncated body
+  if (ret <= 0 || (size_t)ret > size) {
+    return -1;
+  }
+
+  return ret;
+}
+
+void rb_http_message_free(struct rb_http_handler_s *rb_http_handler,
+                          struct rb_http_message_s *message) {
+  const struct rb_http_payload_free_s *payload_free =
+      rb_http_handler->payload_free;
+
+  if (message->free_message) {
+    if (message->source == RB_HTTP_SOURCE_MMAP) {
+      munmap(message->payload, message->len);
+    } else if (message->source == RB_HTTP_SOURCE_FD) {
+      close(message->fd);
+    } else if (message->payload == NULL) {
+      // Nothing to release
+    } else if (message->pooled) {
+      rb_http_pool_put(&rb_http_handler->pool, message->payload);
+    } else if (payload_free != NULL) {
+      payload_free->fn(rb_http_handler, message->payload, message->len,
+                       message->marked, message->client_opaque,
+                       payload_free->opaque);
+    } else {
+      free(message->payload);
+    }
+  }
+  rb_http_pool_put(&rb_http_handler->pool, message);
+}
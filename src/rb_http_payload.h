@@ -0,0 +1,21 @@
+#include "rb_http_handler.h"
+
+/**
+ * Reads the payload of a message that is not in memory
+ * @param  message Message to read
+ * @param  buf     Buffer to fill
+ * @param  size    Size of the buffer
+ * @param  offset  Offset in the payload to read from
+ * @return         Bytes read, 0 at the end of the payload, or -1 if the
+ * source fails or ends before the length of the message
+ */
+ssize_t rb_http_payload_read(struct rb_http_message_s *message, char *buf,
+                             size_t size, size_t offset);
+
+/**
+ * Frees a message, and releases its payload if the library owns it
+ * @param rb_http_handler Handler the message was produced to
+ * @param message         Message to free
+ */
+void rb_http_message_free(struct rb_http_handler_s *rb_http_handler,
+                          struct rb_http_message_s *message);
@@ -0,0 +1,126 @@
+/**
+ * @file rb_http_pool.c
+ * @brief Recycled buffers for messages and payloads.
+ *
+ * Buffers are grouped in power of two size classes from
+ * 1 << RB_HTTP_POOL_MIN_SHIFT bytes. A returned buffer is kept in the free
+ * list of its class, so in steady state producing and reporting messages
+ * doesn't allocate memory. Each buffer has a header with its class right
+ * before the memory given to the caller.
+ */
+#include "../config.h"
+#include "rb_http_pool.h"
+
+// @brief Header of a pool buffer.
+struct rb_http_pool_buf_s {
+  struct rb_http_pool_buf_s *next; // Next free buffer of the class
+  size_t cls;                      // Size class, RB_HTTP_POOL_CLASSES if big
+};
+
+/**
+ * Computes the size class of a buffer
+ * @param  size Bytes needed
+ * @return      Size class, RB_HTTP_POOL_CLASSES if it is too big to be pooled
+ */
+static size_t pool_size_class(size_t size) {
+  size_t cls = 0;
+
+  while (cls < RB_HTTP_POOL_CLASSES &&
+         ((size_t)1 << (RB_HTTP_POOL_MIN_SHIFT + cls)) < size) {
+    cls++;
+  }
+
+  return cls;
+}
+
+void rb_http_pool_init(struct rb_http_pool_s *pool) {
+  size_t i = 0;
+
+  for (i = 0; i < RB_HTTP_POOL_CLASSES; i++) {
+    pthread_mutex_init(&pool->classes[i].lock, NULL);
+    pool->classes[i].free = NULL;
+    pool->classes[i].cnt = 0;
+  }
+}
+
+void rb_http_pool_destroy(struct rb_http_pool_s *pool) {
+  size_t i = 0;
+
+  for (i = 0; i < RB_HTTP_POOL_CLASSES; i++) {
+    struct rb_http_pool_buf_s *buf = pool->classes[i].free;
+
+    while (buf != NULL) {
+      struct rb_http_pool_buf_s *next = buf->next;
+      free(buf);
+      buf = next;
+    }
+    pthread_mutex_destroy(&pool->classes[i].lock);
+  }
+}
+
+void *rb_http_pool_get(struct rb_http_pool_s *pool, size_t size) {
+  const size_t cls = pool_size_class(size);
+  struct rb_http_pool_buf_s *buf = NULL;
+
+  if (cls < RB_HTTP_POOL_CLASSES) {
+    struct rb_http_pool_class_s *pool_class = &pool->classes[cls];
+
+    pthread_mutex_lock(&pool_class->lock);
+    buf = pool_class->free;
+    if (buf != NULL) {
+      pool_class->free = buf->next;
+      pool_class->cnt--;
+    }
+    pthread_mutex_unlock(&pool_class->lock);
+
+    if (buf == NULL) {
+      ATOMIC_OP64(add, fetch, &pool->misses, 1);
+      buf = malloc(sizeof(*buf) +
+                   ((size_t)1 << (RB_HTTP_POOL_MIN_SHIFT + cls)));
+    }
+  } else {
+    ATOMIC_OP64(add, fetch, &pool->misses, 1);
+    buf = malloc(sizeof(*buf) + size);
+  }
+
+  if (buf == NULL) {
+    return NULL;
+  }
+
+  buf->next = NULL;
+  buf->cls = cls;
+
+  return &buf[1];
+}
+
+void rb_http_pool_put(struct rb_http_pool_s *pool, void *ptr) {
+  struct rb_http_pool_buf_s *buf = (struct rb_http_pool_buf_s *)ptr - 1;
+
+  if (buf->cls < RB_HTTP_POOL_CLASSES) {
+    struct rb_http_pool_class_s *pool_class = &pool->classes[buf->cls];
+
+    pthread_mutex_lock(&pool_class->lock);
+    if (((size_t)pool_class->cnt << (RB_HTTP_POOL_MIN_SHIFT + buf->cls)) <
+        RB_HTTP_POOL_CACHED_BYTES) {
+      buf->next = pool_class->free;
+      pool_class->free = buf;
+      pool_class->cnt++;
+      buf = NULL;
+    }
+    pthread_mutex_unlock(&pool_class->lock);
+  }
+
+  free(buf);
+}
+
+char *rb_http_buffer_alloc(struct rb_http_handler_s *rb_http_handler,
+                           size_t len) {
+  return rb_http_pool_get(&rb_http_handler->pool, len);
+}
+
+void rb_http_buffer_free(struct rb_http_handler_s *rb_http_handler,
+                         char *buff) {
+  if (buff != NULL) {
+    rb_http_pool_put(&rb_http_handler->pool, buff);
+  }
+}
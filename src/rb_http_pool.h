@@ -0,0 +1,30 @@
+#include "rb_http_handler.h"
+
+/**
+ * Initializes the buffer pool of a handler
+ * @param pool Pool to initialize
+ */
+void rb_http_pool_init(struct rb_http_pool_s *pool);
+
+/**
+ * Frees the buffers cached by a pool
+ * @param pool Pool to destroy
+ */
+void rb_http_pool_destroy(struct rb_http_pool_s *pool);
+
+/**
+ * Gets a buffer from the pool, allocating it if no buffer of its size class
+ * is free
+ * @param  pool Pool
+ * @param  size Bytes needed
+ * @return      Buffer, or NULL if it can't be allocated
+ */
+void *rb_http_pool_get(struct rb_http_pool_s *pool, size_t size);
+
+/**
+ * Returns a buffer to the pool. Buffers too big to be pooled, and buffers
+ * over RB_HTTP_POOL_CACHED_BYTES in their class, are freed.
+ * @param pool Pool
+ * @param ptr  Buffer got with rb_http_pool_get()
+ */
+void rb_http_pool_put(struct rb_http_pool_s *pool, void *ptr);
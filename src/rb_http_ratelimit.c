@@ -0,0 +1,89 @@
+/**
+ * @file rb_http_ratelimit.c
+ * @brief Egress rate limits of a handler.
+ *
+ * Token buckets limit the bytes put on the wire (compressed ones in
+ * CHUNKED_MODE) and the requests started per second. They are shared by all
+ * the connection threads, and the rate is read from the options of the
+ * caller each time, so a new limit applies on the next chunk or request.
+ * CHUNKED_MODE threads sleep in the read callback, or before starting a
+ * POST; the NORMAL_MODE thread keeps driving the transfers in flight and
+ * doesn't start new ones until the buckets are out of debt.
+ */
+#include "../config.h"
+#include "rb_http_adaptive.h"
+#include "rb_http_ratelimit.h"
+
+#include <unistd.h>
+
+// Max time a thread sleeps before checking if the handler is destroyed
+#define RATELIMIT_MAX_SLEEP 100L
+
+void rb_http_ratelimit_init(struct rb_http_ratelimit_s *bucket) {
+  pthread_mutex_init(&bucket->lock, NULL);
+  bucket->tokens = 0;
+  bucket->last = 0;
+  bucket->throttled = 0;
+  bucket->throttled_ms = 0;
+}
+
+void rb_http_ratelimit_destroy(struct rb_http_ratelimit_s *bucket) {
+  pthread_mutex_destroy(&bucket->lock);
+}
+
+long rb_http_ratelimit_take(struct rb_http_ratelimit_s *bucket, long rate,
+                            long burst, long tokens, long now) {
+  long wait_ms = 0;
+
+  if (rate <= 0) {
+    return 0;
+  }
+  if (burst <= 0) {
+    burst = rate;
+  }
+
+  pthread_mutex_lock(&bucket->lock);
+  if (bucket->last == 0) {
+    bucket->tokens = (double)burst;
+  } else if (now > bucket->last) {
+    bucket->tokens += (double)rate * (double)(now - bucket->last) / 1000.0;
+  }
+  if (bucket->tokens > (double)burst) {
+    bucket->tokens = (double)burst;
+  }
+  if (now > bucket->last) {
+    bucket->last = now;
+  }
+
+  bucket->tokens -= (double)tokens;
+  if (bucket->tokens < 0) {
+    // Rounded up, so the bucket is out of debt when the wait ends
+    wait_ms = (long)(-bucket->tokens * 1000.0 / (double)rate) + 1;
+  }
+  pthread_mutex_unlock(&bucket->lock);
+
+  return wait_ms;
+}
+
+void rb_http_ratelimit_wait(struct rb_http_handler_s *rb_http_handler,
+                            struct rb_http_ratelimit_s *bucket, long rate,
+                            long burst) {
+  long wait_ms = rb_http_ratelimit_take(bucket, rate, burst, 0,
+                                        rb_http_now_ms());
+
+  if (wait_ms == 0) {
+    return;
+  }
+
+  ATOMIC_OP64(add, fetch, &bucket->throttled, 1);
+  while (wait_ms > 0 &&
+         ATOMIC_OP(add, fetch, &rb_http_handler->thread_running, 0) != 0) {
+    if (wait_ms > RATELIMIT_MAX_SLEEP) {
+      wait_ms = RATELIMIT_MAX_SLEEP;
+    }
+    usleep((useconds_t)(1000 * wait_ms));
+    ATOMIC_OP64(add, fetch, &bucket->throttled_ms, (uint64_t)wait_ms);
+
+    wait_ms = rb_http_ratelimit_take(bucket, rate, burst, 0, rb_http_now_ms());
+  }
+}
@@ -0,0 +1,39 @@
+#include "rb_http_handler.h"
+
+/**
+ * Initializes a token bucket. It starts full.
+ * @param bucket Bucket
+ */
+void rb_http_ratelimit_init(struct rb_http_ratelimit_s *bucket);
+
+/**
+ * Destroys a token bucket
+ * @param bucket Bucket
+ */
+void rb_http_ratelimit_destroy(struct rb_http_ratelimit_s *bucket);
+
+/**
+ * Takes tokens from a bucket. The bucket can go into debt, so a chunk or a
+ * request is never split; the next caller waits until it is paid.
+ * @param  bucket Bucket
+ * @param  rate   Tokens added per second, 0 for no limit
+ * @param  burst  Max tokens kept while idle, 0 for one second of rate
+ * @param  tokens Tokens to take, 0 to only ask for the wait
+ * @param  now    Current time (ms)
+ * @return        Time (ms) until the bucket is out of debt, 0 if it is not
+ */
+long rb_http_ratelimit_take(struct rb_http_ratelimit_s *bucket, long rate,
+                            long burst, long tokens, long now);
+
+/**
+ * Sleeps a connection thread until a bucket is out of debt, counting the
+ * time in the stats of the bucket. It returns early if the handler is being
+ * destroyed.
+ * @param rb_http_handler Handler
+ * @param bucket          Bucket
+ * @param rate            Tokens added per second, 0 for no limit
+ * @param burst           Max tokens kept while idle, 0 for one second of rate
+ */
+void rb_http_ratelimit_wait(struct rb_http_handler_s *rb_http_handler,
+                            struct rb_http_ratelimit_s *bucket, long rate,
+                            long burst);
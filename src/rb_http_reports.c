@@ -0,0 +1,269 @@
+/**
+ * @file rb_http_reports.c
+ * @brief Queues of reports waiting for rb_http_get_reports().
+ *
+ * Reports are queued on RB_HTTP_REPORT_SHARDS queues. Every connection
+ * thread uses the shard of its id, so threads don't contend on one lock.
+ * rb_http_get_reports() takes one report of every shard in turn, and
+ * rb_http_get_reports_consumer() lets several application threads take the
+ * reports of different shards at the same time. Consumers wait on a handler
+ * condition that is only signaled if some consumer is waiting.
+ *
+ * Applications with an event loop can ask for an eventfd with
+ * rb_http_get_report_fd(). Every queued report increments it, and
+ * rb_http_get_reports() resets it before taking the reports, so a report
+ * queued while they are being taken leaves the fd readable.
+ *
+ * With inline reports the queues are skipped: the report callback is called
+ * on the thread that completed the transfer.
+ */
+#include "../config.h"
+#include "rb_http_chunked.h"
+#include "rb_http_normal.h"
+#include "rb_http_reports.h"
+
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+// Shard of the reports queued by the calling thread
+static __thread int reports_shard = 0;
+
+void rb_http_reports_init(struct rb_http_handler_s *rb_http_handler) {
+  int i = 0;
+
+  for (i = 0; i < RB_HTTP_REPORT_SHARDS; i++) {
+    rd_fifoq_init(&rb_http_handler->rfq_reports[i]);
+  }
+  pthread_mutex_init(&rb_http_handler->reports_lock, NULL);
+  pthread_cond_init(&rb_http_handler->reports_cond, NULL);
+  rb_http_handler->report_fd = -1;
+}
+
+void rb_http_reports_set_shard(int id) {
+  reports_shard = id % RB_HTTP_REPORT_SHARDS;
+}
+
+// Wakes up consumers and flushes waiting for reports, if any
+static void reports_signal(struct rb_http_handler_s *rb_http_handler) {
+  // A waiting consumer has already looked at the queue, or is about to do
+  // it holding the lock
+  if (ATOMIC_OP(add, fetch, &rb_http_handler->reports_waiting, 0) > 0) {
+    pthread_mutex_lock(&rb_http_handler->reports_lock);
+    pthread_cond_broadcast(&rb_http_handler->reports_cond);
+    pthread_mutex_unlock(&rb_http_handler->reports_lock);
+  }
+}
+
+void rb_http_reports_add(struct rb_http_handler_s *rb_http_handler,
+                         struct rb_http_report_s *report) {
+  const int fd = ATOMIC_OP(add, fetch, &rb_http_handler->report_fd, 0);
+
+  if (rb_http_handler->inline_report_fn != NULL) {
+    if (rb_http_handler->mode == CHUNKED_MODE) {
+      rb_http_report_chunked(rb_http_handler, report,
+                             rb_http_handler->inline_report_fn);
+    } else {
+      rb_http_report_normal(rb_http_handler, report,
+                            rb_http_handler->inline_report_fn);
+    }
+    reports_signal(rb_http_handler);
+    return;
+  }
+
+  rd_fifoq_add(&rb_http_handler->rfq_reports[reports_shard], report);
+  reports_signal(rb_http_handler);
+
+  if (fd >= 0) {
+    eventfd_write(fd, 1);
+  }
+}
+
+/**
+ * Delivers one report of every shard of a consumer
+ * @return Reports delivered
+ */
+static int reports_pass(struct rb_http_handler_s *rb_http_handler,
+                        cb_report report_fn, int consumer, int nconsumers) {
+  rd_fifoq_elm_t *rfqe = NULL;
+  rd_fifoq_t *rfq = NULL;
+  int cnt = 0;
+  int i = 0;
+
+  for (i = consumer; i < RB_HTTP_REPORT_SHARDS; i += nconsumers) {
+    rfq = &rb_http_handler->rfq_reports[i];
+    if ((rfqe = rd_fifoq_pop(rfq)) == NULL) {
+      continue;
+    }
+
+    if (rfqe->rfqe_ptr != NULL) {
+      if (rb_http_handler->mode == CHUNKED_MODE) {
+        rb_http_report_chunked(rb_http_handler, rfqe->rfqe_ptr, report_fn);
+      } else {
+        rb_http_report_normal(rb_http_handler, rfqe->rfqe_ptr, report_fn);
+      }
+    }
+    rd_fifoq_elm_release(rfq, rfqe);
+    cnt++;
+  }
+
+  // A flush may be waiting for the last report, taken by another consumer
+  if (cnt > 0 && ATOMIC_OP(add, fetch, &rb_http_handler->left, 0) == 0) {
+    reports_signal(rb_http_handler);
+  }
+
+  return cnt;
+}
+
+// Report callback of the reports nobody took before the handler destroy
+static void reports_discard(struct rb_http_handler_s *rb_http_handler,
+                            int status_code, long http_code,
+                            const char *status_code_str, char *buff,
+                            size_t bufsiz, void *opaque) {
+  (void)rb_http_handler;
+  (void)status_code;
+  (void)http_code;
+  (void)status_code_str;
+  (void)buff;
+  (void)bufsiz;
+  (void)opaque;
+}
+
+void rb_http_reports_destroy(struct rb_http_handler_s *rb_http_handler) {
+  int i = 0;
+
+  // Their messages and payloads are released
+  while (reports_pass(rb_http_handler, reports_discard, 0, 1) > 0) {
+  }
+
+  for (i = 0; i < RB_HTTP_REPORT_SHARDS; i++) {
+    rd_fifoq_destroy(&rb_http_handler->rfq_reports[i]);
+  }
+  pthread_mutex_destroy(&rb_http_handler->reports_lock);
+  pthread_cond_destroy(&rb_http_handler->reports_cond);
+  if (rb_http_handler->report_fd >= 0) {
+    close(rb_http_handler->report_fd);
+  }
+}
+
+// Absolute time for pthread_cond_timedwait(), timeout_ms from now
+static void reports_deadline(struct timespec *deadline, int timeout_ms) {
+  clock_gettime(CLOCK_REALTIME, deadline);
+  deadline->tv_sec += timeout_ms / 1000;
+  deadline->tv_nsec += (timeout_ms % 1000) * 1000000L;
+  if (deadline->tv_nsec >= 1000000000L) {
+    deadline->tv_sec++;
+    deadline->tv_nsec -= 1000000000L;
+  }
+}
+
+/**
+ * Waits until a report is queued on any shard of a consumer
+ * @return 0 if the timeout expired
+ */
+static int reports_wait(struct rb_http_handler_s *rb_http_handler,
+                        int consumer, int nconsumers, int timeout_ms) {
+  struct timespec deadline;
+  int ready = 0;
+  int i = 0;
+
+  reports_deadline(&deadline, timeout_ms);
+
+  pthread_mutex_lock(&rb_http_handler->reports_lock);
+  ATOMIC_OP(add, fetch, &rb_http_handler->reports_waiting, 1);
+
+  while (!ready) {
+    for (i = consumer; i < RB_HTTP_REPORT_SHARDS && !ready; i += nconsumers) {
+      ready = ATOMIC_OP(add, fetch, &rb_http_handler->rfq_reports[i].rfq_cnt,
+                        0) > 0;
+    }
+
+    if (!ready && pthread_cond_timedwait(&rb_http_handler->reports_cond,
+                                         &rb_http_handler->reports_lock,
+                                         &deadline) == ETIMEDOUT) {
+      break;
+    }
+  }
+
+  ATOMIC_OP(sub, fetch, &rb_http_handler->reports_waiting, 1);
+  pthread_mutex_unlock(&rb_http_handler->reports_lock);
+
+  return ready;
+}
+
+int rb_http_reports_get(struct rb_http_handler_s *rb_http_handler,
+                        cb_report report_fn, int timeout_ms, int consumer,
+                        int nconsumers) {
+  while (1) {
+    if (reports_pass(rb_http_handler, report_fn, consumer, nconsumers) > 0) {
+      continue;
+    }
+
+    // As rd_fifoq_pop_timedwait(): keep taking reports until none arrives
+    // in timeout_ms
+    if (timeout_ms == 0 ||
+        !reports_wait(rb_http_handler, consumer, nconsumers, timeout_ms)) {
+      break;
+    }
+  }
+
+  return ATOMIC_OP(add, fetch, &rb_http_handler->left, 0);
+}
+
+int rb_http_reports_wait_cnt(struct rb_http_handler_s *rb_http_handler,
+                             int *cnt, int any_report, int timeout_ms) {
+  struct timespec deadline;
+  int ready = 0;
+  int i = 0;
+
+  reports_deadline(&deadline, timeout_ms);
+
+  pthread_mutex_lock(&rb_http_handler->reports_lock);
+  ATOMIC_OP(add, fetch, &rb_http_handler->reports_waiting, 1);
+
+  while (!ready) {
+    ready = ATOMIC_OP(add, fetch, cnt, 0) == 0;
+    for (i = 0; any_report && i < RB_HTTP_REPORT_SHARDS && !ready; i++) {
+      ready = ATOMIC_OP(add, fetch, &rb_http_handler->rfq_reports[i].rfq_cnt,
+                        0) > 0;
+    }
+
+    if (!ready && pthread_cond_timedwait(&rb_http_handler->reports_cond,
+                                         &rb_http_handler->reports_lock,
+                                         &deadline) == ETIMEDOUT) {
+      break;
+    }
+  }
+
+  ATOMIC_OP(sub, fetch, &rb_http_handler->reports_waiting, 1);
+  pthread_mutex_unlock(&rb_http_handler->reports_lock);
+
+  return ready;
+}
+
+void rb_http_reports_clear_fd(struct rb_http_handler_s *rb_http_handler) {
+  const int fd = ATOMIC_OP(add, fetch, &rb_http_handler->report_fd, 0);
+  eventfd_t cnt = 0;
+
+  if (fd >= 0) {
+    eventfd_read(fd, &cnt);
+  }
+}
+
+int rb_http_get_report_fd(struct rb_http_handler_s *rb_http_handler) {
+  int fd = -1;
+
+  pthread_mutex_lock(&rb_http_handler->options_lock);
+  if (rb_http_handler->report_fd < 0) {
+    // Starts readable, reports may have been queued before the fd existed
+    fd = eventfd(1, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd >= 0) {
+      // report_fd is -1 here. Only add/sub atomics are portable.
+      ATOMIC_OP(add, fetch, &rb_http_handler->report_fd, fd + 1);
+    }
+  }
+  fd = rb_http_handler->report_fd;
+  pthread_mutex_unlock(&rb_http_handler->options_lock);
+
+  return fd;
+}
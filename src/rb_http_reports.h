@@ -0,0 +1,61 @@
+#include "rb_http_handler.h"
+
+/**
+ * Initializes the report queues of a handler
+ * @param rb_http_handler Handler
+ */
+void rb_http_reports_init(struct rb_http_handler_s *rb_http_handler);
+
+/**
+ * Destroys the report queues of a handler and closes the report fd
+ * @param rb_http_handler Handler
+ */
+void rb_http_reports_destroy(struct rb_http_handler_s *rb_http_handler);
+
+/**
+ * Selects the report queue used by the calling thread
+ * @param id Id of the connection thread
+ */
+void rb_http_reports_set_shard(int id);
+
+/**
+ * Queues a report for rb_http_get_reports() and signals the report fd if the
+ * application is using it
+ * @param rb_http_handler Handler
+ * @param report          Report to queue
+ */
+void rb_http_reports_add(struct rb_http_handler_s *rb_http_handler,
+                         struct rb_http_report_s *report);
+
+/**
+ * Waits until a counter of the handler reaches 0, or a report is queued on
+ * any shard. Every queued or delivered report wakes it up to check again.
+ * @param  rb_http_handler Handler
+ * @param  cnt             Counter decremented before queuing reports
+ * @param  any_report      Return as well when a report is queued
+ * @param  timeout_ms      Max time to wait
+ * @return                 0 if the timeout expired
+ */
+int rb_http_reports_wait_cnt(struct rb_http_handler_s *rb_http_handler,
+                             int *cnt, int any_report, int timeout_ms);
+
+/**
+ * Resets the report fd before the queued reports are taken, so it is only
+ * readable again if new reports arrive
+ * @param rb_http_handler Handler
+ */
+void rb_http_reports_clear_fd(struct rb_http_handler_s *rb_http_handler);
+
+/**
+ * Delivers queued reports, one of every queue in turn, until no report
+ * arrives in timeout_ms
+ * @param  rb_http_handler Handler
+ * @param  report_fn       Callback for each message
+ * @param  timeout_ms      Max time to wait for a report, 0 to not wait
+ * @param  consumer        Takes the queues consumer, consumer + nconsumers...
+ * @param  nconsumers      Threads taking reports
+ * @return                 Messages waiting for a report
+ */
+int rb_http_reports_get(struct rb_http_handler_s *rb_http_handler,
+                        cb_report report_fn, int timeout_ms, int consumer,
+                        int nconsumers);
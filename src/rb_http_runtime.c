@@ -0,0 +1,448 @@
+/**
+ * @file rb_http_runtime.c
+ * @brief Event loops shared by many handlers.
+ *
+ * A runtime has a fixed number of workers. Each one is an epoll loop that
+ * drives the multi handles of the NORMAL_MODE handlers attached to it,
+ * through the curl socket interface, so hundreds of handlers share a few
+ * threads instead of having one each. Every turn, each handler of the worker
+ * starts up to RB_HTTP_RUNTIME_QUANTUM requests, beginning with a different
+ * handler each turn, and then the worker waits for socket events or curl
+ * timeouts.
+ *
+ * Curl calls on the multi handle of a handler are only made by its worker,
+ * with the worker lock held: attaching a handler only adds it to the list,
+ * and the worker itself lets it go between turns when detaching.
+ */
+#include "../config.h"
+#include "rb_http_adaptive.h"
+#include "rb_http_normal.h"
+#include "rb_http_options.h"
+#include "rb_http_reports.h"
+#include "rb_http_runtime.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+// Events taken from epoll at once
+#define RUNTIME_EVENTS 64
+
+static pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
+static int global_users = 0;
+
+void rb_http_global_acquire(void) {
+  pthread_mutex_lock(&global_lock);
+  if (global_users++ == 0) {
+    curl_global_init(CURL_GLOBAL_ALL);
+  }
+  pthread_mutex_unlock(&global_lock);
+}
+
+void rb_http_global_release(void) {
+  pthread_mutex_lock(&global_lock);
+  if (--global_users == 0) {
+    curl_global_cleanup();
+  }
+  pthread_mutex_unlock(&global_lock);
+}
+
+/**
+ * Wakes up a worker even if it is not waiting yet
+ * @param worker Worker
+ */
+static void runtime_kick(struct rb_http_worker_s *worker) {
+  const uint64_t one = 1;
+
+  if (write(worker->wake_fd, &one, sizeof(one)) < 0) {
+    // Already readable: the counter is only drained by the worker
+  }
+}
+
+void rb_http_runtime_wake(struct rb_http_worker_s *worker) {
+  if (ATOMIC_OP(exchange, n, &worker->sleeping, 0)) {
+    runtime_kick(worker);
+  }
+}
+
+/**
+ * Watches, updates or forgets a socket of a handler. Called by curl from the
+ * worker thread.
+ */
+static int runtime_socket_cb(CURL *easy, curl_socket_t fd, int what,
+                             void *userp, void *socketp) {
+  struct rb_http_threaddata_s *rb_http_threaddata =
+      (struct rb_http_threaddata_s *)userp;
+  struct rb_http_worker_s *worker = rb_http_threaddata->worker;
+  struct rb_http_runtime_socket_s *sock =
+      (struct rb_http_runtime_socket_s *)socketp;
+  struct epoll_event ev;
+
+  (void)easy;
+
+  if (what == CURL_POLL_REMOVE) {
+    if (sock != NULL) {
+      // Events already taken from epoll may point to it until the turn ends
+      epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+      TAILQ_REMOVE(&rb_http_threaddata->sockets, sock, tailq);
+      sock->rb_http_threaddata = NULL;
+      TAILQ_INSERT_TAIL(&worker->closed, sock, tailq);
+    }
+    return 0;
+  }
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = ((what & CURL_POLL_IN) ? (uint32_t)EPOLLIN : 0) |
+              ((what & CURL_POLL_OUT) ? (uint32_t)EPOLLOUT : 0);
+
+  if (sock == NULL) {
+    sock = calloc(1, sizeof(struct rb_http_runtime_socket_s));
+    sock->fd = fd;
+    sock->rb_http_threaddata = rb_http_threaddata;
+    TAILQ_INSERT_TAIL(&rb_http_threaddata->sockets, sock, tailq);
+    curl_multi_assign(rb_http_threaddata->rb_http_handler->multi_handle, fd,
+                      sock);
+    ev.data.ptr = sock;
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+  } else {
+    ev.data.ptr = sock;
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+  }
+
+  return 0;
+}
+
+/**
+ * Lets curl handle an event of a handler, and queues the reports of the
+ * transfers that finished
+ * @param rb_http_threaddata Thread data of the handler
+ * @param fd                 Socket, or CURL_SOCKET_TIMEOUT
+ * @param ev_bitmask         CURL_CSELECT_* events of the socket
+ */
+static void runtime_action(struct rb_http_threaddata_s *rb_http_threaddata,
+                           curl_socket_t fd, int ev_bitmask) {
+  struct rb_http_handler_s *rb_http_handler =
+      rb_http_threaddata->rb_http_handler;
+
+  if (curl_multi_socket_action(rb_http_handler->multi_handle, fd, ev_bitmask,
+                               &rb_http_handler->still_running) != CURLM_OK) {
+    struct rb_http_report_s *report =
+        calloc(1, sizeof(struct rb_http_report_s));
+    report->err_code = -1;
+    report->http_code = 0;
+    report->handler = NULL;
+    rb_http_reports_add(rb_http_handler, report);
+  }
+
+  rb_http_normal_done(rb_http_handler);
+}
+
+/**
+ * Lets go the handlers being detached. Must be called with the worker lock
+ * held.
+ * @param worker Worker
+ */
+static void runtime_detach_pending(struct rb_http_worker_s *worker) {
+  struct rb_http_runtime_socket_s *sock = NULL;
+  int i = 0;
+
+  while (i < worker->nhandlers) {
+    struct rb_http_threaddata_s *rb_http_threaddata = worker->handlers[i];
+
+    if (!rb_http_threaddata->detaching) {
+      i++;
+      continue;
+    }
+
+    rb_http_normal_abort(rb_http_threaddata);
+    curl_multi_cleanup(rb_http_threaddata->rb_http_handler->multi_handle);
+    rb_http_threaddata->rb_http_handler->multi_handle = NULL;
+    while ((sock = TAILQ_FIRST(&rb_http_threaddata->sockets)) != NULL) {
+      TAILQ_REMOVE(&rb_http_threaddata->sockets, sock, tailq);
+      sock->rb_http_threaddata = NULL;
+      TAILQ_INSERT_TAIL(&worker->closed, sock, tailq);
+    }
+
+    worker->handlers[i] = worker->handlers[--worker->nhandlers];
+    rb_http_threaddata->worker = NULL;
+    pthread_cond_broadcast(&worker->cond);
+  }
+}
+
+/**
+ * Serves every handler of a worker once, and runs the curl timeouts due.
+ * Must be called with the worker lock held.
+ * @param  worker Worker
+ * @return        Max time (ms) to wait for events
+ */
+static long runtime_turn(struct rb_http_worker_s *worker) {
+  const int nhandlers = worker->nhandlers;
+  long wait_ms = RB_HTTP_RUNTIME_MAX_WAIT;
+  long timeout_ms = -1;
+  int i = 0;
+
+  for (i = 0; i < nhandlers; i++) {
+    struct rb_http_threaddata_s *rb_http_threaddata =
+        worker->handlers[(worker->next + i) % nhandlers];
+
+    // Used its whole turn, so there may be more messages waiting
+    if (rb_http_normal_dispatch(rb_http_threaddata,
+                                RB_HTTP_RUNTIME_QUANTUM) ==
+        RB_HTTP_RUNTIME_QUANTUM) {
+      wait_ms = 0;
+    }
+  }
+  if (nhandlers > 0) {
+    worker->next = (worker->next + 1) % nhandlers;
+  }
+
+  // Asked every turn rather than tracked with CURLMOPT_TIMERFUNCTION, which
+  // is not called again for a timeout equal to the last one. Transfers just
+  // added are only started by a timeout action, and may finish in it too.
+  for (i = 0; i < nhandlers; i++) {
+    struct rb_http_threaddata_s *rb_http_threaddata = worker->handlers[i];
+    struct rb_http_handler_s *rb_http_handler =
+        rb_http_threaddata->rb_http_handler;
+    const int running = rb_http_handler->still_running;
+
+    curl_multi_timeout(rb_http_handler->multi_handle, &timeout_ms);
+    if (timeout_ms == 0 || running > 0) {
+      runtime_action(rb_http_threaddata, CURL_SOCKET_TIMEOUT, 0);
+      curl_multi_timeout(rb_http_handler->multi_handle, &timeout_ms);
+    }
+    // Free connections can take the next messages now
+    if (rb_http_handler->still_running < running) {
+      wait_ms = 0;
+    }
+    if (timeout_ms >= 0 && timeout_ms < wait_ms) {
+      wait_ms = timeout_ms;
+    }
+  }
+
+  return wait_ms > 0 ? wait_ms : 0;
+}
+
+/**
+ * Frees the sockets closed during a turn. Must be called with the worker
+ * lock held.
+ * @param worker Worker
+ */
+static void runtime_free_closed(struct rb_http_worker_s *worker) {
+  struct rb_http_runtime_socket_s *sock = NULL;
+
+  while ((sock = TAILQ_FIRST(&worker->closed)) != NULL) {
+    TAILQ_REMOVE(&worker->closed, sock, tailq);
+    free(sock);
+  }
+}
+
+static void *runtime_worker(void *arg) {
+  struct rb_http_worker_s *worker = (struct rb_http_worker_s *)arg;
+  struct epoll_event events[RUNTIME_EVENTS];
+  uint64_t wakes = 0;
+  long wait_ms = 0;
+  int n = 0;
+  int i = 0;
+
+  pthread_mutex_lock(&worker->lock);
+  while (worker->running) {
+    // Messages produced from now on wake the loop up
+    ATOMIC_OP(store, n, &worker->sleeping, 1);
+
+    runtime_detach_pending(worker);
+    wait_ms = runtime_turn(worker);
+    runtime_free_closed(worker);
+    pthread_mutex_unlock(&worker->lock);
+
+    n = epoll_wait(worker->epoll_fd, events, RUNTIME_EVENTS, (int)wait_ms);
+
+    pthread_mutex_lock(&worker->lock);
+    for (i = 0; i < n; i++) {
+      struct rb_http_runtime_socket_s *sock =
+          (struct rb_http_runtime_socket_s *)events[i].data.ptr;
+      int ev_bitmask = 0;
+
+      if (sock == NULL) {
+        if (read(worker->wake_fd, &wakes, sizeof(wakes)) < 0) {
+          // Drained by a previous event
+        }
+        continue;
+      }
+      if (sock->rb_http_threaddata == NULL) {
+        continue;
+      }
+
+      if (events[i].events & EPOLLIN) {
+        ev_bitmask |= CURL_CSELECT_IN;
+      }
+      if (events[i].events & EPOLLOUT) {
+        ev_bitmask |= CURL_CSELECT_OUT;
+      }
+      if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+        ev_bitmask |= CURL_CSELECT_ERR;
+      }
+      runtime_action(sock->rb_http_threaddata, sock->fd, ev_bitmask);
+    }
+    runtime_free_closed(worker);
+  }
+  pthread_mutex_unlock(&worker->lock);
+
+  return NULL;
+}
+
+/**
+ * Releases the resources of a worker whose thread is not running
+ * @param worker Worker
+ */
+static void runtime_worker_destroy(struct rb_http_worker_s *worker) {
+  if (worker->epoll_fd >= 0) {
+    close(worker->epoll_fd);
+  }
+  if (worker->wake_fd >= 0) {
+    close(worker->wake_fd);
+  }
+  runtime_free_closed(worker);
+  free(worker->handlers);
+  pthread_cond_destroy(&worker->cond);
+  pthread_mutex_destroy(&worker->lock);
+}
+
+struct rb_http_runtime_s *rb_http_runtime_create(int workers, char *err,
+                                                 size_t errsize) {
+  struct rb_http_runtime_s *runtime = NULL;
+  struct epoll_event ev;
+  int i = 0;
+
+  if (workers < 1 || workers > MAX_RUNTIME_WORKERS) {
+    snprintf(err, errsize, "Runtime workers must be between 1 and %d",
+             MAX_RUNTIME_WORKERS);
+    return NULL;
+  }
+
+  runtime = calloc(1, sizeof(struct rb_http_runtime_s));
+  runtime->nworkers = workers;
+  runtime->workers = calloc((size_t)workers, sizeof(struct rb_http_worker_s));
+  pthread_mutex_init(&runtime->lock, NULL);
+
+  for (i = 0; i < workers; i++) {
+    struct rb_http_worker_s *worker = &runtime->workers[i];
+
+    worker->runtime = runtime;
+    worker->running = 1;
+    pthread_mutex_init(&worker->lock, NULL);
+    pthread_cond_init(&worker->cond, NULL);
+    TAILQ_INIT(&worker->closed);
+    worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    worker->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (worker->epoll_fd < 0 || worker->wake_fd < 0 ||
+        epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->wake_fd, &ev)) {
+      snprintf(err, errsize, "Can't create the runtime event loops: %s",
+               strerror(errno));
+      for (; i >= 0; i--) {
+        runtime_worker_destroy(&runtime->workers[i]);
+      }
+      pthread_mutex_destroy(&runtime->lock);
+      free(runtime->workers);
+      free(runtime);
+      return NULL;
+    }
+  }
+
+  rb_http_global_acquire();
+
+  for (i = 0; i < workers; i++) {
+    pthread_create(&runtime->workers[i].p_thread, NULL, &runtime_worker,
+                   &runtime->workers[i]);
+  }
+
+  return runtime;
+}
+
+void rb_http_runtime_destroy(struct rb_http_runtime_s *runtime) {
+  int i = 0;
+
+  assert(runtime != NULL);
+  assert(runtime->handlers == 0);
+
+  for (i = 0; i < runtime->nworkers; i++) {
+    pthread_mutex_lock(&runtime->workers[i].lock);
+    runtime->workers[i].running = 0;
+    pthread_mutex_unlock(&runtime->workers[i].lock);
+    runtime_kick(&runtime->workers[i]);
+  }
+
+  for (i = 0; i < runtime->nworkers; i++) {
+    pthread_join(runtime->workers[i].p_thread, NULL);
+    runtime_worker_destroy(&runtime->workers[i]);
+  }
+
+  pthread_mutex_destroy(&runtime->lock);
+  free(runtime->workers);
+  free(runtime);
+
+  rb_http_global_release();
+}
+
+void rb_http_runtime_attach(struct rb_http_runtime_s *runtime,
+                            struct rb_http_threaddata_s *rb_http_threaddata) {
+  CURLM *multi_handle = rb_http_threaddata->rb_http_handler->multi_handle;
+  struct rb_http_worker_s *worker = NULL;
+  int i = 0;
+
+  TAILQ_INIT(&rb_http_threaddata->sockets);
+  curl_multi_setopt(multi_handle, CURLMOPT_SOCKETFUNCTION, runtime_socket_cb);
+  curl_multi_setopt(multi_handle, CURLMOPT_SOCKETDATA, rb_http_threaddata);
+
+  // Handlers only go to the worker with less of them
+  pthread_mutex_lock(&runtime->lock);
+  for (i = 0; i < runtime->nworkers; i++) {
+    if (worker == NULL ||
+        runtime->workers[i].nhandlers < worker->nhandlers) {
+      worker = &runtime->workers[i];
+    }
+  }
+
+  pthread_mutex_lock(&worker->lock);
+  if (worker->nhandlers == worker->handlers_size) {
+    worker->handlers_size = worker->handlers_size ? worker->handlers_size * 2
+                                                  : 16;
+    worker->handlers =
+        realloc(worker->handlers, (size_t)worker->handlers_size *
+                                      sizeof(struct rb_http_threaddata_s *));
+  }
+  worker->handlers[worker->nhandlers++] = rb_http_threaddata;
+  rb_http_threaddata->worker = worker;
+  pthread_mutex_unlock(&worker->lock);
+
+  runtime->handlers++;
+  pthread_mutex_unlock(&runtime->lock);
+
+  runtime_kick(worker);
+}
+
+void rb_http_runtime_detach(struct rb_http_threaddata_s *rb_http_threaddata) {
+  struct rb_http_worker_s *worker = rb_http_threaddata->worker;
+  struct rb_http_runtime_s *runtime = worker->runtime;
+
+  pthread_mutex_lock(&worker->lock);
+  rb_http_threaddata->detaching = 1;
+  runtime_kick(worker);
+  while (rb_http_threaddata->worker != NULL) {
+    pthread_cond_wait(&worker->cond, &worker->lock);
+  }
+  pthread_mutex_unlock(&worker->lock);
+
+  pthread_mutex_lock(&runtime->lock);
+  runtime->handlers--;
+  pthread_mutex_unlock(&runtime->lock);
+
+  // Like the thread of a handler does when it finishes
+  rb_http_options_release(rb_http_threaddata->rb_http_handler,
+                          rb_http_threaddata->options);
+}
@@ -0,0 +1,35 @@
+#include "rb_http_handler.h"
+
+/**
+ * Initializes libcurl if this is its first user. Handlers and runtimes can
+ * be created and destroyed from any thread, but libcurl global init and
+ * cleanup must not run concurrently, so they are counted here.
+ */
+void rb_http_global_acquire(void);
+
+/**
+ * Cleans libcurl up if this was its last user
+ */
+void rb_http_global_release(void);
+
+/**
+ * Makes the worker with less handlers of a runtime drive the transfers of a
+ * NORMAL_MODE handler. The multi handle of the handler must be created.
+ * @param runtime            Runtime
+ * @param rb_http_threaddata Thread data of the handler
+ */
+void rb_http_runtime_attach(struct rb_http_runtime_s *runtime,
+                            struct rb_http_threaddata_s *rb_http_threaddata);
+
+/**
+ * Takes a handler out of its worker, and cleans its multi handle up from the
+ * worker thread. Returns when the worker doesn't use the handler anymore.
+ * @param rb_http_threaddata Thread data of the handler
+ */
+void rb_http_runtime_detach(struct rb_http_threaddata_s *rb_http_threaddata);
+
+/**
+ * Wakes up a worker waiting for events, so it serves new messages now
+ * @param worker Worker
+ */
+void rb_http_runtime_wake(struct rb_http_worker_s *worker);
@@ -0,0 +1,195 @@
+/**
+ * @file rb_http_timer.c
+ * @brief Hierarchical timer wheel.
+ *
+ * Every worker owns a wheel, so no locking is needed. Scheduling and
+ * canceling a timer are O(1): the timer is linked into the slot of the level
+ * that covers its distance to the current time. When level 0 wraps around,
+ * the next slot of the upper levels is cascaded down. The wheel keeps the
+ * time of its last advance, so callers don't need to read the clock for
+ * every message.
+ */
+#include "../config.h"
+#include "rb_http_timer.h"
+
+#define SLOT_MASK (RB_HTTP_TIMER_SLOTS - 1)
+
+// Bits of the time that select the slot of a level
+#define LEVEL_SHIFT(level) ((level)*RB_HTTP_TIMER_SLOT_BITS)
+
+void rb_http_timer_wheel_init(struct rb_http_timer_wheel_s *wheel, long now) {
+  int i = 0;
+  int j = 0;
+
+  memset(wheel, 0, sizeof(*wheel));
+  wheel->now = now;
+  wheel->current = now;
+
+  for (i = 0; i < RB_HTTP_TIMER_LEVELS; i++) {
+    for (j = 0; j < RB_HTTP_TIMER_SLOTS; j++) {
+      TAILQ_INIT(&wheel->slots[i][j]);
+    }
+  }
+}
+
+void rb_http_timer_init(struct rb_http_timer_s *timer, void (*cb)(void *),
+                        void *opaque) {
+  memset(timer, 0, sizeof(*timer));
+  timer->cb = cb;
+  timer->opaque = opaque;
+}
+
+/**
+ * Links a timer in the slot that covers its expiration
+ */
+static void timer_link(struct rb_http_timer_wheel_s *wheel,
+                       struct rb_http_timer_s *timer) {
+  long expires = timer->expires;
+  long delta = 0;
+  int level = 0;
+
+  // Already expired timers fire on next advance
+  if (expires < wheel->current) {
+    expires = wheel->current;
+  }
+
+  // Timers too far away are kept on the last slot of the wheel and cascaded
+  // until they are close enough
+  delta = expires - wheel->current;
+  if (delta >> LEVEL_SHIFT(RB_HTTP_TIMER_LEVELS) != 0) {
+    delta = (1L << LEVEL_SHIFT(RB_HTTP_TIMER_LEVELS)) - 1;
+    expires = wheel->current + delta;
+  }
+
+  while (delta >> LEVEL_SHIFT(level + 1) != 0) {
+    level++;
+  }
+
+  timer->q =
+      &wheel->slots[level][(expires >> LEVEL_SHIFT(level)) & SLOT_MASK];
+  TAILQ_INSERT_TAIL(timer->q, timer, tailq);
+}
+
+void rb_http_timer_add(struct rb_http_timer_wheel_s *wheel,
+                       struct rb_http_timer_s *timer, long expires) {
+  rb_http_timer_cancel(wheel, timer);
+
+  timer->expires = expires;
+  timer_link(wheel, timer);
+  wheel->cnt++;
+}
+
+void rb_http_timer_cancel(struct rb_http_timer_wheel_s *wheel,
+                          struct rb_http_timer_s *timer) {
+  if (timer->q != NULL) {
+    TAILQ_REMOVE(timer->q, timer, tailq);
+    timer->q = NULL;
+    wheel->cnt--;
+  }
+}
+
+int rb_http_timer_pending(const struct rb_http_timer_s *timer) {
+  return timer->q != NULL;
+}
+
+/**
+ * Moves the timers of an upper level slot to the levels below
+ */
+static void timer_cascade(struct rb_http_timer_wheel_s *wheel, int level,
+                          int slot) {
+  struct rb_http_timer_q_s q;
+  struct rb_http_timer_s *timer = NULL;
+
+  TAILQ_INIT(&q);
+  TAILQ_CONCAT(&q, &wheel->slots[level][slot], tailq);
+
+  while ((timer = TAILQ_FIRST(&q)) != NULL) {
+    TAILQ_REMOVE(&q, timer, tailq);
+    timer_link(wheel, timer);
+  }
+}
+
+void rb_http_timer_wheel_advance(struct rb_http_timer_wheel_s *wheel,
+                                 long now) {
+  struct rb_http_timer_q_s fired;
+  struct rb_http_timer_s *timer = NULL;
+  int level = 0;
+  int slot = 0;
+
+  wheel->now = now;
+
+  if (wheel->cnt == 0) {
+    wheel->current = now + 1;
+    return;
+  }
+
+  TAILQ_INIT(&fired);
+
+  while (wheel->current <= now && wheel->cnt > 0) {
+    slot = (int)(wheel->current & SLOT_MASK);
+
+    if (slot == 0) {
+      for (level = 1; level < RB_HTTP_TIMER_LEVELS; level++) {
+        const int upper =
+            (int)((wheel->current >> LEVEL_SHIFT(level)) & SLOT_MASK);
+        timer_cascade(wheel, level, upper);
+        if (upper != 0) {
+          break;
+        }
+      }
+    }
+
+    TAILQ_CONCAT(&fired, &wheel->slots[0][slot], tailq);
+    TAILQ_FOREACH(timer, &fired, tailq) {
+      timer->q = &fired;
+    }
+
+    // Timers added from callbacks must go to the next slot
+    wheel->current++;
+
+    while ((timer = TAILQ_FIRST(&fired)) != NULL) {
+      TAILQ_REMOVE(&fired, timer, tailq);
+      timer->q = NULL;
+      wheel->cnt--;
+      timer->cb(timer->opaque);
+    }
+  }
+
+  if (wheel->cnt == 0) {
+    wheel->current = now + 1;
+  }
+}
+
+long rb_http_timer_wheel_next(const struct rb_http_timer_wheel_s *wheel,
+                              long max_ms) {
+  long next = max_ms;
+  int level = 0;
+  int i = 0;
+
+  if (wheel->cnt == 0) {
+    return max_ms;
+  }
+
+  for (level = 0; level < RB_HTTP_TIMER_LEVELS; level++) {
+    const long base = wheel->current >> LEVEL_SHIFT(level);
+
+    // Level 0 slots are fired at their own time, upper ones when they are
+    // cascaded, which is never later than any of their timers. An upper
+    // slot is reused a whole turn after it has been cascaded.
+    for (i = 0; i <= RB_HTTP_TIMER_SLOTS; i++) {
+      const long fire = (base + i) << LEVEL_SHIFT(level);
+      if (fire < wheel->current) {
+        continue;
+      }
+
+      if (!TAILQ_EMPTY(&wheel->slots[level][(base + i) & SLOT_MASK])) {
+        if (fire - wheel->now < next) {
+          next = fire - wheel->now;
+        }
+        break;
+      }
+    }
+  }
+
+  return next > 0 ? next : 0;
+}
@@ -0,0 +1,59 @@
+#include "rb_http_handler.h"
+
+/**
+ * Initializes a timer wheel
+ * @param wheel Wheel to initialize
+ * @param now   Current time (ms)
+ */
+void rb_http_timer_wheel_init(struct rb_http_timer_wheel_s *wheel, long now);
+
+/**
+ * Initializes a timer
+ * @param timer  Timer to initialize
+ * @param cb     Function called when the timer fires
+ * @param opaque Passed to cb
+ */
+void rb_http_timer_init(struct rb_http_timer_s *timer, void (*cb)(void *),
+                        void *opaque);
+
+/**
+ * Schedules a timer. If it was already pending it is rescheduled.
+ * @param wheel   Wheel of the timer
+ * @param timer   Timer to schedule
+ * @param expires Time (ms) the timer fires
+ */
+void rb_http_timer_add(struct rb_http_timer_wheel_s *wheel,
+                       struct rb_http_timer_s *timer, long expires);
+
+/**
+ * Cancels a timer. Nothing is done if it is not pending.
+ * @param wheel Wheel of the timer
+ * @param timer Timer to cancel
+ */
+void rb_http_timer_cancel(struct rb_http_timer_wheel_s *wheel,
+                          struct rb_http_timer_s *timer);
+
+/**
+ * Checks if a timer is scheduled
+ * @param  timer Timer to check
+ * @return       1 if the timer has not fired nor been canceled
+ */
+int rb_http_timer_pending(const struct rb_http_timer_s *timer);
+
+/**
+ * Updates the cached time of the wheel and fires the expired timers
+ * @param wheel Wheel to advance
+ * @param now   Current time (ms)
+ */
+void rb_http_timer_wheel_advance(struct rb_http_timer_wheel_s *wheel,
+                                 long now);
+
+/**
+ * Time until the next timer may fire. It can be earlier than the real
+ * expiration of the timer, but never later.
+ * @param  wheel  Wheel to check
+ * @param  max_ms Value returned if no timer fires before it
+ * @return        Time (ms) to wait before next advance
+ */
+long rb_http_timer_wheel_next(const struct rb_http_timer_wheel_s *wheel,
+                              long max_ms);
@@ -0,0 +1,105 @@
+/**
+ * @file rb_http_trace.c
+ * @brief Trace ring of the message path.
+ *
+ * Every stage of a message fires a USDT probe, and can be recorded in a
+ * ring of the last events too. Writers take a slot with an atomic add, so
+ * recording never blocks. Each slot has a sequence number that is odd while
+ * it is being written, so rb_http_trace_dump() skips the slots it catches
+ * in the middle of a write instead of locking the writers.
+ */
+#include "../config.h"
+#include "rb_http_trace.h"
+
+#include <inttypes.h>
+#include <time.h>
+
+static const char *trace_event_names[] = {
+    "enqueue", "dequeue", "compress", "chunk", "post_start", "post_end",
+    "report"};
+
+void rb_http_trace_add(struct rb_http_trace_s *trace, int event, int thread,
+                       uint64_t arg0, uint64_t arg1) {
+  const uint64_t index = ATOMIC_OP64(fetch, add, &trace->head, 1);
+  struct rb_http_trace_event_s *slot = &trace->events[index & trace->mask];
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  ATOMIC_OP64(add, fetch, &slot->seq, 1);
+  slot->index = index;
+  slot->ts = (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+  slot->event = event;
+  slot->thread = thread;
+  slot->arg0 = arg0;
+  slot->arg1 = arg1;
+  ATOMIC_OP64(add, fetch, &slot->seq, 1);
+}
+
+void rb_http_trace_destroy(struct rb_http_trace_s *trace) {
+  if (trace != NULL) {
+    free(trace->events);
+    free(trace);
+  }
+}
+
+void rb_http_handler_set_trace_ring(struct rb_http_handler_s *rb_http_handler,
+                                    size_t events) {
+  size_t size = 1;
+
+  assert(!rb_http_handler->running);
+
+  rb_http_trace_destroy(rb_http_handler->trace);
+  rb_http_handler->trace = NULL;
+
+  if (events > 0) {
+    while (size < events) {
+      size <<= 1;
+    }
+    rb_http_handler->trace = calloc(1, sizeof(struct rb_http_trace_s));
+    rb_http_handler->trace->events =
+        calloc(size, sizeof(struct rb_http_trace_event_s));
+    rb_http_handler->trace->mask = size - 1;
+  }
+}
+
+int rb_http_trace_dump(struct rb_http_handler_s *rb_http_handler,
+                       const char *path) {
+  struct rb_http_trace_s *trace = rb_http_handler->trace;
+  uint64_t head = 0;
+  uint64_t index = 0;
+  FILE *file = NULL;
+  int dumped = 0;
+
+  if (trace == NULL || (file = fopen(path, "w")) == NULL) {
+    return -1;
+  }
+
+  head = ATOMIC_OP64(add, fetch, &trace->head, 0);
+  index = head > trace->mask + 1 ? head - trace->mask - 1 : 0;
+
+  for (; index < head; index++) {
+    struct rb_http_trace_event_s *slot = &trace->events[index & trace->mask];
+    struct rb_http_trace_event_s event;
+    const uint64_t seq = ATOMIC_OP64(add, fetch, &slot->seq, 0);
+
+    memcpy(&event, slot, sizeof(event));
+
+    // Written while copying it, or already overwritten by a newer event
+    if ((seq & 1) != 0 || seq != ATOMIC_OP64(add, fetch, &slot->seq, 0) ||
+        event.index != index) {
+      continue;
+    }
+
+    fprintf(file, "%" PRIu64 ".%09" PRIu64 " %s thread=%d %" PRIu64
+                  " %" PRIu64 "\n",
+            event.ts / 1000000000, event.ts % 1000000000,
+            trace_event_names[event.event], event.thread, event.arg0,
+            event.arg1);
+    dumped++;
+  }
+
+  fclose(file);
+
+  return dumped;
+}
@@ -0,0 +1,46 @@
+#include "rb_http_handler.h"
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define RB_HTTP_TRACE_PROBE(probe, thread, arg0, arg1)                         \
+  DTRACE_PROBE3(librbhttp, probe, thread, arg0, arg1)
+#else
+#define RB_HTTP_TRACE_PROBE(probe, thread, arg0, arg1)
+#endif
+
+/**
+ * Fires the USDT probe librbhttp:probe, and records the event in the trace
+ * ring if the handler has one. A disabled probe is a nop instruction and a
+ * disabled ring a predicted branch.
+ * @param handler Handler
+ * @param event   RB_HTTP_TRACE_* event
+ * @param probe   Probe name
+ * @param thread  Connection thread, -1 if none
+ * @param arg0    First argument of the event
+ * @param arg1    Second argument of the event
+ */
+#define RB_HTTP_TRACE(handler, event, probe, thread, arg0, arg1)               \
+  do {                                                                         \
+    RB_HTTP_TRACE_PROBE(probe, thread, arg0, arg1);                            \
+    if ((handler)->trace != NULL) {                                            \
+      rb_http_trace_add((handler)->trace, event, thread, (uint64_t)(arg0),     \
+                        (uint64_t)(arg1));                                     \
+    }                                                                          \
+  } while (0)
+
+/**
+ * Records an event in a trace ring, overwriting the oldest one
+ * @param trace  Trace ring
+ * @param event  RB_HTTP_TRACE_* event
+ * @param thread Connection thread, -1 if none
+ * @param arg0   First argument of the event
+ * @param arg1   Second argument of the event
+ */
+void rb_http_trace_add(struct rb_http_trace_s *trace, int event, int thread,
+                       uint64_t arg0, uint64_t arg1);
+
+/**
+ * Frees a trace ring
+ * @param trace Trace ring, or NULL
+ */
+void rb_http_trace_destroy(struct rb_http_trace_s *trace);
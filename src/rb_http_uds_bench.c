@@ -0,0 +1,405 @@
+/**
+ * @file rb_http_uds_bench.c
+ * @brief Compares loopback TCP with a Unix domain socket.
+ *
+ * Starts a local sink, listening on both 127.0.0.1 and a Unix socket, that
+ * answers every request with an empty 200. Then, for each transport:
+ *  - latency: one message at a time, one POST per message (CHUNKED_MODE
+ *    with RB_HTTP_MAX_BATCH_MESSAGES 1), from rb_http_produce() to its
+ *    report.
+ *  - throughput: N messages in NORMAL_MODE, one request per message, and
+ *    in CHUNKED_MODE, batched.
+ * Usage: bench_uds [messages]
+ */
+#include "rb_http_handler.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define N_MESSAGE 5000
+#define N_LATENCY 2000
+#define MESSAGE                                                                \
+  "{\"client_mac\": \"54:26:96:db:88:01\", \"application_name\": \"wwww\", "   \
+  "\"sensor_uuid\":\"abc\", \"a\":5}"
+#define SINK_BUFSIZ 65536
+
+static const char sink_response[] =
+    "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n";
+static const char sink_continue[] = "HTTP/1.1 100 Continue\r\n\r\n";
+
+// @brief Request being read by the sink.
+struct sink_conn_s {
+  int fd;
+  char buf[SINK_BUFSIZ];
+  size_t len; // Bytes in buf
+};
+
+// @brief Reports of one run.
+struct bench_run_s {
+  long reported;
+  long errors;
+  uint64_t *sent;     // Time (ns) each message was produced
+  uint64_t *latency;  // Time (ns) from produce to report, per message
+};
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Makes sure the sink has at least need bytes of the request
+ * @param  conn Connection
+ * @param  need Bytes needed
+ * @return      0 on success, -1 if the connection was closed
+ */
+static int sink_fill(struct sink_conn_s *conn, size_t need) {
+  while (conn->len < need) {
+    const ssize_t rc =
+        read(conn->fd, conn->buf + conn->len, sizeof(conn->buf) - conn->len);
+
+    if (rc <= 0) {
+      return -1;
+    }
+    conn->len += (size_t)rc;
+  }
+
+  return 0;
+}
+
+/**
+ * Drops the first n bytes of the request buffer
+ * @param conn Connection
+ * @param n    Bytes
+ */
+static void sink_consume(struct sink_conn_s *conn, size_t n) {
+  memmove(conn->buf, conn->buf + n, conn->len - n);
+  conn->len -= n;
+}
+
+/**
+ * Reads a line of the request, CRLF included
+ * @param  conn Connection
+ * @return      Length of the line, 0 on error
+ */
+static size_t sink_line(struct sink_conn_s *conn) {
+  char *eol = NULL;
+
+  while ((eol = memchr(conn->buf, '\n', conn->len)) == NULL) {
+    if (conn->len == sizeof(conn->buf) || sink_fill(conn, conn->len + 1)) {
+      return 0;
+    }
+  }
+
+  return (size_t)(eol - conn->buf) + 1;
+}
+
+/**
+ * Discards n body bytes
+ * @param  conn Connection
+ * @param  n    Bytes
+ * @return      0 on success, -1 if the connection was closed
+ */
+static int sink_skip(struct sink_conn_s *conn, size_t n) {
+  while (n > 0) {
+    const size_t chunk = n < sizeof(conn->buf) ? n : sizeof(conn->buf);
+
+    if (sink_fill(conn, chunk)) {
+      return -1;
+    }
+    sink_consume(conn, chunk);
+    n -= chunk;
+  }
+
+  return 0;
+}
+
+/**
+ * Discards a chunked body
+ * @param  conn Connection
+ * @return      0 on success, -1 on error
+ */
+static int sink_skip_chunked(struct sink_conn_s *conn) {
+  size_t len = 0;
+  size_t size = 0;
+
+  do {
+    if ((len = sink_line(conn)) == 0) {
+      return -1;
+    }
+    size = strtoul(conn->buf, NULL, 16);
+    sink_consume(conn, len);
+    if (sink_skip(conn, size)) {
+      return -1;
+    }
+    // CRLF after the data, or the empty trailer after the last chunk
+    if ((len = sink_line(conn)) == 0) {
+      return -1;
+    }
+    sink_consume(conn, len);
+  } while (size > 0);
+
+  return 0;
+}
+
+static void *sink_conn(void *arg) {
+  struct sink_conn_s *conn = arg;
+
+  for (;;) {
+    size_t content_length = 0;
+    int chunked = 0;
+    size_t len = 0;
+
+    // Request line and headers
+    for (;;) {
+      if ((len = sink_line(conn)) == 0) {
+        goto end;
+      }
+      if (len == 2) {
+        sink_consume(conn, len);
+        break;
+      }
+      if (!strncasecmp(conn->buf, "Content-Length:", 15)) {
+        content_length = strtoul(conn->buf + 15, NULL, 10);
+      } else if (!strncasecmp(conn->buf, "Transfer-Encoding:", 18)) {
+        chunked = 1;
+      } else if (!strncasecmp(conn->buf, "Expect:", 7)) {
+        if (write(conn->fd, sink_continue, sizeof(sink_continue) - 1) < 0) {
+          goto end;
+        }
+      }
+      sink_consume(conn, len);
+    }
+
+    if (chunked ? sink_skip_chunked(conn)
+                : sink_skip(conn, content_length)) {
+      goto end;
+    }
+    if (write(conn->fd, sink_response, sizeof(sink_response) - 1) < 0) {
+      goto end;
+    }
+  }
+
+end:
+  close(conn->fd);
+  free(conn);
+  return NULL;
+}
+
+static void *sink_accept(void *arg) {
+  const int listen_fd = (int)(intptr_t)arg;
+
+  for (;;) {
+    struct sink_conn_s *conn = NULL;
+    pthread_t thread;
+    const int fd = accept(listen_fd, NULL, NULL);
+
+    if (fd < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return NULL;
+    }
+
+    conn = calloc(1, sizeof(*conn));
+    conn->fd = fd;
+    pthread_create(&thread, NULL, sink_conn, conn);
+    pthread_detach(thread);
+  }
+}
+
+/**
+ * Starts the sink on 127.0.0.1 and on a Unix socket
+ * @param  path Unix socket path
+ * @return      TCP port, -1 on error
+ */
+static int sink_start(const char *path) {
+  struct sockaddr_in in;
+  struct sockaddr_un un;
+  socklen_t in_len = sizeof(in);
+  pthread_t thread;
+  const int tcp_fd = socket(AF_INET, SOCK_STREAM, 0);
+  const int unix_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+  memset(&in, 0, sizeof(in));
+  in.sin_family = AF_INET;
+  in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  memset(&un, 0, sizeof(un));
+  un.sun_family = AF_UNIX;
+  snprintf(un.sun_path, sizeof(un.sun_path), "%s", path);
+  unlink(path);
+
+  if (tcp_fd < 0 || unix_fd < 0 ||
+      bind(tcp_fd, (struct sockaddr *)&in, sizeof(in)) ||
+      bind(unix_fd, (struct sockaddr *)&un, sizeof(un)) ||
+      listen(tcp_fd, 128) || listen(unix_fd, 128) ||
+      getsockname(tcp_fd, (struct sockaddr *)&in, &in_len)) {
+    perror("sink");
+    return -1;
+  }
+
+  pthread_create(&thread, NULL, sink_accept, (void *)(intptr_t)tcp_fd);
+  pthread_detach(thread);
+  pthread_create(&thread, NULL, sink_accept, (void *)(intptr_t)unix_fd);
+  pthread_detach(thread);
+
+  return ntohs(in.sin_port);
+}
+
+static struct bench_run_s run;
+
+static void bench_callback(struct rb_http_handler_s *rb_http_handler,
+                           int status_code, long http_status,
+                           const char *status_code_str, char *buff,
+                           size_t bufsiz, void *opaque) {
+  const uint64_t now = now_ns();
+  const long i = (long)(intptr_t)opaque - 1;
+
+  (void)rb_http_handler;
+  (void)status_code_str;
+  (void)buff;
+  (void)bufsiz;
+
+  if (status_code != 0 || http_status != 200) {
+    run.errors++;
+  }
+  if (i >= 0) {
+    run.latency[run.reported] = now - run.sent[i];
+  }
+  run.reported++;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  const uint64_t x = *(const uint64_t *)a;
+  const uint64_t y = *(const uint64_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+static struct rb_http_handler_s *bench_handler(const char *url,
+                                               const char *unix_socket,
+                                               const char *mode) {
+  struct rb_http_handler_s *handler = rb_http_handler_create(url, NULL, 0);
+
+  rb_http_handler_set_opt(handler, "RB_HTTP_MODE", mode, NULL, 0);
+  rb_http_handler_set_opt(handler, "HTTP_UNIX_SOCKET_PATH", unix_socket, NULL,
+                          0);
+  rb_http_handler_set_opt(handler, "RB_HTTP_MAX_MESSAGES", "1000000", NULL, 0);
+  rb_http_handler_set_opt(handler, "RB_HTTP_PREWARM", "1", NULL, 0);
+
+  return handler;
+}
+
+/**
+ * Produces messages, waiting for the reports when the queue is full
+ * @param handler  Handler
+ * @param messages Messages to produce
+ * @param inflight Max messages not reported yet
+ */
+static void bench_produce(struct rb_http_handler_s *handler, long messages,
+                          long inflight) {
+  char err[BUFSIZ];
+  long i = 0;
+
+  for (i = 0; i < messages; i++) {
+    while (i - run.reported >= inflight) {
+      rb_http_get_reports(handler, bench_callback, 10);
+    }
+    run.sent[i] = now_ns();
+    while (rb_http_produce(handler, (char *)MESSAGE, sizeof(MESSAGE) - 1, 0,
+                           err, sizeof(err), (void *)(intptr_t)(i + 1)) != 0) {
+      rb_http_get_reports(handler, bench_callback, 10);
+    }
+  }
+  rb_http_flush(handler, bench_callback, 60000);
+}
+
+static void bench_latency(const char *transport, const char *url,
+                          const char *unix_socket, long messages) {
+  struct rb_http_handler_s *handler =
+      bench_handler(url, unix_socket, "1"); // CHUNKED_MODE
+
+  rb_http_handler_set_opt(handler, "RB_HTTP_CONNECTIONS", "1", NULL, 0);
+  rb_http_handler_set_opt(handler, "RB_HTTP_MAX_BATCH_MESSAGES", "1", NULL, 0);
+  rb_http_handler_run(handler);
+  rb_http_handler_wait_ready(handler, 5000);
+
+  memset(&run, 0, sizeof(run));
+  run.sent = calloc((size_t)messages, sizeof(uint64_t));
+  run.latency = calloc((size_t)messages, sizeof(uint64_t));
+  bench_produce(handler, messages, 1);
+
+  qsort(run.latency, (size_t)run.reported, sizeof(uint64_t), cmp_u64);
+  printf("%-4s latency     %6ld messages, %ld errors: p50 %.1f us, "
+         "p99 %.1f us\n",
+         transport, run.reported, run.errors,
+         (double)run.latency[run.reported / 2] / 1000.0,
+         (double)run.latency[run.reported * 99 / 100] / 1000.0);
+
+  rb_http_handler_destroy(handler, NULL, 0);
+  free(run.sent);
+  free(run.latency);
+}
+
+static void bench_throughput(const char *transport, const char *url,
+                             const char *unix_socket, const char *mode,
+                             long messages) {
+  struct rb_http_handler_s *handler = bench_handler(url, unix_socket, mode);
+  uint64_t start = 0;
+  double elapsed = 0;
+
+  rb_http_handler_run(handler);
+  rb_http_handler_wait_ready(handler, 5000);
+
+  memset(&run, 0, sizeof(run));
+  run.sent = calloc((size_t)messages, sizeof(uint64_t));
+  run.latency = calloc((size_t)messages, sizeof(uint64_t));
+  start = now_ns();
+  bench_produce(handler, messages, messages);
+  elapsed = (double)(now_ns() - start) / 1e9;
+
+  printf("%-4s %-10s %6ld messages, %ld errors: %.0f msg/s\n", transport,
+         mode[0] == '0' ? "normal" : "chunked", run.reported, run.errors,
+         (double)run.reported / elapsed);
+
+  rb_http_handler_destroy(handler, NULL, 0);
+  free(run.sent);
+  free(run.latency);
+}
+
+int main(int argc, char **argv) {
+  const long messages = argc > 1 ? atol(argv[1]) : N_MESSAGE;
+  const long latency = messages < N_LATENCY ? messages : N_LATENCY;
+  char path[sizeof(((struct sockaddr_un *)NULL)->sun_path)];
+  char url[64];
+  int port = 0;
+
+  snprintf(path, sizeof(path), "/tmp/rb_http_bench.%d.sock", (int)getpid());
+  if ((port = sink_start(path)) < 0) {
+    return 1;
+  }
+  snprintf(url, sizeof(url), "http://127.0.0.1:%d/", port);
+
+  bench_latency("tcp", url, "", latency);
+  bench_latency("uds", url, path, latency);
+  bench_throughput("tcp", url, "", "0", messages);
+  bench_throughput("uds", url, path, "0", messages);
+  bench_throughput("tcp", url, "", "1", messages);
+  bench_throughput("uds", url, path, "1", messages);
+
+  unlink(path);
+  return 0;
+}
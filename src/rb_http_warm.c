@@ -0,0 +1,206 @@
+/**
+ * @file rb_http_warm.c
+ * @brief Connection pre-warming.
+ *
+ * With RB_HTTP_PREWARM the connections to the endpoint are opened by
+ * rb_http_handler_run(), with a HEAD request on every connection, so the
+ * first messages don't pay DNS, TCP and TLS setup. RB_HTTP_IDLE_PROBE
+ * sends the same request on connections idle for too long, before the
+ * server or a middlebox closes them, and RB_HTTP_TCP_KEEPALIVE enables TCP
+ * keepalive probes on all of them.
+ */
+#include "../config.h"
+#include "rb_http_adaptive.h"
+#include "rb_http_warm.h"
+
+#include <unistd.h>
+
+static size_t warm_write_null(void *buffer, size_t size, size_t nmemb,
+                              void *opaque) {
+  (void)buffer;
+  (void)opaque;
+
+  return nmemb * size;
+}
+
+void rb_http_warm_keepalive(CURL *easy_handle,
+                            const struct rb_http_options_s *options) {
+  curl_easy_setopt(easy_handle, CURLOPT_TCP_KEEPALIVE,
+                   options->tcp_keepalive > 0 ? 1L : 0L);
+  if (options->tcp_keepalive > 0) {
+    curl_easy_setopt(easy_handle, CURLOPT_TCP_KEEPIDLE, options->tcp_keepalive);
+    curl_easy_setopt(easy_handle, CURLOPT_TCP_KEEPINTVL,
+                     options->tcp_keepalive);
+  }
+}
+
+/**
+ * Makes a transfer a HEAD request to the endpoint
+ * @param easy_handle Transfer
+ * @param options     Options of the thread
+ */
+static void warm_request(CURL *easy_handle,
+                         const struct rb_http_options_s *options) {
+  curl_easy_setopt(easy_handle, CURLOPT_URL, options->url);
+  curl_easy_setopt(easy_handle, CURLOPT_UNIX_SOCKET_PATH, options->unix_socket);
+  curl_easy_setopt(easy_handle, CURLOPT_NOBODY, 1L);
+  curl_easy_setopt(easy_handle, CURLOPT_HTTPHEADER, NULL);
+  curl_easy_setopt(easy_handle, CURLOPT_WRITEFUNCTION, warm_write_null);
+  curl_easy_setopt(easy_handle, CURLOPT_NOPROGRESS, 1L);
+  curl_easy_setopt(easy_handle, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(easy_handle, CURLOPT_VERBOSE, options->verbose);
+  curl_easy_setopt(easy_handle, CURLOPT_SSL_VERIFYPEER,
+                   options->insecure ? 0L : 1L);
+  curl_easy_setopt(easy_handle, CURLOPT_SSL_VERIFYHOST,
+                   options->insecure ? 0L : 2L);
+  curl_easy_setopt(easy_handle, CURLOPT_TIMEOUT_MS, options->timeout);
+  curl_easy_setopt(easy_handle, CURLOPT_CONNECTTIMEOUT_MS,
+                   options->conntimeout);
+  rb_http_warm_keepalive(easy_handle, options);
+}
+
+int rb_http_warm_probe(struct rb_http_threaddata_s *rb_http_threaddata) {
+  CURL *easy_handle = rb_http_threaddata->easy_handle;
+  CURLcode res;
+
+  warm_request(easy_handle, rb_http_threaddata->options);
+  res = curl_easy_perform(easy_handle);
+
+  // Next POST sets its own method, headers and callbacks
+  curl_easy_setopt(easy_handle, CURLOPT_NOBODY, 0L);
+  rb_http_threaddata->last_request = rb_http_now_ms();
+
+  if (res != CURLE_OK) {
+    return 0;
+  }
+
+  if (!rb_http_threaddata->warm) {
+    rb_http_threaddata->warm = 1;
+    ATOMIC_OP(add, fetch, &rb_http_threaddata->rb_http_handler->warm, 1);
+  }
+
+  return 1;
+}
+
+int rb_http_warm_multi(struct rb_http_threaddata_s *rb_http_threaddata,
+                       int connections) {
+  struct rb_http_handler_s *rb_http_handler =
+      rb_http_threaddata->rb_http_handler;
+  CURLM *multi_handle = rb_http_handler->multi_handle;
+  CURL **easy_handles = calloc((size_t)connections, sizeof(CURL *));
+  CURLMsg *msg = NULL;
+  int msgs_left = 0;
+  int running = 0;
+  int warm = 0;
+  int i = 0;
+
+  for (i = 0; i < connections; i++) {
+    easy_handles[i] = curl_easy_init();
+    warm_request(easy_handles[i], rb_http_threaddata->options);
+    curl_multi_add_handle(multi_handle, easy_handles[i]);
+  }
+
+  // All the requests are started at once, so each one opens a connection
+  do {
+    curl_multi_perform(multi_handle, &running);
+    while ((msg = curl_multi_info_read(multi_handle, &msgs_left))) {
+      if (msg->msg == CURLMSG_DONE && msg->data.result == CURLE_OK) {
+        warm++;
+      }
+    }
+  } while (running > 0 &&
+           curl_multi_wait(multi_handle, NULL, 0, 100, NULL) == CURLM_OK);
+
+  for (i = 0; i < connections; i++) {
+    curl_multi_remove_handle(multi_handle, easy_handles[i]);
+    curl_easy_cleanup(easy_handles[i]);
+  }
+  free(easy_handles);
+
+  rb_http_threaddata->last_request = rb_http_now_ms();
+  if (warm > rb_http_threaddata->warm) {
+    ATOMIC_OP(add, fetch, &rb_http_handler->warm,
+              warm - rb_http_threaddata->warm);
+    rb_http_threaddata->warm = warm;
+  }
+
+  return warm;
+}
+
+void rb_http_warm_start(struct rb_http_threaddata_s *rb_http_threaddata,
+                        int connections) {
+  struct rb_http_handler_s *rb_http_handler =
+      rb_http_threaddata->rb_http_handler;
+  CURL *easy_handle = NULL;
+  int i = 0;
+
+  rb_http_threaddata->last_request = rb_http_now_ms();
+  if (rb_http_threaddata->probes > 0) {
+    return;
+  }
+
+  rb_http_threaddata->probes_ok = 0;
+  free(rb_http_threaddata->probe_handles);
+  rb_http_threaddata->probe_handles =
+      calloc((size_t)connections, sizeof(CURL *));
+  rb_http_threaddata->probe_handles_cnt = connections;
+  for (i = 0; i < connections; i++) {
+    easy_handle = curl_easy_init();
+    warm_request(easy_handle, rb_http_threaddata->options);
+    if (curl_multi_add_handle(rb_http_handler->multi_handle, easy_handle) !=
+        CURLM_OK) {
+      curl_easy_cleanup(easy_handle);
+      continue;
+    }
+    rb_http_threaddata->probe_handles[i] = easy_handle;
+    rb_http_threaddata->probes++;
+    rb_http_handler->still_running++;
+  }
+}
+
+void rb_http_warm_done(struct rb_http_threaddata_s *rb_http_threaddata,
+                       CURL *easy_handle, CURLcode result) {
+  struct rb_http_handler_s *rb_http_handler =
+      rb_http_threaddata->rb_http_handler;
+  int i = 0;
+
+  for (i = 0; i < rb_http_threaddata->probe_handles_cnt; i++) {
+    if (rb_http_threaddata->probe_handles[i] == easy_handle) {
+      rb_http_threaddata->probe_handles[i] = NULL;
+    }
+  }
+  curl_multi_remove_handle(rb_http_handler->multi_handle, easy_handle);
+  curl_easy_cleanup(easy_handle);
+
+  rb_http_threaddata->probes--;
+  if (result == CURLE_OK) {
+    rb_http_threaddata->probes_ok++;
+  }
+  if (rb_http_threaddata->probes == 0 &&
+      rb_http_threaddata->probes_ok > rb_http_threaddata->warm) {
+    ATOMIC_OP(add, fetch, &rb_http_handler->warm,
+              rb_http_threaddata->probes_ok - rb_http_threaddata->warm);
+    rb_http_threaddata->warm = rb_http_threaddata->probes_ok;
+  }
+}
+
+int rb_http_handler_wait_ready(struct rb_http_handler_s *rb_http_handler,
+                               int timeout_ms) {
+  const long deadline = rb_http_now_ms() + timeout_ms;
+  int connections = 0;
+  int warm = 0;
+
+  pthread_mutex_lock(&rb_http_handler->options_lock);
+  connections = rb_http_handler->options->prewarm
+                    ? rb_http_handler->options->connections
+                    : 0;
+  pthread_mutex_unlock(&rb_http_handler->options_lock);
+
+  while ((warm = ATOMIC_OP(add, fetch, &rb_http_handler->warm, 0)) <
+             connections &&
+         rb_http_handler->running && rb_http_now_ms() < deadline) {
+    usleep(10 * 1000);
+  }
+
+  return warm;
+}
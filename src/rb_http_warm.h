@@ -0,0 +1,49 @@
+#include "rb_http_handler.h"
+
+/**
+ * Sets the TCP keepalive options of a transfer
+ * @param easy_handle Transfer
+ * @param options     Options of the thread
+ */
+void rb_http_warm_keepalive(CURL *easy_handle,
+                            const struct rb_http_options_s *options);
+
+/**
+ * Opens the connection of a CHUNKED_MODE thread, or checks it is still
+ * open, with a HEAD request to the endpoint. The connection is kept by the
+ * transfer for the next POST.
+ * @param  rb_http_threaddata Thread
+ * @return                    1 if the endpoint answered
+ */
+int rb_http_warm_probe(struct rb_http_threaddata_s *rb_http_threaddata);
+
+/**
+ * Opens connections of the NORMAL_MODE thread with HEAD requests to the
+ * endpoint. The connections are kept by the multi handle for the next
+ * messages.
+ * @param  rb_http_threaddata Thread
+ * @param  connections        Connections to open
+ * @return                    Connections the endpoint answered on
+ */
+int rb_http_warm_multi(struct rb_http_threaddata_s *rb_http_threaddata,
+                       int connections);
+
+/**
+ * Like rb_http_warm_multi(), but doesn't wait for the probes: a runtime
+ * worker drives them with the other transfers, and gives them to
+ * rb_http_warm_done() when they finish. Nothing is started while the
+ * previous probes are in flight.
+ * @param rb_http_threaddata Thread data of the handler
+ * @param connections        Connections to open
+ */
+void rb_http_warm_start(struct rb_http_threaddata_s *rb_http_threaddata,
+                        int connections);
+
+/**
+ * Accounts a probe started by rb_http_warm_start() and releases it
+ * @param rb_http_threaddata Thread data of the handler
+ * @param easy_handle        Probe
+ * @param result             Result of the probe
+ */
+void rb_http_warm_done(struct rb_http_threaddata_s *rb_http_threaddata,
+                       CURL *easy_handle, CURLcode result);
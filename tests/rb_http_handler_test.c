@@ -1,8 +1,11 @@
 #include <errno.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <stdarg.h>
 #include <stddef.h>
@@ -10,6 +13,13 @@
 #include <cmocka.h>
 
 #include "../src/librb-http.h"
+#include "../src/rb_http_chunked.h"
+#include "../src/rb_http_fanout.h"
+#include "../src/rb_http_lanes.h"
+#include "../src/rb_http_partition.h"
+#include "../src/rb_http_ratelimit.h"
+#include "../src/rb_http_timer.h"
+#include "../src/rb_http_trace.h"
 
 static void test_rb_http_handler_url (void **state) {
 	(void) state;
@@ -33,11 +43,1061 @@ static void test_rb_http_handler_url_null (void **state) {
 	assert_null (handler);
 }
 
+#define OPTION(key, val, field)                                               \
+	{ key, #val, offsetof (struct rb_http_options_s, field),                \
+	  sizeof (((struct rb_http_options_s *)0)->field), val }
+
+// Options stored as given
+static const struct {
+	const char *key;
+	const char *val;
+	size_t offset;
+	size_t size;
+	long expected;
+} option_tests[] = {
+	OPTION ("RB_HTTP_MAX_BATCH_MESSAGES", 100, max_batch_messages),
+	OPTION ("RB_HTTP_MAX_BATCH_BYTES", 65536, max_batch_bytes),
+	OPTION ("RB_HTTP_MAX_BATCH_COMPRESSED_BYTES", 8192,
+	        max_batch_compressed_bytes),
+	OPTION ("RB_HTTP_MAX_POST_DURATION", 2000, max_post_duration),
+	OPTION ("RB_HTTP_ADAPTIVE_BATCH", 1, adaptive_batch),
+	OPTION ("RB_HTTP_ADAPTIVE_CONNECTIONS", 1, adaptive_connections),
+	OPTION ("RB_HTTP_MIN_CONNECTIONS", 2, min_connections),
+	OPTION ("RB_HTTP_MAX_PRIORITY_MESSAGES", 10, max_priority_messages),
+	OPTION ("RB_HTTP_PRIORITY_WEIGHT", 2, priority_weight),
+	OPTION ("RB_HTTP_MESSAGE_TTL", 500, message_ttl),
+	OPTION ("RB_HTTP_DRAIN_TIMEOUT", 100, drain_timeout),
+	OPTION ("RB_HTTP_FRAMING", 2, framing),
+	OPTION ("RB_HTTP_MAX_BYTES_PER_SEC", 1000, max_bytes_per_sec),
+	OPTION ("RB_HTTP_REQUESTS_BURST", 5, requests_burst),
+	OPTION ("RB_HTTP_FANOUT_QUORUM", 2, fanout_quorum),
+	OPTION ("RB_HTTP_PREWARM", 1, prewarm),
+	OPTION ("RB_HTTP_IDLE_PROBE", 30000, idle_probe),
+	OPTION ("RB_HTTP_TCP_KEEPALIVE", 60, tcp_keepalive),
+	OPTION ("RB_HTTP_MAX_RESPONSE_BYTES", 4096, max_response_bytes),
+};
+
+static void test_rb_http_handler_options (void **state) {
+	(void) state;
+
+	struct rb_http_handler_s *handler = NULL;
+	char err[BUFSIZ];
+	size_t i = 0;
+
+	handler = rb_http_handler_create("http://localhost:8080/librb-http", err,
+	                                 sizeof(err));
+	assert_non_null (handler);
+
+	for (i = 0; i < sizeof(option_tests) / sizeof(option_tests[0]); i++) {
+		const char *field = NULL;
+		long value = 0;
+
+		assert_int_equal (rb_http_handler_set_opt (handler,
+		                  option_tests[i].key, option_tests[i].val, err,
+		                  sizeof(err)), 0);
+
+		// Every option publishes a new snapshot
+		field = (const char *)handler->options + option_tests[i].offset;
+		if (option_tests[i].size == sizeof(int)) {
+			value = *(const int *)field;
+		} else {
+			value = *(const long *)field;
+		}
+		assert_int_equal (value, option_tests[i].expected);
+	}
+
+	// Lists and paths
+	assert_int_equal (rb_http_handler_set_opt (handler, "RB_HTTP_FANOUT_URLS",
+	                  "http://localhost:8081/a,http://localhost:8082/b", err,
+	                  sizeof(err)), 0);
+	assert_int_equal (handler->options->fanout_cnt, 2);
+	assert_string_equal (handler->options->fanout_urls[1],
+	                     "http://localhost:8082/b");
+	assert_int_equal (rb_http_handler_set_opt (handler, "RB_HTTP_FANOUT_URLS",
+	                  "a,b,c,d,e,f,g,h", err, sizeof(err)), -1);
+	assert_int_equal (handler->options->fanout_cnt, 2);
+	assert_int_equal (rb_http_handler_set_opt (handler, "RB_HTTP_FANOUT_URLS",
+	                  "", err, sizeof(err)), 0);
+	assert_int_equal (handler->options->fanout_cnt, 0);
+
+	assert_int_equal (rb_http_handler_set_opt (handler,
+	                  "HTTP_UNIX_SOCKET_PATH", "/run/collector.sock", err,
+	                  sizeof(err)), 0);
+	assert_string_equal (handler->options->unix_socket,
+	                     "/run/collector.sock");
+	assert_int_equal (rb_http_handler_set_opt (handler,
+	                  "HTTP_UNIX_SOCKET_PATH", "", err, sizeof(err)), 0);
+	assert_null (handler->options->unix_socket);
+
+	// Lower bounds above their upper bound are rejected
+	assert_int_equal (rb_http_handler_set_opt (handler,
+	                  "RB_HTTP_MIN_BATCH_MESSAGES", "101", err, sizeof(err)),
+	                  -1);
+	assert_int_equal (rb_http_handler_set_opt (handler,
+	                  "RB_HTTP_MIN_BATCH_TIMEOUT", "1001", err, sizeof(err)),
+	                  -1);
+	assert_int_equal (handler->options->min_batch_messages,
+	                  DEFAULT_MIN_BATCH_MESSAGES);
+	assert_int_equal (rb_http_handler_set_opt (handler,
+	                  "RB_HTTP_MIN_CONNECTIONS", "0", err, sizeof(err)), -1);
+	assert_int_equal (rb_http_handler_set_opt (handler,
+	                  "RB_HTTP_MIN_CONNECTIONS", "5", err, sizeof(err)), -1);
+	assert_int_equal (rb_http_handler_set_opt (handler, "RB_HTTP_CONNECTIONS",
+	                  "1", err, sizeof(err)), -1);
+	assert_int_equal (handler->options->min_connections, 2);
+
+	// Producers see the limits they check without taking the options lock
+	assert_int_equal (handler->max_priority_messages, 10);
+	assert_int_equal (handler->message_ttl, 500);
+
+	rb_http_handler_destroy (handler, err, sizeof(err));
+}
+
+static void test_rb_http_strerror (void **state) {
+	(void) state;
+
+	assert_string_equal (rb_http_strerror (RB_HTTP_ERR_EXPIRED),
+	                     "Message expired before it could be sent");
+	assert_string_equal (rb_http_strerror (RB_HTTP_ERR_QUORUM),
+	                     "Message not acknowledged by enough destinations");
+	assert_string_equal (rb_http_strerror (RB_HTTP_ERR_REJECTED),
+	                     "Message rejected by the server");
+	assert_string_equal (rb_http_strerror (RB_HTTP_ERR_ABORTED),
+	                     "Message request aborted when the handler was "
+	                     "destroyed");
+}
+
+#define RESIZE_MESSAGES 2000
+
+static int reported = 0;
+
+static void count_report (struct rb_http_handler_s *handler, int status_code,
+                          long http_code, const char *status_code_str,
+                          char *buff, size_t bufsiz, void *opaque) {
+	(void) handler;
+	(void) status_code;
+	(void) http_code;
+	(void) status_code_str;
+	(void) buff;
+	(void) bufsiz;
+	(void) opaque;
+
+	reported++;
+}
+
+static void *resize_producer (void *arg) {
+	struct rb_http_handler_s *handler = arg;
+	char err[BUFSIZ];
+	int i = 0;
+
+	for (i = 0; i < RESIZE_MESSAGES; i++) {
+		while (rb_http_produce (handler, (char *)"{}", 2, 0, err,
+		                        sizeof(err), NULL) != 0) {
+			usleep (100);
+		}
+	}
+
+	return NULL;
+}
+
+static void test_rb_http_handler_resize (void **state) {
+	(void) state;
+
+	struct rb_http_handler_s *handler = NULL;
+	pthread_t producer;
+	char err[BUFSIZ];
+	int i = 0;
+
+	// Nothing listens there, so every POST fails and reports its messages
+	handler = rb_http_handler_create("http://127.0.0.1:1/librb-http", err,
+	                                 sizeof(err));
+	assert_non_null (handler);
+	assert_int_equal (rb_http_handler_set_opt (handler, "RB_HTTP_MODE", "1",
+	                  err, sizeof(err)), 0);
+	assert_int_equal (rb_http_handler_set_opt (handler,
+	                  "RB_HTTP_MIN_RETRY_BACKOFF", "0", err, sizeof(err)), 0);
+	rb_http_handler_run (handler);
+
+	// Threads retired while messages are being queued to them lose none
+	pthread_create (&producer, NULL, resize_producer, handler);
+	for (i = 0; i < 50; i++) {
+		assert_int_equal (rb_http_handler_set_opt (handler,
+		                  "RB_HTTP_CONNECTIONS", i % 2 ? "4" : "1", err,
+		                  sizeof(err)), 0);
+		usleep (1000);
+	}
+	pthread_join (producer, NULL);
+
+	reported = 0;
+	assert_int_equal (rb_http_flush (handler, count_report, 30000), 0);
+	assert_int_equal (reported, RESIZE_MESSAGES);
+
+	rb_http_handler_destroy (handler, err, sizeof(err));
+}
+
+static long test_now_ms (void) {
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void test_rb_http_handler_retry_backoff (void **state) {
+	(void) state;
+
+	struct rb_http_handler_s *handler = NULL;
+	char err[BUFSIZ];
+	long start = 0;
+
+	handler = rb_http_handler_create("http://127.0.0.1:1/librb-http", err,
+	                                 sizeof(err));
+	assert_non_null (handler);
+	assert_int_equal (rb_http_handler_set_opt (handler, "RB_HTTP_MODE", "1",
+	                  err, sizeof(err)), 0);
+	assert_int_equal (rb_http_handler_set_opt (handler, "RB_HTTP_CONNECTIONS",
+	                  "1", err, sizeof(err)), 0);
+	assert_int_equal (rb_http_handler_set_opt (handler,
+	                  "RB_HTTP_MIN_RETRY_BACKOFF", "10000", err, sizeof(err)),
+	                  0);
+	assert_int_equal (rb_http_handler_set_opt (handler,
+	                  "RB_HTTP_DRAIN_TIMEOUT", "0", err, sizeof(err)), 0);
+	rb_http_handler_run (handler);
+
+	// The POST fails before taking the message, which waits 10 s for the
+	// next one
+	assert_int_equal (rb_http_produce (handler, (char *)"{}", 2, 0, err,
+	                  sizeof(err), NULL), 0);
+	usleep (200 * 1000);
+	reported = 0;
+	assert_int_equal (rb_http_get_reports (handler, count_report, 0), 1);
+	assert_int_equal (reported, 0);
+
+	// Destroy doesn't wait for the end of the backoff
+	start = test_now_ms ();
+	rb_http_handler_destroy (handler, err, sizeof(err));
+	assert_true (test_now_ms () - start < 200);
+}
+
+static void test_rb_http_handler_stats (void **state) {
+	(void) state;
+
+	struct rb_http_handler_s *handler = NULL;
+	char err[BUFSIZ];
+	char stats[BUFSIZ];
+	int len = 0;
+
+	handler = rb_http_handler_create("http://localhost:8080/librb-http", err,
+	                                 sizeof(err));
+	assert_non_null (handler);
+
+	len = rb_http_handler_get_stats (handler, stats, sizeof(stats));
+	assert_true (len > 0 && (size_t)len < sizeof(stats));
+	assert_non_null (strstr (stats, "\"workers\":[]"));
+
+	/* Truncated output still reports the full length */
+	assert_int_equal (rb_http_handler_get_stats (handler, stats, 4), len);
+	assert_int_equal (strlen (stats), 3);
+}
+
+static void test_rb_http_handler_options_version (void **state) {
+	(void) state;
+
+	struct rb_http_handler_s *handler = NULL;
+	char err[BUFSIZ];
+	uint64_t version = 0;
+
+	handler = rb_http_handler_create("http://localhost:8080/librb-http", err,
+	                                 sizeof(err));
+	assert_non_null (handler);
+	version = handler->options->version;
+
+	assert_int_equal (rb_http_handler_set_opt (handler, "HTTP_URL",
+	                  "http://localhost:8081/librb-http", err, sizeof(err)), 0);
+	assert_string_equal (handler->options->url,
+	                     "http://localhost:8081/librb-http");
+	assert_true (handler->options->version == version + 1);
+
+	/* Rejected options don't publish a new snapshot */
+	assert_int_equal (rb_http_handler_set_opt (handler, "RB_HTTP_CONNECTIONS",
+	                  "0", err, sizeof(err)), -1);
+	assert_int_equal (rb_http_handler_set_opt (handler, "UNKNOWN", "0", err,
+	                  sizeof(err)), -1);
+	assert_true (handler->options->version == version + 1);
+	assert_int_equal (handler->options->connections, DEFAULT_CONNECTIONS);
+
+	/* Batch size follows max messages until it is set explicitly */
+	assert_int_equal (rb_http_handler_set_opt (handler,
+	                  "RB_HTTP_MAX_MESSAGES", "1000", err, sizeof(err)), 0);
+	assert_int_equal (handler->options->max_batch_messages, 100);
+
+	rb_http_handler_destroy (handler, err, sizeof(err));
+}
+
+static void test_rb_http_handler_flush (void **state) {
+	(void) state;
+
+	struct rb_http_handler_s *handler = NULL;
+	char err[BUFSIZ];
+
+	handler = rb_http_handler_create("http://localhost:8080/librb-http", err,
+	                                 sizeof(err));
+	assert_non_null (handler);
+
+	// Empty messages are never queued
+	assert_int_equal (rb_http_produce (handler, NULL, 0, 0, err, sizeof(err),
+	                  NULL), 1);
+	assert_int_equal (handler->outstanding, 0);
+	assert_int_equal (rb_http_flush (handler, NULL, 0), 0);
+
+	rb_http_handler_destroy (handler, err, sizeof(err));
+
+	// Without a report callback it waits for the refused request to be
+	// reported, and leaves the report queued
+	handler = rb_http_handler_create("http://127.0.0.1:1/librb-http", err,
+	                                 sizeof(err));
+	assert_non_null (handler);
+	rb_http_handler_run (handler);
+	assert_int_equal (rb_http_produce (handler, (char *)"{}", 2, 0, err,
+	                  sizeof(err), NULL), 0);
+	assert_int_equal (rb_http_flush (handler, NULL, 30000), 0);
+	assert_int_equal (handler->outstanding, 0);
+
+	reported = 0;
+	assert_int_equal (rb_http_get_reports (handler, count_report, 0), 0);
+	assert_int_equal (reported, 1);
+
+	rb_http_handler_destroy (handler, err, sizeof(err));
+}
+
+static void test_rb_http_handler_memory_budget (void **state) {
+	(void) state;
+
+	struct rb_http_handler_s *handler = NULL;
+	char err[BUFSIZ];
+	char message[512];
+
+	handler = rb_http_handler_create("http://localhost:8080/librb-http", err,
+	                                 sizeof(err));
+	assert_non_null (handler);
+	assert_int_equal (handler->max_bytes, 0);
+
+	assert_int_equal (rb_http_handler_set_opt (handler, "RB_HTTP_MAX_BYTES",
+	                  "256", err, sizeof(err)), 0);
+	assert_int_equal (handler->max_bytes, 256);
+
+	memset (message, 'a', sizeof(message));
+	assert_int_equal (rb_http_produce (handler, message, sizeof(message),
+	                  RB_HTTP_MESSAGE_F_COPY, err, sizeof(err), NULL), 1);
+	assert_string_equal (err, "librbhttp memory budget exceeded");
+	assert_int_equal (handler->bytes, 0);
+
+	rb_http_handler_destroy (handler, err, sizeof(err));
+}
+
+static ssize_t test_payload_read (char *buf, size_t size, size_t offset,
+                                   void *opaque) {
+	(void) buf;
+	(void) offset;
+	(void) opaque;
+	return (ssize_t) size;
+}
+
+static void test_rb_http_handler_payload_sources (void **state) {
+	(void) state;
+
+	struct rb_http_handler_s *handler = NULL;
+	char err[BUFSIZ];
+
+	handler = rb_http_handler_create("http://localhost:8080/librb-http", err,
+	                                 sizeof(err));
+	assert_non_null (handler);
+
+	// Only buffers can be copied
+	assert_int_equal (rb_http_produce_fd (handler, 0, 0, 10,
+	                  RB_HTTP_MESSAGE_F_COPY, err, sizeof(err), NULL), 1);
+	assert_string_equal (err, "librbhttp invalid flags for this payload");
+	assert_int_equal (rb_http_produce_pull (handler, test_payload_read, 10,
+	                  RB_HTTP_MESSAGE_F_FREE, err, sizeof(err), NULL), 1);
+	assert_int_equal (rb_http_produce_pull (handler, NULL, 10, 0, err,
+	                  sizeof(err), NULL), 1);
+	assert_int_equal (handler->outstanding, 0);
+
+	rb_http_handler_destroy (handler, err, sizeof(err));
+}
+
+static int payload_marked = -1;
+
+static void test_payload_free (struct rb_http_handler_s *handler,
+                               char *payload, size_t len, int marked,
+                               void *message_opaque, void *opaque) {
+	(void) handler;
+	(void) payload;
+	(void) len;
+	(void) message_opaque;
+	(void) opaque;
+
+	payload_marked = marked;
+}
+
+static void test_rb_http_handler_buffer_pool (void **state) {
+	(void) state;
+
+	struct rb_http_handler_s *handler = NULL;
+	char err[BUFSIZ];
+	char *buff = NULL;
+	int opaque = 0;
+
+	handler = rb_http_handler_create("http://localhost:8080/librb-http", err,
+	                                 sizeof(err));
+	assert_non_null (handler);
+
+	rb_http_handler_set_payload_free (handler, test_payload_free, &opaque);
+	assert_non_null (handler->payload_free);
+	assert_ptr_equal (handler->payload_free->opaque, &opaque);
+
+	// A returned buffer is reused
+	buff = rb_http_buffer_alloc (handler, 100);
+	assert_non_null (buff);
+	rb_http_buffer_free (handler, buff);
+	assert_ptr_equal (rb_http_buffer_alloc (handler, 200), buff);
+
+	// A pooled payload is never copied
+	assert_int_equal (rb_http_produce (handler, buff, 100,
+	                  RB_HTTP_MESSAGE_F_POOL | RB_HTTP_MESSAGE_F_COPY, err,
+	                  sizeof(err), NULL), 1);
+	rb_http_buffer_free (handler, buff);
+
+	rb_http_handler_destroy (handler, err, sizeof(err));
+
+	// The deallocator tells marked payloads apart
+	handler = rb_http_handler_create("http://127.0.0.1:1/librb-http", err,
+	                                 sizeof(err));
+	assert_non_null (handler);
+	rb_http_handler_set_payload_free (handler, test_payload_free, &opaque);
+	rb_http_handler_run (handler);
+
+	assert_int_equal (rb_http_produce (handler, (char *)"{}", 2,
+	                  RB_HTTP_MESSAGE_F_FREE | RB_HTTP_MESSAGE_F_MARK, err,
+	                  sizeof(err), NULL), 0);
+	assert_int_equal (rb_http_flush (handler, count_report, 30000), 0);
+	assert_int_equal (payload_marked, 1);
+
+	assert_int_equal (rb_http_produce (handler, (char *)"{}", 2,
+	                  RB_HTTP_MESSAGE_F_FREE, err, sizeof(err), NULL), 0);
+	assert_int_equal (rb_http_flush (handler, count_report, 30000), 0);
+	assert_int_equal (payload_marked, 0);
+
+	rb_http_handler_destroy (handler, err, sizeof(err));
+}
+
+static void test_rb_http_handler_trace_ring (void **state) {
+	(void) state;
+
+	struct rb_http_handler_s *handler = NULL;
+	char err[BUFSIZ];
+	int i = 0;
+
+	handler = rb_http_handler_create("http://localhost:8080/librb-http", err,
+	                                 sizeof(err));
+	assert_non_null (handler);
+	assert_int_equal (rb_http_trace_dump (handler, "/tmp/rb_http_trace.txt"),
+	                  -1);
+
+	// The ring is rounded up to a power of two
+	rb_http_handler_set_trace_ring (handler, 100);
+	assert_non_null (handler->trace);
+	assert_int_equal (handler->trace->mask, 127);
+
+	// Only the newest events are kept
+	for (i = 0; i < 130; i++) {
+		rb_http_trace_add (handler->trace, RB_HTTP_TRACE_ENQUEUE, 0,
+		                   (uint64_t)i, 0);
+	}
+	assert_int_equal (rb_http_trace_dump (handler, "/tmp/rb_http_trace.txt"),
+	                  128);
+	unlink ("/tmp/rb_http_trace.txt");
+
+	rb_http_handler_set_trace_ring (handler, 0);
+	assert_null (handler->trace);
+
+	rb_http_handler_destroy (handler, err, sizeof(err));
+}
+
+static void test_rb_http_handler_rate_limit (void **state) {
+	(void) state;
+
+	struct rb_http_ratelimit_s bucket;
+
+	// 10 tokens per second, starting with a burst of 5
+	rb_http_ratelimit_init (&bucket);
+	assert_int_equal (rb_http_ratelimit_take (&bucket, 10, 5, 5, 1000), 0);
+
+	// The bucket goes into debt, and is paid as time passes
+	assert_int_equal (rb_http_ratelimit_take (&bucket, 10, 5, 1, 1000), 101);
+	assert_int_equal (rb_http_ratelimit_take (&bucket, 10, 5, 0, 1101), 0);
+
+	// Tokens don't accumulate over the burst
+	rb_http_ratelimit_take (&bucket, 10, 5, 0, 60000);
+	assert_int_equal (rb_http_ratelimit_take (&bucket, 10, 5, 6, 60000), 101);
+
+	// No rate means no limit
+	assert_int_equal (rb_http_ratelimit_take (&bucket, 0, 0, 100, 60000), 0);
+	rb_http_ratelimit_destroy (&bucket);
+}
+
+static int expired = 0;
+
+static void expired_report (struct rb_http_handler_s *handler, int status_code,
+                            long http_code, const char *status_code_str,
+                            char *buff, size_t bufsiz, void *opaque) {
+	(void) handler;
+	(void) http_code;
+	(void) status_code_str;
+	(void) buff;
+	(void) bufsiz;
+	(void) opaque;
+
+	expired += status_code == RB_HTTP_ERR_EXPIRED;
+}
+
+static void test_rb_http_handler_runtime (void **state) {
+	(void) state;
+
+	struct rb_http_runtime_s *runtime = NULL;
+	struct rb_http_handler_s *handler = NULL;
+	char err[BUFSIZ];
+
+	assert_null (rb_http_runtime_create (0, err, sizeof(err)));
+	runtime = rb_http_runtime_create (2, err, sizeof(err));
+	assert_non_null (runtime);
+
+	handler = rb_http_handler_create("http://localhost:8080/librb-http", err,
+	                                 sizeof(err));
+	assert_non_null (handler);
+	assert_int_equal (rb_http_handler_set_runtime (handler, runtime, err,
+	                  sizeof(err)), 0);
+	assert_ptr_equal (handler->runtime, runtime);
+
+	// CHUNKED_MODE handlers keep their own threads
+	assert_true (rb_http_handler_set_opt (handler, "RB_HTTP_MODE", "1", err,
+	             sizeof(err)) != 0);
+
+	// The first message takes more bytes than allowed in a second, so the
+	// worker dispatches the second one once it has expired
+	assert_int_equal (rb_http_handler_set_opt (handler,
+	                  "RB_HTTP_MAX_BYTES_PER_SEC", "1", err, sizeof(err)), 0);
+	rb_http_handler_run (handler);
+	assert_int_equal (rb_http_produce (handler, (char *)"{}", 2, 0, err,
+	                  sizeof(err), NULL), 0);
+	assert_int_equal (rb_http_produce_ttl (handler, (char *)"{}", 2, 0, 10,
+	                  err, sizeof(err), NULL), 0);
+
+	expired = 0;
+	assert_int_equal (rb_http_flush (handler, expired_report, 5000), 0);
+	assert_int_equal (expired, 1);
+
+	rb_http_handler_destroy (handler, err, sizeof(err));
+	rb_http_runtime_destroy (runtime);
+}
+
+static void test_rb_http_handler_report_fd (void **state) {
+	(void) state;
+
+	struct rb_http_handler_s *handler = NULL;
+	char err[BUFSIZ];
+	int fd = -1;
+
+	handler = rb_http_handler_create("http://localhost:8080/librb-http", err,
+	                                 sizeof(err));
+	assert_non_null (handler);
+	assert_int_equal (handler->report_fd, -1);
+
+	fd = rb_http_get_report_fd (handler);
+	assert_true (fd >= 0);
+	assert_int_equal (rb_http_get_report_fd (handler), fd);
+
+	rb_http_handler_destroy (handler, err, sizeof(err));
+}
+
+static void test_rb_http_handler_report_consumers (void **state) {
+	(void) state;
+
+	struct rb_http_handler_s *handler = NULL;
+	char err[BUFSIZ];
+
+	handler = rb_http_handler_create("http://localhost:8080/librb-http", err,
+	                                 sizeof(err));
+	assert_non_null (handler);
+
+	// Nothing to report, so consumers return without waiting
+	assert_int_equal (rb_http_get_reports_consumer (handler, NULL, 0, 0, 2), 0);
+	assert_int_equal (rb_http_get_reports_consumer (handler, NULL, 0, 1, 2), 0);
+	assert_int_equal (rb_http_get_reports (handler, NULL, 10), 0);
+	assert_int_equal (handler->reports_waiting, 0);
+
+	rb_http_handler_destroy (handler, err, sizeof(err));
+}
+
+static int inline_status = 0;
+static pthread_t inline_thread;
+
+static void inline_report (struct rb_http_handler_s *handler, int status_code,
+                           long http_code, const char *status_code_str,
+                           char *buff, size_t bufsiz, void *opaque) {
+	(void) handler;
+	(void) http_code;
+	(void) buff;
+	(void) bufsiz;
+	(void) opaque;
+
+	assert_string_equal (status_code_str, rb_http_strerror (status_code));
+	inline_thread = pthread_self ();
+	__atomic_store_n (&inline_status, status_code, __ATOMIC_RELEASE);
+}
+
+static void test_rb_http_handler_inline_reports (void **state) {
+	(void) state;
+
+	struct rb_http_handler_s *handler = NULL;
+	char err[BUFSIZ];
+	int i = 0;
+
+	handler = rb_http_handler_create("http://127.0.0.1:1/librb-http", err,
+	                                 sizeof(err));
+	assert_non_null (handler);
+	rb_http_handler_set_inline_reports (handler, inline_report);
+	rb_http_handler_run (handler);
+
+	// The connection is refused, and the worker reports it right away,
+	// without going through the reports queue
+	assert_int_equal (rb_http_produce (handler, (char *)"{}", 2, 0, err,
+	                  sizeof(err), NULL), 0);
+	for (i = 0; i < 1000 && __atomic_load_n (&inline_status,
+	                                         __ATOMIC_ACQUIRE) == 0; i++) {
+		usleep (1000);
+	}
+	assert_int_equal (inline_status, CURLE_COULDNT_CONNECT);
+	assert_false (pthread_equal (inline_thread, pthread_self ()));
+
+	reported = 0;
+	assert_int_equal (rb_http_get_reports (handler, count_report, 0), 0);
+	assert_int_equal (reported, 0);
+
+	rb_http_handler_destroy (handler, err, sizeof(err));
+}
+
+// Takes the status of each message from a character of the body
+static int response_parser (struct rb_http_handler_s *handler, long http_code,
+                            const char *body, size_t len, int *status,
+                            size_t nmessages, void *opaque) {
+	size_t i = 0;
+
+	(void) handler;
+	(void) opaque;
+
+	if (http_code != 207 || len != nmessages) {
+		return -1;
+	}
+
+	for (i = 0; i < nmessages; i++) {
+		status[i] = body[i] == 'R' ? RB_HTTP_ERR_RETRY
+		          : body[i] == 'X' ? RB_HTTP_ERR_REJECTED : 0;
+	}
+
+	return 0;
+}
+
+static void test_rb_http_handler_response_parser (void **state) {
+	(void) state;
+
+	struct rb_http_handler_s *handler = NULL;
+	struct rb_http_threaddata_s *threaddata = NULL;
+	struct rb_http_message_s messages[4];
+	struct rb_http_message_s *message = NULL;
+	rb_http_msg_q_t msgs;
+	char err[BUFSIZ];
+	int i = 0;
+
+	handler = rb_http_handler_create("http://localhost:8080/librb-http", err,
+	                                 sizeof(err));
+	assert_non_null (handler);
+	assert_int_equal (rb_http_handler_set_opt (handler,
+	                  "RB_HTTP_MAX_RESPONSE_BYTES", "4096", err, sizeof(err)),
+	                  0);
+	assert_int_equal (rb_http_handler_set_opt (handler,
+	                  "RB_HTTP_MAX_MESSAGE_RETRIES", "1", err, sizeof(err)), 0);
+	rb_http_handler_set_response_parser (handler, response_parser, NULL);
+
+	threaddata = calloc (1, sizeof(*threaddata));
+	threaddata->rb_http_handler = handler;
+	threaddata->options = handler->options;
+	rb_http_lanes_init (&threaddata->lanes);
+
+	memset (messages, 0, sizeof(messages));
+	rb_http_msg_q_init (&msgs);
+	for (i = 0; i < 4; i++) {
+		rb_http_msg_q_add (&msgs, &messages[i]);
+	}
+
+	// Each message gets its own status, and retries go back to the queue
+	threaddata->response = strdup ("0RXR");
+	threaddata->response_len = 4;
+	rb_http_chunked_parse_response (threaddata, &msgs, 207);
+
+	assert_int_equal (rb_http_msg_q_cnt (&msgs), 2);
+	assert_ptr_equal (rb_http_msg_q_pop (&msgs), &messages[0]);
+	assert_ptr_equal (rb_http_msg_q_pop (&msgs), &messages[2]);
+	assert_int_equal (messages[0].status, 0);
+	assert_int_equal (messages[2].status, RB_HTTP_ERR_REJECTED);
+	for (i = 1; i < 4; i += 2) {
+		assert_ptr_equal (rb_http_lanes_pop (&threaddata->lanes, 0, 0),
+		                  &messages[i]);
+		assert_int_equal (messages[i].status, 0);
+		assert_int_equal (messages[i].retries, 1);
+	}
+
+	// Out of retries, the message is rejected and reported
+	rb_http_msg_q_add (&msgs, &messages[1]);
+	threaddata->response_len = 1;
+	memcpy (threaddata->response, "R", 1);
+	rb_http_chunked_parse_response (threaddata, &msgs, 207);
+	assert_int_equal (rb_http_lanes_cnt (&threaddata->lanes), 0);
+	message = rb_http_msg_q_pop (&msgs);
+	assert_ptr_equal (message, &messages[1]);
+	assert_int_equal (message->status, RB_HTTP_ERR_REJECTED);
+
+	// Responses the parser doesn't understand leave the POST status
+	messages[0].status = 0;
+	rb_http_msg_q_add (&msgs, &messages[0]);
+	rb_http_chunked_parse_response (threaddata, &msgs, 500);
+	assert_int_equal (messages[0].status, 0);
+	assert_int_equal (rb_http_msg_q_cnt (&msgs), 1);
+
+	rb_http_lanes_destroy (&threaddata->lanes);
+	free (threaddata->response);
+	free (threaddata);
+	rb_http_handler_destroy (handler, err, sizeof(err));
+}
+
+/**
+ * Compresses two messages into a POST body with the framing of the handler,
+ * closes it and inflates it back
+ * @return Bytes of the body
+ */
+static size_t framed_body (struct rb_http_handler_s *handler, char *body,
+                           size_t bodysiz) {
+	struct rb_http_threaddata_s *threaddata = NULL;
+	struct rb_http_message_s messages[2];
+	char chunk[256];
+	size_t writed = 0;
+	z_stream inflated;
+	int i = 0;
+
+	threaddata = calloc (1, sizeof(*threaddata));
+	threaddata->rb_http_handler = handler;
+	threaddata->options = handler->options;
+	threaddata->strm = calloc (1, sizeof(z_stream));
+	deflateInit (threaddata->strm, Z_DEFAULT_COMPRESSION);
+	threaddata->rfq_pending = calloc (1, sizeof(rb_http_msg_q_t));
+	rb_http_msg_q_init (threaddata->rfq_pending);
+
+	memset (messages, 0, sizeof(messages));
+	messages[0].payload = (char *)"{\"a\":1}";
+	messages[1].payload = (char *)"{\"b\":22}";
+	for (i = 0; i < 2; i++) {
+		messages[i].len = strlen (messages[i].payload);
+		rb_http_chunked_frame_message (threaddata, &messages[i]);
+		writed = rb_http_chunked_compress_message (threaddata, chunk,
+		                                           sizeof(chunk), writed);
+		assert_null (threaddata->message_left);
+		threaddata->current_messages++;
+	}
+	writed += rb_http_chunked_compress_close (threaddata, chunk + writed,
+	                                          sizeof(chunk) - writed);
+	assert_true (threaddata->frame_closed);
+	assert_int_equal (rb_http_msg_q_cnt (threaddata->rfq_pending), 2);
+
+	memset (&inflated, 0, sizeof(inflated));
+	inflateInit (&inflated);
+	inflated.next_in = (Bytef *)chunk;
+	inflated.avail_in = (uInt)writed;
+	inflated.next_out = (Bytef *)body;
+	inflated.avail_out = (uInt)bodysiz;
+	assert_int_equal (inflate (&inflated, Z_SYNC_FLUSH), Z_OK);
+	assert_int_equal (inflated.avail_in, 0);
+	inflateEnd (&inflated);
+
+	while (rb_http_msg_q_pop (threaddata->rfq_pending) != NULL);
+	free (threaddata->rfq_pending);
+	deflateEnd (threaddata->strm);
+	free (threaddata->strm);
+	free (threaddata);
+
+	return inflated.total_out;
+}
+
+static void test_rb_http_handler_framing (void **state) {
+	(void) state;
+
+	struct rb_http_handler_s *handler = NULL;
+	char body[256];
+	char err[BUFSIZ];
+	const char length_prefixed[] = "\0\0\0\x07{\"a\":1}\0\0\0\x08{\"b\":22}";
+
+	handler = rb_http_handler_create("http://localhost:8080/librb-http", err,
+	                                 sizeof(err));
+	assert_non_null (handler);
+
+	assert_int_equal (rb_http_handler_set_opt (handler, "RB_HTTP_FRAMING",
+	                  "0", err, sizeof(err)), 0);
+	assert_int_equal (framed_body (handler, body, sizeof(body)), 15);
+	assert_memory_equal (body, "{\"a\":1}{\"b\":22}", 15);
+
+	assert_int_equal (rb_http_handler_set_opt (handler, "RB_HTTP_FRAMING",
+	                  "1", err, sizeof(err)), 0);
+	assert_int_equal (framed_body (handler, body, sizeof(body)), 17);
+	assert_memory_equal (body, "{\"a\":1}\n{\"b\":22}\n", 17);
+
+	// The closing bracket is written when the body is closed
+	assert_int_equal (rb_http_handler_set_opt (handler, "RB_HTTP_FRAMING",
+	                  "2", err, sizeof(err)), 0);
+	assert_int_equal (framed_body (handler, body, sizeof(body)), 18);
+	assert_memory_equal (body, "[{\"a\":1},{\"b\":22}]", 18);
+
+	assert_int_equal (rb_http_handler_set_opt (handler, "RB_HTTP_FRAMING",
+	                  "3", err, sizeof(err)), 0);
+	assert_int_equal (framed_body (handler, body, sizeof(body)),
+	                  sizeof(length_prefixed) - 1);
+	assert_memory_equal (body, length_prefixed, sizeof(length_prefixed) - 1);
+
+	// Lengths that don't fit in the prefix are rejected when produced
+	assert_int_not_equal (rb_http_produce (handler, body,
+	                      (size_t)UINT32_MAX + 1, 0, err, sizeof(err), NULL),
+	                      0);
+
+	rb_http_handler_destroy (handler, err, sizeof(err));
+}
+
+/**
+ * Uploads a body to a destination that refuses connections
+ * @param  handler Handler with the fan-out options set
+ * @param  acked   1 if HTTP_URL acknowledged the body
+ * @return         rb_http_fanout_send() result
+ */
+static int fanout_quorum (struct rb_http_handler_s *handler, int acked) {
+	struct rb_http_threaddata_s *threaddata = NULL;
+	int ret = 0;
+
+	threaddata = calloc (1, sizeof(*threaddata));
+	threaddata->rb_http_handler = handler;
+	threaddata->options = handler->options;
+
+	rb_http_fanout_begin (threaddata, NULL);
+	rb_http_fanout_append (threaddata, "{}", 2);
+	ret = rb_http_fanout_send (threaddata, acked);
+	rb_http_fanout_finish (threaddata);
+	rb_http_fanout_destroy (threaddata);
+	free (threaddata);
+
+	return ret;
+}
+
+static void test_rb_http_handler_fanout_quorum (void **state) {
+	(void) state;
+
+	struct rb_http_handler_s *handler = NULL;
+	char err[BUFSIZ];
+	int ret = 0;
+
+	handler = rb_http_handler_create("http://localhost:8080/librb-http", err,
+	                                 sizeof(err));
+	assert_non_null (handler);
+	assert_int_equal (rb_http_handler_set_opt (handler, "RB_HTTP_FANOUT_URLS",
+	                  "http://127.0.0.1:1/librb-http", err, sizeof(err)), 0);
+	assert_int_equal (rb_http_handler_set_opt (handler,
+	                  "RB_HTTP_FANOUT_RETRIES", "0", err, sizeof(err)), 0);
+	handler->thread_running = 1;
+
+	// HTTP_URL acknowledged the body and the extra destination failed
+	assert_int_equal (rb_http_handler_set_opt (handler,
+	                  "RB_HTTP_FANOUT_QUORUM", "1", err, sizeof(err)), 0);
+	ret = fanout_quorum (handler, 1);
+	assert_int_equal (ret, 1);
+
+	assert_int_equal (rb_http_handler_set_opt (handler,
+	                  "RB_HTTP_FANOUT_QUORUM", "2", err, sizeof(err)), 0);
+	ret = fanout_quorum (handler, 1);
+	assert_int_equal (ret, 0);
+
+	// Uploads the quorum didn't wait for are still completed and counted
+	assert_int_equal (handler->fanout_stats[0].failed, 2);
+
+	// A failed POST to HTTP_URL is not acknowledged
+	assert_int_equal (rb_http_handler_set_opt (handler,
+	                  "RB_HTTP_FANOUT_QUORUM", "1", err, sizeof(err)), 0);
+	ret = fanout_quorum (handler, 0);
+	assert_int_equal (ret, 0);
+
+	handler->thread_running = 0;
+	rb_http_handler_destroy (handler, err, sizeof(err));
+}
+
+static void test_rb_http_lanes_steal (void **state) {
+	(void) state;
+
+	struct rb_http_lanes_s from, to;
+	struct rb_http_message_s messages[10];
+	struct rb_http_message_s *message = NULL;
+	const int kept[] = {0, 1, 2, 6, 7};
+	int i = 0;
+
+	rb_http_lanes_init (&from);
+	rb_http_lanes_init (&to);
+
+	// 6 normal messages, the last 2 with a key, and 2 priority ones
+	memset (messages, 0, sizeof(messages));
+	for (i = 0; i < 10; i++) {
+		messages[i].lane = i < 8 ? RB_HTTP_LANE_NORMAL
+		                         : RB_HTTP_LANE_PRIORITY;
+		messages[i].keyed = i == 6 || i == 7;
+		rb_http_lanes_add (&from, &messages[i]);
+	}
+
+	// Half of the queue at most, even if more is asked for
+	assert_int_equal (rb_http_lanes_steal (&from, &to, 100), 5);
+	assert_int_equal (rb_http_lanes_cnt (&from), 5);
+	assert_int_equal (rb_http_lanes_cnt (&to), 5);
+
+	// Priority messages first, then the tail of the normal lane without the
+	// keyed messages, in order
+	assert_ptr_equal (rb_http_lanes_pop (&to, 100, 0), &messages[8]);
+	assert_ptr_equal (rb_http_lanes_pop (&to, 100, 0), &messages[9]);
+	for (i = 3; i < 6; i++) {
+		assert_ptr_equal (rb_http_lanes_pop (&to, 100, 0), &messages[i]);
+	}
+
+	// Keyed messages stay with their worker
+	for (i = 0; (message = rb_http_lanes_pop (&from, 100, 0)) != NULL; i++) {
+		assert_ptr_equal (message, &messages[kept[i]]);
+	}
+	assert_int_equal (i, 5);
+
+	// No more than the max asked for
+	for (i = 0; i < 6; i++) {
+		messages[i].keyed = 0;
+		rb_http_lanes_add (&from, &messages[i]);
+	}
+	assert_int_equal (rb_http_lanes_steal (&from, &to, 2), 2);
+	assert_int_equal (rb_http_lanes_steal (&from, &to, 100), 2);
+	while (rb_http_lanes_pop (&from, 0, 0) != NULL);
+	while (rb_http_lanes_pop (&to, 0, 0) != NULL);
+
+	rb_http_lanes_destroy (&from);
+	rb_http_lanes_destroy (&to);
+}
+
+#define PARTITION_KEYS 10000
+
+static void test_rb_http_partition (void **state) {
+	(void) state;
+
+	char key[32];
+	int grown = 0, shrunk = 0;
+	int i = 0;
+
+	for (i = 0; i < PARTITION_KEYS; i++) {
+		const int len = snprintf (key, sizeof(key), "sensor-%d", i);
+		const uint64_t hash = rb_http_partition_hash (key, (size_t)len);
+		const int worker = rb_http_partition_worker (hash, 8);
+
+		// A key always lands on the same worker
+		assert_true (worker >= 0 && worker < 8);
+		assert_int_equal (rb_http_partition_hash (key, (size_t)len), hash);
+		assert_int_equal (rb_http_partition_worker (hash, 8), worker);
+
+		// Keys only move to the new worker, or from the removed one
+		if (rb_http_partition_worker (hash, 9) != worker) {
+			assert_int_equal (rb_http_partition_worker (hash, 9), 8);
+			grown++;
+		}
+		if (rb_http_partition_worker (hash, 7) != worker) {
+			assert_int_equal (worker, 7);
+			shrunk++;
+		}
+	}
+
+	// About 1/9 and 1/8 of the keys move
+	assert_true (grown > PARTITION_KEYS / 9 * 8 / 10 &&
+	             grown < PARTITION_KEYS / 9 * 12 / 10);
+	assert_true (shrunk > PARTITION_KEYS / 8 * 8 / 10 &&
+	             shrunk < PARTITION_KEYS / 8 * 12 / 10);
+}
+
+static void timer_cb (void *opaque) {
+	(*(int *)opaque)++;
+}
+
+static void test_rb_http_timer_wheel (void **state) {
+	(void) state;
+
+	struct rb_http_timer_wheel_s wheel;
+	struct rb_http_timer_s near, far;
+	int fired_near = 0, fired_far = 0;
+
+	rb_http_timer_wheel_init (&wheel, 1000);
+	rb_http_timer_init (&near, timer_cb, &fired_near);
+	rb_http_timer_init (&far, timer_cb, &fired_far);
+
+	rb_http_timer_add (&wheel, &near, 1010);
+	rb_http_timer_add (&wheel, &far, 1000 + 70000);
+	assert_int_equal (rb_http_timer_wheel_next (&wheel, 500), 10);
+
+	rb_http_timer_wheel_advance (&wheel, 1009);
+	assert_int_equal (fired_near, 0);
+	rb_http_timer_wheel_advance (&wheel, 1010);
+	assert_int_equal (fired_near, 1);
+	assert_false (rb_http_timer_pending (&near));
+
+	/* Far timers are cascaded down and fire on time */
+	rb_http_timer_wheel_advance (&wheel, 1000 + 69999);
+	assert_int_equal (fired_far, 0);
+	rb_http_timer_wheel_advance (&wheel, 1000 + 70000);
+	assert_int_equal (fired_far, 1);
+
+	/* Canceled timers don't fire */
+	rb_http_timer_add (&wheel, &near, wheel.now + 5);
+	rb_http_timer_cancel (&wheel, &near);
+	rb_http_timer_wheel_advance (&wheel, wheel.now + 10);
+	assert_int_equal (fired_near, 1);
+}
+
 int main (void) {
 
 	const struct CMUnitTest tests[] = {
 		cmocka_unit_test (test_rb_http_handler_url),
-		cmocka_unit_test (test_rb_http_handler_url_null)
+		cmocka_unit_test (test_rb_http_handler_url_null),
+		cmocka_unit_test (test_rb_http_handler_options),
+		cmocka_unit_test (test_rb_http_strerror),
+		cmocka_unit_test (test_rb_http_handler_resize),
+		cmocka_unit_test (test_rb_http_handler_retry_backoff),
+		cmocka_unit_test (test_rb_http_handler_stats),
+		cmocka_unit_test (test_rb_http_handler_options_version),
+		cmocka_unit_test (test_rb_http_handler_flush),
+		cmocka_unit_test (test_rb_http_handler_memory_budget),
+		cmocka_unit_test (test_rb_http_handler_payload_sources),
+		cmocka_unit_test (test_rb_http_handler_buffer_pool),
+		cmocka_unit_test (test_rb_http_handler_trace_ring),
+		cmocka_unit_test (test_rb_http_handler_rate_limit),
+		cmocka_unit_test (test_rb_http_handler_runtime),
+		cmocka_unit_test (test_rb_http_handler_report_fd),
+		cmocka_unit_test (test_rb_http_handler_report_consumers),
+		cmocka_unit_test (test_rb_http_handler_inline_reports),
+		cmocka_unit_test (test_rb_http_handler_response_parser),
+		cmocka_unit_test (test_rb_http_handler_framing),
+		cmocka_unit_test (test_rb_http_handler_fanout_quorum),
+		cmocka_unit_test (test_rb_http_lanes_steal),
+		cmocka_unit_test (test_rb_http_partition),
+		cmocka_unit_test (test_rb_http_timer_wheel)
 	};
 
 	return cmocka_run_group_tests (tests, NULL, NULL);